@@ -1,68 +1,155 @@
-#include "cell.h"
-
-Cell::Cell(std::string expression, const ISheet& sheet_) : raw_expression(expression), sheet(sheet_) {
-	if (raw_expression[0] == kFormulaSign) {
-		is_formula = true;
-		formula = ParseFormula(raw_expression.substr(1));
-	}
-	else {
-		is_formula = false;
-		if (raw_expression.size() > 0 && raw_expression[0] == kEscapeSign) {
-			value = raw_expression.substr(1);
-		}
-		else {
-			try {
-				value = std::stod(raw_expression);
-			}
-			catch (const std::invalid_argument& err) {
-				value = raw_expression;
-			}
-		}
-	}
-}
-
-void Cell::UpdateValueIfFormula() {
-	if (is_formula) {
-		auto formula_eval_res = formula.get()->Evaluate(sheet);
-		if (std::holds_alternative<double>(formula_eval_res)) {
-			value = std::get<double>(formula_eval_res);
-		}
-		else if (std::holds_alternative<FormulaError>(formula_eval_res)) {
-			value = std::get<FormulaError>(formula_eval_res);
-		}
-		raw_expression = "=" + formula.get()->GetExpression();
-	}
-}
-
-Cell::Value Cell::GetValue() const {
-	return value; 
-}
-
-std::string Cell::GetText() const { return raw_expression; }
-std::vector<Position> Cell::GetReferencedCells() const {
-	if (IsFormula()) {
-		return formula.get()->GetReferencedCells();
-	}
-	else {
-		return {};
-	}
-}
-
-bool Cell::IsFormula() const { return is_formula; }
-IFormula* Cell::GetFormula() { return formula.get(); }
-
-void Cell::SetValue(Value new_value) {
-	value = new_value;
-}
-
-void Cell::SetText(std::string new_text) {
-	raw_expression = new_text;
-}
-
-void Cell::AddDependentCell(const Position& pos) {
-	dependent.push_back(pos);
-}
-
-std::vector<Position>& Cell::GetDependentCells() {
-	return dependent;
-}
+#include "cell.h"
+#include <charconv>
+#include <cmath>
+
+namespace {
+	// Число, только если текст целиком - конечное десятичное число. В отличие
+	// от std::stod не бросает исключений и не принимает "3D" за 3
+	std::optional<double> ParseNumber(std::string_view text) {
+		if (!text.empty() && text[0] == '+') {
+			text.remove_prefix(1);
+			if (!text.empty() && text[0] == '-') {
+				return std::nullopt;
+			}
+		}
+		double number = 0.0;
+		auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+		if (error != std::errc() || end != text.data() + text.size() || !std::isfinite(number)) {
+			return std::nullopt;
+		}
+		return number;
+	}
+}
+
+Cell::Cell(std::string expression, const ISheet& sheet_) : sheet(sheet_), raw_expression(std::move(expression)) {
+	is_formula = raw_expression[0] == kFormulaSign;
+	if (is_formula) {
+		formula = ParseFormula(raw_expression.substr(1));
+		text_stale = true;
+	}
+	else {
+		SetValueFromText();
+	}
+}
+
+Cell::Cell(std::string expression, const ISheet& sheet_, Position pos, FormulaTemplateCache& templates)
+	: sheet(sheet_), raw_expression(std::move(expression)) {
+	is_formula = raw_expression[0] == kFormulaSign;
+	if (is_formula) {
+		formula = ParseFormula(raw_expression.substr(1), pos, templates);
+		text_stale = true;
+	}
+	else {
+		SetValueFromText();
+	}
+}
+
+Cell::Cell(std::string expression, const ISheet& sheet_, std::unique_ptr<IFormula> formula_)
+	: is_formula(formula_ != nullptr), sheet(sheet_), raw_expression(std::move(expression)), text_stale(is_formula), formula(std::move(formula_)) {
+	if (!is_formula) {
+		SetValueFromText();
+	}
+}
+
+void Cell::Deleter::operator()(Cell* cell) const {
+	cell->~Cell();
+	resource->deallocate(cell, sizeof(Cell), alignof(Cell));
+}
+
+Cell::Ptr Cell::TryCreate(std::pmr::memory_resource* resource, std::string expression, const ISheet& sheet, Position pos, FormulaTemplateCache& templates) {
+	std::unique_ptr<IFormula> formula;
+	if (expression[0] == kFormulaSign) {
+		formula = TryParseFormula(expression.substr(1), pos, templates);
+		if (formula == nullptr) {
+			return nullptr;
+		}
+	}
+	return Create(resource, std::move(expression), sheet, std::move(formula));
+}
+
+void Cell::SetValueFromText() {
+	if (raw_expression.size() > 0 && raw_expression[0] == kEscapeSign) {
+		SetValue(raw_expression.substr(1));
+	}
+	else if (auto number = ParseNumber(raw_expression)) {
+		SetValue(*number);
+	}
+	else {
+		SetValue(raw_expression);
+	}
+}
+
+void Cell::UpdateValueIfFormula() {
+	if (is_formula) {
+		auto formula_eval_res = formula.get()->Evaluate(sheet);
+		if (std::holds_alternative<double>(formula_eval_res)) {
+			SetValue(std::get<double>(formula_eval_res));
+		}
+		else if (std::holds_alternative<FormulaError>(formula_eval_res)) {
+			SetValue(std::get<FormulaError>(formula_eval_res));
+		}
+	}
+}
+
+Cell::Value Cell::GetValue() const {
+	return value; 
+}
+
+const Cell::Value& Cell::PeekValue() const {
+	return value;
+}
+
+EvalValue Cell::GetOperand() const {
+	return operand;
+}
+
+std::string Cell::GetText() const {
+	if (text_stale) {
+		raw_expression.assign(1, kFormulaSign);
+		formula->AppendExpression(raw_expression);
+		text_stale = false;
+	}
+	return raw_expression;
+}
+std::vector<Position> Cell::GetReferencedCells() const {
+	if (IsFormula()) {
+		return formula.get()->GetReferencedCells();
+	}
+	else {
+		return {};
+	}
+}
+
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+	if (IsFormula()) {
+		return formula.get()->GetReferencedRanges();
+	}
+	else {
+		return {};
+	}
+}
+
+bool Cell::IsFormula() const { return is_formula; }
+IFormula* Cell::GetFormula() { return formula.get(); }
+
+void Cell::SetValue(Value new_value) {
+	value = std::move(new_value);
+	operand = EvalValue::FromCellValue(value);
+}
+
+void Cell::SetText(std::string new_text) {
+	raw_expression = new_text;
+	text_stale = false;
+}
+
+void Cell::InvalidateText() {
+	text_stale = is_formula;
+}
+
+void Cell::MarkAsPlaceholder() {
+	is_placeholder = true;
+}
+
+bool Cell::IsPlaceholder() const {
+	return is_placeholder;
+}
\ No newline at end of file
@@ -1,28 +1,66 @@
-﻿#pragma once
-#include "formula.h"
-
-class Cell : public ICell {
-public:
-    using Value = std::variant<std::string, double, FormulaError>;
-    explicit Cell(std::string expression, const ISheet& sheet_);
-    Cell() = default;
-    Value GetValue() const;
-    void SetValue(Value new_value);
-    void SetText(std::string new_text);
-    std::string GetText() const;
-    std::vector<Position> GetReferencedCells() const;
-    bool IsFormula() const;
-    IFormula* GetFormula();
-    void AddDependentCell(const Position& pos);
-    std::vector<Position>& GetDependentCells();
-    void UpdateValueIfFormula();
-private:
-    bool is_formula;
-    const ISheet& sheet;
-    Value value;
-    std::string raw_expression;
-    std::unique_ptr<IFormula> formula;
-    std::vector<Position> dependent;
-};
-
+﻿#pragma once
+#include <memory_resource>
+#include "formula.h"
+#include "eval_value.h"
+
+class Cell : public ICell {
+public:
+    using Value = std::variant<std::string, double, FormulaError>;
+    // Ячейка листа размещается в его memory_resource и туда же возвращается
+    struct Deleter {
+        std::pmr::memory_resource* resource = nullptr;
+        void operator()(Cell* cell) const;
+    };
+    using Ptr = std::unique_ptr<Cell, Deleter>;
+    template <typename... Args>
+    static Ptr Create(std::pmr::memory_resource* resource, Args&&... args);
+    explicit Cell(std::string expression, const ISheet& sheet_);
+    Cell(std::string expression, const ISheet& sheet_, Position pos, FormulaTemplateCache& templates);
+    // Без исключений: nullptr, если текст начинается с '=' и не формула
+    static Ptr TryCreate(std::pmr::memory_resource* resource, std::string expression, const ISheet& sheet, Position pos, FormulaTemplateCache& templates);
+    Cell() = default;
+    Value GetValue() const;
+    // Без копирования строки; ссылка действительна до изменения ячейки
+    const Value& PeekValue() const;
+    // Закэшированное при изменении значения, без разбора текста и копий строк
+    EvalValue GetOperand() const;
+    void SetValue(Value new_value);
+    void SetText(std::string new_text);
+    // Текст формулы будет построен заново из выражения при следующем GetText
+    void InvalidateText();
+    std::string GetText() const;
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+    bool IsFormula() const;
+    IFormula* GetFormula();
+    void UpdateValueIfFormula();
+    // Пустая ячейка, созданная листом ради ссылки на неё из формулы
+    void MarkAsPlaceholder();
+    bool IsPlaceholder() const;
+private:
+    Cell(std::string expression, const ISheet& sheet_, std::unique_ptr<IFormula> formula_);
+    void SetValueFromText();
+
+    bool is_formula;
+    bool is_placeholder = false;
+    const ISheet& sheet;
+    Value value;
+    EvalValue operand;
+    mutable std::string raw_expression;
+    mutable bool text_stale = false;
+    std::unique_ptr<IFormula> formula;
+};
+
+template <typename... Args>
+Cell::Ptr Cell::Create(std::pmr::memory_resource* resource, Args&&... args) {
+    void* memory = resource->allocate(sizeof(Cell), alignof(Cell));
+    try {
+        return Ptr(new (memory) Cell(std::forward<Args>(args)...), Deleter{ resource });
+    }
+    catch (...) {
+        resource->deallocate(memory, sizeof(Cell), alignof(Cell));
+        throw;
+    }
+}
+
 std::ostream& operator<<(std::ostream& stream, const Cell::Value& value);
\ No newline at end of file
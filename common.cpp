@@ -1,103 +1,145 @@
-#include "common.h"
-#include "sheet.h"
-
-using namespace std;
-
-bool Position::operator==(const Position& rhs) const { return row == rhs.row && col == rhs.col; }
-bool Position::operator<(const Position& rhs) const { return make_pair(row, col) < make_pair(rhs.row, rhs.col); }
-bool Position::IsValid() const { return 0 <= row && row < kMaxRows && 0 <= col && col < kMaxCols; }
-
-string Position::ToString() const {
-    string str;
-    if (!IsValid()) {
-        return str;
-    }
-
-    int tmp_col = col;
-
-    while (tmp_col > 25) {
-        str.push_back('A' + tmp_col % 26);
-        tmp_col = tmp_col / 26 - 1;
-    }
-
-    str.push_back('A' + tmp_col);
-    reverse(str.begin(), str.end());
-
-    str += to_string(row + 1);
-
-    return str;
-}
-
-static string_view::iterator cell_name_partition_point(string_view sv) {
-    if (sv.size() < 2 || !isalpha(sv[0])) {
-        return sv.end();
-    }
-
-    bool valid = is_partitioned(sv.begin(), sv.end(), [](const char c) { return isupper(c); });
-    auto it = partition_point(sv.begin(), sv.end(), [](const char c) { return isupper(c); });
-    valid &= all_of(it, sv.end(), [](const char c) { return isdigit(c); });
-    if (valid) {
-        return it;
-    }
-
-    return sv.end();
-}
-
-Position Position::FromString(string_view sv) {
-    Position pos{ 0, 0 };
-
-    auto point_it = cell_name_partition_point(sv);
-
-    if (point_it == sv.end()) {
-        pos.row = -1;
-        pos.col = -1;
-        return pos;
-    }
-
-    
-    pos.row = atoi(string(point_it, sv.end()).c_str()) - 1;  // possible UB
-
-    string_view columns_view = sv.substr(0, distance(sv.begin(), point_it));
-    int power = 1;
-    for (int i = columns_view.size() - 1; i >= 0; i--) {
-        if (power == 1) {
-            pos.col = columns_view[i] - 'A';
-        }
-        else {
-            pos.col += (1 + columns_view[i] - 'A') * power;
-        }
-        power *= 26;
-    };
-
-    return pos;
-}
-
-bool Size::operator==(const Size& rhs) const {
-    return rows == rhs.rows && cols == rhs.cols;
-}
-
-FormulaError::FormulaError(Category category) : category_(category) {}
-FormulaError::Category FormulaError::GetCategory() const { return category_; }
-bool FormulaError::operator==(FormulaError rhs) const { return category_ == rhs.category_; }
-std::string_view FormulaError::ToString() const {
-    switch (category_) {
-    case Category::Ref:
-        return "#REF!";
-    case Category::Div0:
-        return "#DIV/0!";
-    case Category::Value:
-        return "#VALUE!";
-    default:
-        return "";
-    }
-}
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    output << fe.ToString();
-    return output;
-}
-
-std::unique_ptr<ISheet> CreateSheet() {
-    return std::make_unique<Sheet>();
-}
-
+#include "common.h"
+#include "sheet.h"
+#include "eval_value.h"
+
+#include <array>
+#include <charconv>
+
+using namespace std;
+
+namespace {
+    struct ColumnName {
+        char letters[3] = {};
+        uint8_t length = 0;
+    };
+
+    constexpr std::array<ColumnName, Position::kMaxCols> MakeColumnNames() {
+        std::array<ColumnName, Position::kMaxCols> names{};
+        for (int col = 0; col < Position::kMaxCols; ++col) {
+            char reversed[3] = {};
+            uint8_t length = 0;
+            for (int n = col + 1; n > 0; n = (n - 1) / 26) {
+                reversed[length++] = static_cast<char>('A' + (n - 1) % 26);
+            }
+            for (uint8_t i = 0; i < length; ++i) {
+                names[col].letters[i] = reversed[length - 1 - i];
+            }
+            names[col].length = length;
+        }
+        return names;
+    }
+
+    constexpr std::array<ColumnName, Position::kMaxCols> kColumnNames = MakeColumnNames();
+}
+
+bool Position::operator<(const Position& rhs) const { return make_pair(row, col) < make_pair(rhs.row, rhs.col); }
+
+char* Position::ToChars(char* first, char* last) const {
+    if (!IsValid()) {
+        return first;
+    }
+    const ColumnName& name = kColumnNames[col];
+    if (last - first <= name.length) {
+        return first;
+    }
+    char* letters_end = copy_n(name.letters, name.length, first);
+    auto [digits_end, error] = to_chars(letters_end, last, row + 1);
+    if (error != errc()) {
+        return first;
+    }
+    return digits_end;
+}
+
+string Position::ToString() const {
+    char buffer[kMaxNameLength];
+    return string(buffer, ToChars(buffer, buffer + kMaxNameLength));
+}
+
+bool CellRange::operator==(const CellRange& rhs) const { return first == rhs.first && last == rhs.last; }
+bool CellRange::IsValid() const { return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col; }
+
+bool CellRange::Contains(const Position& pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+string CellRange::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    char buffer[2 * Position::kMaxNameLength + 1];
+    char* const buffer_end = buffer + sizeof(buffer);
+    char* name_end = first.ToChars(buffer, buffer_end);
+    *name_end++ = ':';
+    return string(buffer, last.ToChars(name_end, buffer_end));
+}
+
+bool Size::operator==(const Size& rhs) const {
+    return rows == rhs.rows && cols == rhs.cols;
+}
+
+FormulaError::FormulaError(Category category) : category_(category) {}
+FormulaError::Category FormulaError::GetCategory() const { return category_; }
+bool FormulaError::operator==(FormulaError rhs) const { return category_ == rhs.category_; }
+std::string_view FormulaError::ToString() const {
+    switch (category_) {
+    case Category::Ref:
+        return "#REF!";
+    case Category::Div0:
+        return "#DIV/0!";
+    case Category::Value:
+        return "#VALUE!";
+    default:
+        return "";
+    }
+}
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe) {
+    output << fe.ToString();
+    return output;
+}
+
+void RangeSummary::Add(double value) {
+    sum += value;
+    ++count;
+    min = std::min(min, value);
+    max = std::max(max, value);
+}
+
+void RangeSummary::Add(const RangeSummary& rhs) {
+    sum += rhs.sum;
+    count += rhs.count;
+    min = std::min(min, rhs.min);
+    max = std::max(max, rhs.max);
+    if (!first_error) {
+        first_error = rhs.first_error;
+    }
+}
+
+EvalValue ICell::GetOperand() const {
+    return EvalValue::FromCellValue(GetValue());
+}
+
+RangeSummary ISheet::SummarizeRange(const CellRange& range) const {
+    RangeSummary summary;
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            const ICell* cell = GetCell({ row, col });
+            if (cell == nullptr) {
+                continue;
+            }
+            auto value = cell->GetValue();
+            if (std::holds_alternative<double>(value)) {
+                summary.Add(std::get<double>(value));
+            }
+            else if (std::holds_alternative<FormulaError>(value) && !summary.first_error) {
+                summary.first_error = std::get<FormulaError>(value);
+            }
+        }
+    }
+    return summary;
+}
+
+std::unique_ptr<ISheet> CreateSheet() {
+    return std::make_unique<Sheet>();
+}
+
@@ -1,119 +1,199 @@
-#pragma once
-#include <iosfwd>
-#include <memory>
-#include <stdexcept>
-#include <string>
-#include <string_view>
-#include <variant>
-#include <vector>
-#include <iostream>
-#include <algorithm>
-#include <sstream>
-
-
-struct Position {
-    int row = 0;
-    int col = 0;
-    bool operator==(const Position& rhs) const;
-    bool operator<(const Position& rhs) const;
-    bool IsValid() const;
-    std::string ToString() const;
-    static Position FromString(std::string_view str);
-    static const int kMaxRows = 16384;
-    static const int kMaxCols = 16384;
-};
-
-
-struct Size {
-    int rows = 0;
-    int cols = 0;
-    bool operator==(const Size& rhs) const;
-};
-
-
-class FormulaError {
-public:
-    enum class Category { Ref, Value, Div0,};
-    FormulaError(Category category);
-    Category GetCategory() const;
-    bool operator==(FormulaError rhs) const;
-    std::string_view ToString() const;
-private:
-    Category category_;
-};
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe);
-
-
-class InvalidPositionException : public std::out_of_range {
-public:
-    using std::out_of_range::out_of_range;
-};
-
-
-class FormulaException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-
-class CircularDependencyException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-
-class TableTooBigException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-
-class ICell {
-public:
-    using Value = std::variant<std::string, double, FormulaError>;
-    virtual ~ICell() = default;
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-inline constexpr char kFormulaSign = '=';
-inline constexpr char kEscapeSign = '\'';
-
-
-class ISheet {
-public:
-    virtual ~ISheet() = default;
-    virtual void SetCell(Position pos, std::string text) = 0;
-    virtual const ICell* GetCell(Position pos) const = 0;
-    virtual ICell* GetCell(Position pos) = 0;
-    virtual void ClearCell(Position pos) = 0;
-    virtual void InsertRows(int before, int count = 1) = 0;
-    virtual void InsertCols(int before, int count = 1) = 0;
-    virtual void DeleteRows(int first, int count = 1) = 0;
-    virtual void DeleteCols(int first, int count = 1) = 0;
-    virtual Size GetPrintableSize() const = 0;
-    virtual void PrintValues(std::ostream& output) const = 0;
-    virtual void PrintTexts(std::ostream& output) const = 0;
-};
-
-
-std::unique_ptr<ISheet> CreateSheet();
-
-
-class IFormula {
-public:
-    using Value = std::variant<double, FormulaError>;
-    enum class HandlingResult { NothingChanged, ReferencesRenamedOnly, ReferencesChanged };
-    virtual ~IFormula() = default;
-    virtual Value Evaluate(const ISheet& sheet) const = 0;
-    virtual std::string GetExpression() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-    virtual HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
-    virtual HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
-    virtual HandlingResult HandleDeletedRows(int first, int count = 1) = 0;
-    virtual HandlingResult HandleDeletedCols(int first, int count = 1) = 0;
-};
-
-std::unique_ptr<IFormula> ParseFormula(std::string expression);
+#pragma once
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <sstream>
+
+
+struct Position {
+    int row = 0;
+    int col = 0;
+    constexpr bool operator==(const Position& rhs) const { return row == rhs.row && col == rhs.col; }
+    bool operator<(const Position& rhs) const;
+    constexpr bool IsValid() const { return 0 <= row && row < kMaxRows && 0 <= col && col < kMaxCols; }
+    std::string ToString() const;
+    // Пишет имя ячейки в [first, last) без выделения памяти, как std::to_chars.
+    // Возвращает конец записанного или first, если позиция некорректна или буфер мал
+    char* ToChars(char* first, char* last) const;
+    static constexpr Position FromString(std::string_view str);
+    static const int kMaxRows = 16384;
+    static const int kMaxCols = 16384;
+    static const size_t kMaxNameLength = 8;  // XFD16384
+};
+
+constexpr Position Position::FromString(std::string_view str) {
+    const Position invalid{ -1, -1 };
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && 'A' <= str[i] && str[i] <= 'Z'; ++i) {
+        col = col * 26 + (str[i] - 'A' + 1);
+        if (col > kMaxCols) {
+            return invalid;
+        }
+    }
+    if (i == 0 || i == str.size()) {
+        return invalid;
+    }
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (str[i] < '0' || '9' < str[i]) {
+            return invalid;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > kMaxRows) {
+            return invalid;
+        }
+    }
+    if (row == 0) {
+        return invalid;
+    }
+    return { row - 1, col - 1 };
+}
+
+struct PositionHasher {
+    size_t operator()(const Position& pos) const {
+        return static_cast<size_t>(pos.row) * Position::kMaxCols + pos.col;
+    }
+};
+
+
+struct CellRange {
+    Position first;
+    Position last;
+    bool operator==(const CellRange& rhs) const;
+    bool IsValid() const;
+    bool Contains(const Position& pos) const;
+    std::string ToString() const;
+};
+
+
+struct Size {
+    int rows = 0;
+    int cols = 0;
+    bool operator==(const Size& rhs) const;
+};
+
+
+class FormulaError {
+public:
+    enum class Category { Ref, Value, Div0,};
+    FormulaError(Category category);
+    Category GetCategory() const;
+    bool operator==(FormulaError rhs) const;
+    std::string_view ToString() const;
+private:
+    Category category_;
+};
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe);
+
+
+// Сводка по числовым значениям диапазона для агрегатных функций; текст и
+// пустые ячейки пропускаются, запоминается первая ошибка по столбцам
+struct RangeSummary {
+    double sum = 0.0;
+    int count = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::optional<FormulaError> first_error;
+    void Add(double value);
+    void Add(const RangeSummary& rhs);
+};
+
+
+class InvalidPositionException : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+
+class FormulaException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class CircularDependencyException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исход изменения ячейки для методов без исключений; каждой ошибке
+// соответствует исключение из методов, которые их бросают
+enum class CellStatus { Ok, InvalidPosition, InvalidFormula, CircularDependency };
+
+// Тип значения ячейки при чтении диапазона в плотные буферы
+enum class CellValueType : unsigned char { Empty, Number, Text, Error };
+
+
+class EvalValue;
+
+class ICell {
+public:
+    using Value = std::variant<std::string, double, FormulaError>;
+    virtual ~ICell() = default;
+    virtual Value GetValue() const = 0;
+    virtual std::string GetText() const = 0;
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Значение как операнд формулы (см. eval_value.h)
+    virtual EvalValue GetOperand() const;
+};
+
+inline constexpr char kFormulaSign = '=';
+inline constexpr char kEscapeSign = '\'';
+
+
+class ISheet {
+public:
+    virtual ~ISheet() = default;
+    virtual void SetCell(Position pos, std::string text) = 0;
+    virtual const ICell* GetCell(Position pos) const = 0;
+    virtual ICell* GetCell(Position pos) = 0;
+    virtual void ClearCell(Position pos) = 0;
+    virtual void InsertRows(int before, int count = 1) = 0;
+    virtual void InsertCols(int before, int count = 1) = 0;
+    virtual void DeleteRows(int first, int count = 1) = 0;
+    virtual void DeleteCols(int first, int count = 1) = 0;
+    virtual Size GetPrintableSize() const = 0;
+    virtual void PrintValues(std::ostream& output) const = 0;
+    virtual void PrintTexts(std::ostream& output) const = 0;
+    virtual RangeSummary SummarizeRange(const CellRange& range) const;
+};
+
+
+std::unique_ptr<ISheet> CreateSheet();
+
+
+class IFormula {
+public:
+    using Value = std::variant<double, FormulaError>;
+    enum class HandlingResult { NothingChanged, ReferencesRenamedOnly, ReferencesChanged };
+    virtual ~IFormula() = default;
+    virtual Value Evaluate(const ISheet& sheet) const = 0;
+    virtual std::string GetExpression() const = 0;
+    virtual void AppendExpression(std::string& out) const { out += GetExpression(); }
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual std::vector<CellRange> GetReferencedRanges() const { return {}; }
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1) = 0;
+};
+
+std::unique_ptr<IFormula> ParseFormula(std::string expression);
+// Разбор без исключений для массового ввода: nullptr, если текст не формула
+std::unique_ptr<IFormula> TryParseFormula(std::string expression);
@@ -0,0 +1,326 @@
+#include "concurrent_sheet.h"
+#include "eval_value.h"
+#include <algorithm>
+
+SheetView::CellSnapshot::CellSnapshot(const Cell& cell)
+	: value(cell.GetValue())
+	, text(cell.GetText())
+	, is_formula(cell.IsFormula())
+	, is_placeholder(cell.IsPlaceholder())
+	, referenced_cells(cell.GetReferencedCells()) {
+}
+
+ICell::Value SheetView::CellSnapshot::GetValue() const {
+	return value;
+}
+
+EvalValue SheetView::CellSnapshot::GetOperand() const {
+	return EvalValue::FromCellValue(value);
+}
+
+std::string SheetView::CellSnapshot::GetText() const {
+	return text;
+}
+
+std::vector<Position> SheetView::CellSnapshot::GetReferencedCells() const {
+	return referenced_cells;
+}
+
+bool SheetView::CellSnapshot::IsFormula() const {
+	return is_formula;
+}
+
+bool SheetView::CellSnapshot::IsPlaceholder() const {
+	return is_placeholder;
+}
+
+int SheetView::GetChildIndex(int row, int level) {
+	return (row >> ((kDepth - 1 - level) * kBranchingBits)) & (kBranching - 1);
+}
+
+const SheetView::Row* SheetView::GetRow(int row) const {
+	const Node* node = root.get();
+	for (int level = 0; node != nullptr && level + 1 < kDepth; ++level) {
+		node = node->children[GetChildIndex(row, level)].get();
+	}
+	if (node == nullptr) {
+		return nullptr;
+	}
+	return node->rows[GetChildIndex(row, kDepth - 1)].get();
+}
+
+SheetView::NodePtr SheetView::SetRow(const Node* node, int level, int row, RowPtr row_data) {
+	auto copy = node != nullptr ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+	int index = GetChildIndex(row, level);
+	bool empty = true;
+	if (level + 1 == kDepth) {
+		copy->rows.resize(kBranching);
+		copy->rows[index] = std::move(row_data);
+		empty = std::all_of(begin(copy->rows), end(copy->rows), [](const RowPtr& ptr) { return ptr == nullptr; });
+	}
+	else {
+		copy->children.resize(kBranching);
+		copy->children[index] = SetRow(copy->children[index].get(), level + 1, row, std::move(row_data));
+		empty = std::all_of(begin(copy->children), end(copy->children), [](const NodePtr& ptr) { return ptr == nullptr; });
+	}
+	if (empty) {
+		return nullptr;
+	}
+	return copy;
+}
+
+void SheetView::SetRow(int row, RowPtr row_data) {
+	if (row_data == nullptr && GetRow(row) == nullptr) {
+		return;
+	}
+	root = SetRow(root.get(), 0, row, std::move(row_data));
+}
+
+void SheetView::CollectChangedRows(const Node* lhs, const Node* rhs, int level, int prefix, std::vector<int>& rows) {
+	if (lhs == rhs) {
+		return;
+	}
+	for (int i = 0; i < kBranching; ++i) {
+		int child_prefix = (prefix << kBranchingBits) | i;
+		if (level + 1 == kDepth) {
+			const Row* lhs_row = lhs != nullptr ? lhs->rows[i].get() : nullptr;
+			const Row* rhs_row = rhs != nullptr ? rhs->rows[i].get() : nullptr;
+			if (lhs_row != rhs_row) {
+				rows.push_back(child_prefix);
+			}
+		}
+		else {
+			CollectChangedRows(
+				lhs != nullptr ? lhs->children[i].get() : nullptr,
+				rhs != nullptr ? rhs->children[i].get() : nullptr,
+				level + 1, child_prefix, rows);
+		}
+	}
+}
+
+std::vector<int> SheetView::GetChangedRows(const SheetView& other) const {
+	std::vector<int> rows;
+	CollectChangedRows(root.get(), other.root.get(), 0, 0, rows);
+	return rows;
+}
+
+const SheetView::CellSnapshot* SheetView::FindCell(Position pos) const {
+	const Row* row = GetRow(pos.row);
+	if (row == nullptr) {
+		return nullptr;
+	}
+	auto it = row->find(pos.col);
+	if (it == end(*row)) {
+		return nullptr;
+	}
+	return &it->second;
+}
+
+const ICell* SheetView::GetCell(Position pos) const {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException("invalid position: " + pos.ToString());
+	}
+	return FindCell(pos);
+}
+
+Size SheetView::GetPrintableSize() const {
+	return size;
+}
+
+uint64_t SheetView::GetVersion() const {
+	return version;
+}
+
+void SheetView::PrintValues(std::ostream& output) const {
+	for (int r = 0; r < size.rows; ++r) {
+		int blank_cells = 0;
+		for (int c = 0; c < size.cols; ++c) {
+			auto cell = FindCell({ r, c });
+			if (cell == nullptr) {
+				++blank_cells;
+				continue;
+			}
+			if (cell->IsFormula()) {
+				output << cell->GetValue();
+			}
+			else {
+				output << cell->GetText();
+			}
+			if (c + 1 != size.cols) {
+				output << '\t';
+			}
+		}
+		if (blank_cells == size.cols) {
+			output << '\t';
+		}
+		output << '\n';
+	}
+}
+
+void SheetView::PrintTexts(std::ostream& output) const {
+	for (int r = 0; r < size.rows; ++r) {
+		int blank_cells = 0;
+		for (int c = 0; c < size.cols; ++c) {
+			auto cell = FindCell({ r, c });
+			if (cell == nullptr) {
+				++blank_cells;
+				continue;
+			}
+			output << cell->GetText();
+			if (c + 1 != size.cols) {
+				output << '\t';
+			}
+		}
+		if (blank_cells == size.cols) {
+			output << '\t';
+		}
+		output << '\n';
+	}
+}
+
+ConcurrentSheet::ConcurrentSheet(size_t max_history)
+	: view(std::make_shared<SheetView>())
+	, history{ view }
+	, max_history(std::max<size_t>(max_history, 1)) {
+	sheet.TrackChanges(true);
+}
+
+Sheet& ConcurrentSheet::GetSheet() {
+	return sheet;
+}
+
+std::shared_ptr<const SheetView> ConcurrentSheet::GetView() const {
+	return std::atomic_load(&view);
+}
+
+std::shared_ptr<const SheetView::Row> ConcurrentSheet::SnapshotRow(int row) const {
+	const Sheet::Row* sheet_row = sheet.GetRow(row);
+	if (sheet_row == nullptr) {
+		return nullptr;
+	}
+	auto snapshot = std::make_shared<SheetView::Row>();
+	for (const auto& item : *sheet_row) {
+		if (item.second != nullptr) {
+			snapshot->emplace(item.first, SheetView::CellSnapshot(*item.second));
+		}
+	}
+	if (snapshot->empty()) {
+		return nullptr;
+	}
+	return snapshot;
+}
+
+void ConcurrentSheet::Publish(std::shared_ptr<const SheetView> next) {
+	// view меняет только писатель, поэтому читать его здесь можно без атомарной загрузки
+	std::atomic_store(&view, std::move(next));
+}
+
+void ConcurrentSheet::Commit() {
+	auto next = std::make_shared<SheetView>();
+	next->version = ++last_version;
+	next->size = sheet.GetPrintableSize();
+
+	auto changed_rows = sheet.TakeChangedRows();
+	if (changed_rows.has_value()) {
+		next->root = view->root;
+	}
+	else {
+		changed_rows = sheet.GetRowIndexes();
+	}
+	for (int row : *changed_rows) {
+		next->SetRow(row, SnapshotRow(row));
+	}
+
+	history.resize(history_position + 1);
+	history.push_back(next);
+	if (history.size() > max_history) {
+		history.erase(begin(history));
+	}
+	history_position = history.size() - 1;
+	Publish(std::move(next));
+}
+
+void ConcurrentSheet::Restore(const std::shared_ptr<const SheetView>& target) {
+	std::vector<int> rows;
+	auto uncommitted_rows = sheet.TakeChangedRows();
+	if (uncommitted_rows.has_value()) {
+		rows = view->GetChangedRows(*target);
+		rows.insert(end(rows), begin(*uncommitted_rows), end(*uncommitted_rows));
+	}
+	else {
+		rows = target->GetChangedRows(SheetView());
+		auto sheet_rows = sheet.GetRowIndexes();
+		rows.insert(end(rows), begin(sheet_rows), end(sheet_rows));
+	}
+	std::sort(begin(rows), end(rows));
+	rows.erase(std::unique(begin(rows), end(rows)), end(rows));
+
+	// пересчёт не нужен: значения формул берутся из версии
+	const Sheet::CalculationMode mode = sheet.GetCalculationMode();
+	sheet.SetCalculationMode(Sheet::CalculationMode::Manual);
+	for (int row : rows) {
+		std::vector<int> cols;
+		if (const Sheet::Row* sheet_row = sheet.GetRow(row)) {
+			for (const auto& item : *sheet_row) {
+				if (item.second != nullptr) {
+					cols.push_back(item.first);
+				}
+			}
+		}
+		for (int col : cols) {
+			sheet.ClearCell({ row, col });
+		}
+	}
+	// сначала очищаем все изменённые ячейки, чтобы промежуточные состояния
+	// были подмножеством целевого и не образовывали циклов
+	std::vector<std::pair<Position, std::string>> cells;
+	for (int row : rows) {
+		if (const SheetView::Row* target_row = target->GetRow(row)) {
+			for (const auto& item : *target_row) {
+				if (!item.second.IsPlaceholder()) {
+					cells.push_back({ { row, item.first }, item.second.GetText() });
+				}
+			}
+		}
+	}
+	sheet.SetCells(std::move(cells));
+	for (int row : rows) {
+		if (const SheetView::Row* target_row = target->GetRow(row)) {
+			for (const auto& item : *target_row) {
+				Position pos{ row, item.first };
+				if (!item.second.IsPlaceholder()) {
+					sheet.GetCell(pos)->SetValue(item.second.GetValue());
+					sheet.OnCellChanged(pos);
+				}
+				else if (sheet.GetCell(pos) == nullptr) {
+					// формула, ссылающаяся на заглушку, могла остаться в неизменённой строке
+					sheet.CreatePlaceholder(pos);
+				}
+			}
+		}
+	}
+	// в автоматическом режиме версия содержит актуальные значения, в остальных
+	// формулы остаются грязными до пересчёта
+	if (mode == Sheet::CalculationMode::Automatic) {
+		sheet.DiscardDirty();
+	}
+	sheet.SetCalculationMode(mode);
+	sheet.TakeChangedRows();
+	Publish(target);
+}
+
+bool ConcurrentSheet::Undo() {
+	if (history_position == 0) {
+		return false;
+	}
+	Restore(history[--history_position]);
+	return true;
+}
+
+bool ConcurrentSheet::Redo() {
+	if (history_position + 1 >= history.size()) {
+		return false;
+	}
+	Restore(history[++history_position]);
+	return true;
+}
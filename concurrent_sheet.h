@@ -0,0 +1,95 @@
+#pragma once
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "sheet.h"
+
+// Неизменяемая версия листа. Строки хранятся в персистентном 32-арном
+// префиксном дереве: новая версия копирует только пути к изменённым строкам,
+// остальные поддеревья разделяются со старой. Значения формул хранятся
+// в версии, поэтому её чтение ничего не вычисляет
+class SheetView {
+public:
+	class CellSnapshot : public ICell {
+	public:
+		CellSnapshot(const Cell& cell);
+		Value GetValue() const override;
+		EvalValue GetOperand() const override;
+		std::string GetText() const override;
+		std::vector<Position> GetReferencedCells() const override;
+		bool IsFormula() const;
+		bool IsPlaceholder() const;
+	private:
+		Value value;
+		std::string text;
+		bool is_formula;
+		bool is_placeholder;
+		std::vector<Position> referenced_cells;
+	};
+	using Row = std::unordered_map<int, CellSnapshot>;
+
+	const ICell* GetCell(Position pos) const;
+	const Row* GetRow(int row) const;
+	Size GetPrintableSize() const;
+	void PrintValues(std::ostream& output) const;
+	void PrintTexts(std::ostream& output) const;
+	uint64_t GetVersion() const;
+
+	// строки, отличающиеся от other; общие поддеревья не просматриваются
+	std::vector<int> GetChangedRows(const SheetView& other) const;
+private:
+	static const int kBranchingBits = 5;
+	static const int kBranching = 1 << kBranchingBits;
+	static const int kDepth = 3;
+	static_assert(Position::kMaxRows <= (1 << (kDepth * kBranchingBits)), "rows do not fit into the tree");
+
+	struct Node;
+	using NodePtr = std::shared_ptr<const Node>;
+	using RowPtr = std::shared_ptr<const Row>;
+	struct Node {
+		// на нижнем уровне заполнен rows, на остальных - children
+		std::vector<NodePtr> children;
+		std::vector<RowPtr> rows;
+	};
+
+	const CellSnapshot* FindCell(Position pos) const;
+	void SetRow(int row, RowPtr row_data);
+	static NodePtr SetRow(const Node* node, int level, int row, RowPtr row_data);
+	static void CollectChangedRows(const Node* lhs, const Node* rhs, int level, int prefix, std::vector<int>& rows);
+	static int GetChildIndex(int row, int level);
+
+	NodePtr root;
+	Size size;
+	uint64_t version = 0;
+
+	friend class ConcurrentSheet;
+};
+
+// Лист с одним писателем и многими читателями. Писатель меняет собственный
+// Sheet и вызывает Commit; читатели берут последнюю опубликованную версию
+// и читают её без блокировок писателя. Опубликованные версии образуют
+// историю для Undo/Redo
+class ConcurrentSheet {
+public:
+	explicit ConcurrentSheet(size_t max_history = 256);
+
+	// только поток писателя
+	Sheet& GetSheet();
+	void Commit();
+	bool Undo();
+	bool Redo();
+
+	// любой поток
+	std::shared_ptr<const SheetView> GetView() const;
+private:
+	std::shared_ptr<const SheetView::Row> SnapshotRow(int row) const;
+	void Restore(const std::shared_ptr<const SheetView>& target);
+	void Publish(std::shared_ptr<const SheetView> next);
+
+	Sheet sheet;
+	std::shared_ptr<const SheetView> view;
+	std::vector<std::shared_ptr<const SheetView>> history;
+	size_t history_position = 0;
+	size_t max_history;
+	uint64_t last_version = 0;
+};
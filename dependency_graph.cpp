@@ -0,0 +1,248 @@
+#include "dependency_graph.h"
+#include <algorithm>
+
+namespace {
+	template <typename Map>
+	size_t GetMapMemoryUsage(const Map& map) {
+		size_t bytes = map.bucket_count() * sizeof(void*);
+		for (const auto& item : map) {
+			// узел: ключ, вектор и указатель на следующий
+			bytes += sizeof(item) + sizeof(void*) + item.second.capacity() * sizeof(item.second[0]);
+		}
+		return bytes;
+	}
+}
+
+std::pair<const DependencyGraph::Id*, const DependencyGraph::Id*> DependencyGraph::Adjacency::Find(Id vertex) const {
+	auto it = std::lower_bound(begin(vertices), end(vertices), vertex);
+	if (it == end(vertices) || *it != vertex) {
+		return { nullptr, nullptr };
+	}
+	size_t index = it - begin(vertices);
+	return { neighbours.data() + offsets[index], neighbours.data() + offsets[index + 1] };
+}
+
+size_t DependencyGraph::Adjacency::GetMemoryUsage() const {
+	return (vertices.capacity() + neighbours.capacity()) * sizeof(Id) + offsets.capacity() * sizeof(uint32_t);
+}
+
+DependencyGraph::Id DependencyGraph::ToId(const Position& pos) {
+	return static_cast<Id>(pos.row) * Position::kMaxCols + pos.col;
+}
+
+Position DependencyGraph::ToPosition(Id id) {
+	return { static_cast<int>(id / Position::kMaxCols), static_cast<int>(id % Position::kMaxCols) };
+}
+
+DependencyGraph::Adjacency DependencyGraph::Build(std::vector<std::pair<Id, Id>>& edges) {
+	std::sort(begin(edges), end(edges));
+	Adjacency adjacency;
+	adjacency.neighbours.reserve(edges.size());
+	for (const auto& [from, to] : edges) {
+		if (adjacency.vertices.empty() || adjacency.vertices.back() != from) {
+			adjacency.vertices.push_back(from);
+			adjacency.offsets.push_back(static_cast<uint32_t>(adjacency.neighbours.size()));
+		}
+		adjacency.neighbours.push_back(to);
+	}
+	adjacency.offsets.push_back(static_cast<uint32_t>(adjacency.neighbours.size()));
+	return adjacency;
+}
+
+size_t DependencyGraph::CountPrecedents(Id vertex) const {
+	auto it = forward_delta.find(vertex);
+	if (it != end(forward_delta)) {
+		return it->second.size();
+	}
+	auto [first, last] = forward.Find(vertex);
+	return last - first;
+}
+
+std::vector<DependencyGraph::Id> DependencyGraph::ToSortedIds(const std::vector<Position>& positions) {
+	std::vector<Id> ids;
+	ids.reserve(positions.size());
+	for (const auto& pos : positions) {
+		if (pos.IsValid()) {
+			ids.push_back(ToId(pos));
+		}
+	}
+	std::sort(begin(ids), end(ids));
+	ids.erase(std::unique(begin(ids), end(ids)), end(ids));
+	return ids;
+}
+
+void DependencyGraph::SetPrecedents(const Position& pos, std::vector<Position> precedents) {
+	Id vertex = ToId(pos);
+	std::vector<Id> ids = ToSortedIds(precedents);
+
+	auto delta_it = forward_delta.find(vertex);
+	if (delta_it == end(forward_delta)) {
+		// ячейка без ссылок остаётся без ссылок: буфер не растёт от правок значений
+		if (ids.empty() && CountPrecedents(vertex) == 0) {
+			return;
+		}
+		delta_it = forward_delta.emplace(vertex, std::vector<Id>{}).first;
+		auto [first, last] = forward.Find(vertex);
+		edge_count -= last - first;
+	}
+
+	// обратные рёбра добавляются только для новых ссылок; рёбра пропавших
+	// ссылок остаются в reverse_delta устаревшими
+	const std::vector<Id>& old_ids = delta_it->second;
+	size_t kept = 0;
+	for (Id precedent : ids) {
+		if (std::binary_search(begin(old_ids), end(old_ids), precedent)) {
+			++kept;
+		}
+		else {
+			reverse_delta[precedent].push_back(vertex);
+		}
+	}
+	stale_delta_edges += old_ids.size() - kept;
+	edge_count = edge_count - old_ids.size() + ids.size();
+	delta_it->second = std::move(ids);
+
+	if (forward_delta.size() + stale_delta_edges > kMinDeltaToRebuild + forward.neighbours.size() / 4) {
+		Rebuild();
+	}
+}
+
+void DependencyGraph::SetPrecedents(std::vector<std::pair<Position, std::vector<Position>>> batch) {
+	if (batch.size() < kMinDeltaToRebuild + forward.neighbours.size() / 4) {
+		for (auto& [pos, precedents] : batch) {
+			SetPrecedents(pos, std::move(precedents));
+		}
+		return;
+	}
+	// крупный пакет кладётся в буфер без обратных рёбер и сразу сливается
+	// с основой: перестройка строит обратную сторону из прямой
+	for (const auto& [pos, precedents] : batch) {
+		Id vertex = ToId(pos);
+		std::vector<Id> ids = ToSortedIds(precedents);
+		edge_count = edge_count - CountPrecedents(vertex) + ids.size();
+		forward_delta[vertex] = std::move(ids);
+	}
+	Rebuild();
+}
+
+void DependencyGraph::Remove(const Position& pos) {
+	SetPrecedents(pos, {});
+}
+
+void DependencyGraph::Clear() {
+	forward = {};
+	reverse = {};
+	forward_delta.clear();
+	reverse_delta.clear();
+	stale_delta_edges = 0;
+	edge_count = 0;
+}
+
+bool DependencyGraph::IsBaseEdgeAlive(Id dependent) const {
+	// рёбра переписанных ячеек в основе устарели, актуальные - в буфере
+	return forward_delta.empty() || forward_delta.count(dependent) == 0;
+}
+
+bool DependencyGraph::IsDeltaEdgeAlive(Id dependent, Id precedent) const {
+	const std::vector<Id>& precedents = forward_delta.at(dependent);
+	return std::binary_search(begin(precedents), end(precedents), precedent);
+}
+
+std::vector<Position> DependencyGraph::GetPrecedents(const Position& pos) const {
+	Id vertex = ToId(pos);
+	std::vector<Position> result;
+	auto delta_it = forward_delta.find(vertex);
+	if (delta_it != end(forward_delta)) {
+		for (Id precedent : delta_it->second) {
+			result.push_back(ToPosition(precedent));
+		}
+		return result;
+	}
+	auto [first, last] = forward.Find(vertex);
+	for (const Id* it = first; it != last; ++it) {
+		result.push_back(ToPosition(*it));
+	}
+	return result;
+}
+
+std::vector<Position> DependencyGraph::GetDependents(const Position& pos) const {
+	Id vertex = ToId(pos);
+	std::vector<Position> result;
+	auto [first, last] = reverse.Find(vertex);
+	for (const Id* it = first; it != last; ++it) {
+		if (IsBaseEdgeAlive(*it)) {
+			result.push_back(ToPosition(*it));
+		}
+	}
+	auto delta_it = reverse_delta.find(vertex);
+	if (delta_it == end(reverse_delta)) {
+		return result;
+	}
+	// ребро, удалённое и добавленное снова, встречается в буфере дважды
+	std::vector<Id> dependents;
+	for (Id dependent : delta_it->second) {
+		if (IsDeltaEdgeAlive(dependent, vertex)) {
+			dependents.push_back(dependent);
+		}
+	}
+	std::sort(begin(dependents), end(dependents));
+	dependents.erase(std::unique(begin(dependents), end(dependents)), end(dependents));
+	for (Id dependent : dependents) {
+		result.push_back(ToPosition(dependent));
+	}
+	return result;
+}
+
+bool DependencyGraph::HasDependents(const Position& pos) const {
+	Id vertex = ToId(pos);
+	auto [first, last] = reverse.Find(vertex);
+	for (const Id* it = first; it != last; ++it) {
+		if (IsBaseEdgeAlive(*it)) {
+			return true;
+		}
+	}
+	auto delta_it = reverse_delta.find(vertex);
+	if (delta_it == end(reverse_delta)) {
+		return false;
+	}
+	return std::any_of(begin(delta_it->second), end(delta_it->second), [this, vertex](Id dependent) {
+		return IsDeltaEdgeAlive(dependent, vertex);
+	});
+}
+
+size_t DependencyGraph::GetEdgeCount() const {
+	return edge_count;
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+	return forward.GetMemoryUsage() + reverse.GetMemoryUsage()
+		+ GetMapMemoryUsage(forward_delta) + GetMapMemoryUsage(reverse_delta);
+}
+
+void DependencyGraph::Rebuild() {
+	std::vector<std::pair<Id, Id>> edges;
+	edges.reserve(edge_count);
+	for (size_t i = 0; i < forward.vertices.size(); ++i) {
+		Id vertex = forward.vertices[i];
+		if (forward_delta.count(vertex) != 0) {
+			continue;
+		}
+		for (uint32_t j = forward.offsets[i]; j < forward.offsets[i + 1]; ++j) {
+			edges.push_back({ vertex, forward.neighbours[j] });
+		}
+	}
+	for (const auto& [vertex, precedents] : forward_delta) {
+		for (Id precedent : precedents) {
+			edges.push_back({ vertex, precedent });
+		}
+	}
+
+	forward = Build(edges);
+	for (auto& edge : edges) {
+		std::swap(edge.first, edge.second);
+	}
+	reverse = Build(edges);
+	forward_delta.clear();
+	reverse_delta.clear();
+	stale_delta_edges = 0;
+}
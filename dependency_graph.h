@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+
+// Граф ссылок формул между ячейками листа в обе стороны. Основа хранится
+// в сжатом построчном виде (CSR): отсортированные номера вершин, смещения
+// и общий массив соседей, без отдельного выделения памяти на ячейку.
+// Ячейки, переписанные после последней перестройки, лежат в буфере, и их
+// ссылки из буфера заменяют ссылки из основы. Замена ссылок стоит
+// O(степени): обратные рёбра буфера не ищутся и не удаляются, а
+// проверяются по прямым при чтении и отбрасываются при перестройке
+class DependencyGraph {
+public:
+	// Заменяет ссылки ячейки pos; пустой список удаляет её исходящие рёбра
+	void SetPrecedents(const Position& pos, std::vector<Position> precedents);
+	// То же для многих ячеек; пакет, сравнимый с графом, применяется одной
+	// перестройкой основы. Для повторённой ячейки действует последний список
+	void SetPrecedents(std::vector<std::pair<Position, std::vector<Position>>> batch);
+	void Remove(const Position& pos);
+	void Clear();
+	std::vector<Position> GetPrecedents(const Position& pos) const;
+	std::vector<Position> GetDependents(const Position& pos) const;
+	bool HasDependents(const Position& pos) const;
+	size_t GetEdgeCount() const;
+	// байты, занятые основой и буфером
+	size_t GetMemoryUsage() const;
+private:
+	// номер ячейки row * kMaxCols + col помещается в 32 бита
+	using Id = uint32_t;
+
+	struct Adjacency {
+		std::vector<Id> vertices;
+		std::vector<uint32_t> offsets;
+		std::vector<Id> neighbours;
+
+		std::pair<const Id*, const Id*> Find(Id vertex) const;
+		size_t GetMemoryUsage() const;
+	};
+
+	static Id ToId(const Position& pos);
+	static Position ToPosition(Id id);
+	static std::vector<Id> ToSortedIds(const std::vector<Position>& positions);
+	static Adjacency Build(std::vector<std::pair<Id, Id>>& edges);
+	size_t CountPrecedents(Id vertex) const;
+	bool IsBaseEdgeAlive(Id dependent) const;
+	bool IsDeltaEdgeAlive(Id dependent, Id precedent) const;
+	void Rebuild();
+
+	static const size_t kMinDeltaToRebuild = 64;
+
+	Adjacency forward;
+	Adjacency reverse;
+	// актуальные ссылки ячеек, переписанных после перестройки
+	std::unordered_map<Id, std::vector<Id>> forward_delta;
+	// обратные рёбра ячеек из forward_delta, в том числе устаревшие
+	std::unordered_map<Id, std::vector<Id>> reverse_delta;
+	size_t stale_delta_edges = 0;
+	size_t edge_count = 0;
+};
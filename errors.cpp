@@ -1,2 +1,2 @@
-#include "errors.h"
-
+#include "errors.h"
+
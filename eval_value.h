@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include "common.h"
+
+// Значение при вычислении формулы размером 8 байт: число или ошибка,
+// закодированная тихим NaN с особой полезной нагрузкой. Прочие NaN
+// приводятся к каноническому, поэтому с ошибками не совпадают
+class EvalValue {
+public:
+	EvalValue() = default;
+
+	EvalValue(double number) : bits(ToBits(number)) {
+		if (number != number) {
+			bits = kCanonicalNaN;
+		}
+	}
+
+	EvalValue(FormulaError::Category category) : bits(kErrorTag | static_cast<uint64_t>(category)) {}
+	EvalValue(FormulaError error) : EvalValue(error.GetCategory()) {}
+
+	bool IsError() const {
+		return (bits & ~kCategoryMask) == kErrorTag;
+	}
+
+	double GetNumber() const {
+		double number;
+		std::memcpy(&number, &bits, sizeof(number));
+		return number;
+	}
+
+	FormulaError GetError() const {
+		return static_cast<FormulaError::Category>(bits & kCategoryMask);
+	}
+
+	IFormula::Value ToValue() const {
+		if (IsError()) {
+			return GetError();
+		}
+		return GetNumber();
+	}
+
+	static EvalValue FromCell(const ICell* cell) {
+		return cell == nullptr ? EvalValue(0.0) : cell->GetOperand();
+	}
+
+	// Пустой текст - ноль, прочий текст - #VALUE!
+	static EvalValue FromCellValue(const ICell::Value& value) {
+		if (const double* number = std::get_if<double>(&value)) {
+			return *number;
+		}
+		if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+			return *error;
+		}
+		return std::get<std::string>(value).empty() ? EvalValue(0.0) : EvalValue(FormulaError::Category::Value);
+	}
+
+private:
+	static uint64_t ToBits(double number) {
+		uint64_t bits;
+		std::memcpy(&bits, &number, sizeof(bits));
+		return bits;
+	}
+
+	static constexpr uint64_t kCanonicalNaN = 0x7FF8000000000000ULL;
+	static constexpr uint64_t kErrorTag = 0x7FFAB0C000000000ULL;
+	static constexpr uint64_t kCategoryMask = 0xFF;
+
+	uint64_t bits = 0;
+};
+
+static_assert(sizeof(EvalValue) == sizeof(double), "EvalValue must stay a single machine word");
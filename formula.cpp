@@ -1,345 +1,1008 @@
-﻿#include "formula.h"
-#include "statement.h"
-
-Formula::Value Formula::Evaluate(const ISheet& sheet) const {
-    return statement.get()->Evaluate(sheet);
-}
-
-std::string Formula::GetExpression() const {
-    return statement.get()->ToString();
-}
-std::vector<Position> Formula::GetReferencedCells() const {
-    return references;
-}
-
-void Formula::ModifyStatementRowPositions(Ast::Statement* root, int before, int count) {
-    auto cell_op = dynamic_cast<Ast::CellOperation*>(root);
-    if (cell_op != nullptr) {
-        if (cell_op->pos.row >= before) {
-            cell_op->pos.row += count;
-        }
-        return;
-    }
-    auto binary_op = dynamic_cast<Ast::BinaryOperation*>(root);
-    if (binary_op != nullptr) {
-        ModifyStatementRowPositions(binary_op->lhs.get(), before, count);
-        ModifyStatementRowPositions(binary_op->rhs.get(), before, count);
-        return;
-    }
-    auto unary_op = dynamic_cast<Ast::UnaryOperation*>(root);
-    if (unary_op != nullptr) {
-        ModifyStatementRowPositions(unary_op->rhs.get(), before, count);
-        return;
-    }
-    auto parentesis_op = dynamic_cast<Ast::ParentesisOperation*>(root);
-    if (parentesis_op != nullptr) {
-        ModifyStatementRowPositions(parentesis_op->body.get(), before, count);
-        return;
-    }
-}
-
-Formula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
-    int n_of_changed = 0;
-    for (auto& pos : references) {
-        if (pos.row >= before) {
-            ++n_of_changed;
-            pos.row += count;
-        }
-    }
-    ModifyStatementRowPositions(statement.get(), before, count);
-
-    if (!n_of_changed) {
-        return HandlingResult::NothingChanged;
-    }
-    return HandlingResult::ReferencesRenamedOnly;  
-}
-
-void Formula::ModifyStatementColumnPositions(Ast::Statement* root, int before, int count) {
-    auto cell_op = dynamic_cast<Ast::CellOperation*>(root);
-    if (cell_op != nullptr) {
-        if (cell_op->pos.col >= before) {
-            cell_op->pos.col += count;
-        }
-        return;
-    }
-    auto binary_op = dynamic_cast<Ast::BinaryOperation*>(root);
-    if (binary_op != nullptr) {
-        ModifyStatementColumnPositions(binary_op->lhs.get(), before, count);
-        ModifyStatementColumnPositions(binary_op->rhs.get(), before, count);
-        return;
-    }
-    auto unary_op = dynamic_cast<Ast::UnaryOperation*>(root);
-    if (unary_op != nullptr) {
-        ModifyStatementColumnPositions(unary_op->rhs.get(), before, count);
-        return;
-    }
-    auto parentesis_op = dynamic_cast<Ast::ParentesisOperation*>(root);
-    if (parentesis_op != nullptr) {
-        ModifyStatementColumnPositions(parentesis_op->body.get(), before, count);
-        return;
-    }
-}
-
-Formula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
-    int n_of_changed = 0;
-    for (auto& pos : references) {
-        if (pos.col >= before) {
-            ++n_of_changed;
-            pos.col += count;
-        }
-    }
-    ModifyStatementColumnPositions(statement.get(), before, count);
-    if (!n_of_changed) {
-        return HandlingResult::NothingChanged;
-    }
-
-    return HandlingResult::ReferencesRenamedOnly;
-}
-
-void Formula::DeleteStatementRowPositions(Ast::Statement* root, int first, int count) {
-    auto cell_op = dynamic_cast<Ast::CellOperation*>(root);
-    if (cell_op != nullptr) {
-        if (cell_op->pos.row >= first + count) {
-            cell_op->pos.row -= count;
-            return;
-        }
-        if (cell_op->pos.row >= first) {
-            cell_op->pos.row = -1;
-            return;
-        }
-
-    }
-    auto binary_op = dynamic_cast<Ast::BinaryOperation*>(root);
-    if (binary_op != nullptr) {
-        DeleteStatementRowPositions(binary_op->lhs.get(), first, count);
-        DeleteStatementRowPositions(binary_op->rhs.get(), first, count);
-        return;
-    }
-    auto unary_op = dynamic_cast<Ast::UnaryOperation*>(root);
-    if (unary_op != nullptr) {
-        DeleteStatementRowPositions(unary_op->rhs.get(), first, count);
-        return;
-    }
-    auto parentesis_op = dynamic_cast<Ast::ParentesisOperation*>(root);
-    if (parentesis_op != nullptr) {
-        DeleteStatementRowPositions(parentesis_op->body.get(), first, count);
-        return;
-    }
-}
-void Formula::DeleteStatementColumnPositions(Ast::Statement* root, int first, int count) {
-    auto cell_op = dynamic_cast<Ast::CellOperation*>(root);
-    if (cell_op != nullptr) {
-        if (cell_op->pos.col >= first + count) {
-            cell_op->pos.col -= count;
-            return;
-        }
-        if (cell_op->pos.col >= first) {
-            cell_op->pos.col = -1;
-            return;
-        }
-        
-    }
-    auto binary_op = dynamic_cast<Ast::BinaryOperation*>(root);
-    if (binary_op != nullptr) {
-        DeleteStatementColumnPositions(binary_op->lhs.get(), first, count);
-        DeleteStatementColumnPositions(binary_op->rhs.get(), first, count);
-        return;
-    }
-    auto unary_op = dynamic_cast<Ast::UnaryOperation*>(root);
-    if (unary_op != nullptr) {
-        DeleteStatementColumnPositions(unary_op->rhs.get(), first, count);
-        return;
-    }
-    auto parentesis_op = dynamic_cast<Ast::ParentesisOperation*>(root);
-    if (parentesis_op != nullptr) {
-        DeleteStatementColumnPositions(parentesis_op->body.get(), first, count);
-        return;
-    }
-
-}
-Formula::HandlingResult Formula::HandleDeletedRows(int first, int count) {
-    int n_of_changed = 0;
-    int n_of_deleted = 0;
-    for (auto it = begin(references); it != end(references);) {
-        if (it->row >= first + count) {
-            ++n_of_changed;
-            it->row -= count;
-            ++it;
-            continue;
-        }
-        if (it->row >= first) {
-            ++n_of_deleted;
-            it = references.erase(it);
-            continue;
-        }
-        ++it;
-    }
-    DeleteStatementRowPositions(statement.get(), first, count);
-    if (n_of_deleted) {
-        return HandlingResult::ReferencesChanged;
-    }
-    else if (n_of_changed) {
-        return HandlingResult::ReferencesRenamedOnly;
-    }
-    else {
-        return HandlingResult::NothingChanged;
-    }
-}
-
-Formula::HandlingResult Formula::HandleDeletedCols(int first, int count) {
-    int n_of_changed = 0;
-    int n_of_deleted = 0;
-    for (auto it = begin(references); it != end(references);) {
-        if (it->col >= first + count) {
-            ++n_of_changed;
-            it->col -= count;
-            ++it;
-            continue;
-        }
-        if (it->col >= first) {
-            ++n_of_deleted;
-            it = references.erase(it);
-            continue;
-        }
-        ++it;
-    }
-    DeleteStatementColumnPositions(statement.get(), first, count);
-    if (n_of_deleted) {
-        return HandlingResult::ReferencesChanged;
-    }
-    else if (n_of_changed) {
-        return HandlingResult::ReferencesRenamedOnly;
-    }
-    else {
-        return HandlingResult::NothingChanged;
-    }
-}
-
-class BailErrorListener : public antlr4::BaseErrorListener {
-public:
-    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */, size_t /* line */,
-        size_t /* charPositionInLine */, const std::string& msg, std::exception_ptr /* e */
-    ) override {
-        throw FormulaException("Error when lexing: " + msg);
-    }
-};
-
-
-class StatementListener : public FormulaListener {
-    std::stack<std::unique_ptr<Ast::Statement>> statement_stack;
-    std::vector<Position> references;
-
-    virtual void enterMain(FormulaParser::MainContext* /*ctx*/) override {}
-    virtual void exitMain(FormulaParser::MainContext* /*ctx*/) override {}
-
-    virtual void enterUnaryOp(FormulaParser::UnaryOpContext* /*ctx*/) override {}
-    virtual void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        auto unary_op = std::make_unique<Ast::UnaryOperation>();
-        unary_op->operation_type = ctx->ADD() ? Ast::OperationType::Add : Ast::OperationType::Sub;
-        unary_op->rhs = std::move(statement_stack.top());
-        statement_stack.pop();
-        statement_stack.push(move(unary_op));
-    }
-
-    virtual void enterParens(FormulaParser::ParensContext* ctx) override {}
-    virtual void exitParens(FormulaParser::ParensContext* ctx) override  {
-        auto parentesis_op = std::make_unique<Ast::ParentesisOperation>();
-        parentesis_op->body = std::move(statement_stack.top());
-        statement_stack.pop();
-        statement_stack.push(std::move(parentesis_op));
-    }
-
-    virtual void enterLiteral(FormulaParser::LiteralContext* ctx) override  {}
-    virtual void exitLiteral(FormulaParser::LiteralContext* ctx) override  {
-        auto value_op = std::make_unique<Ast::ValueOperation>();
-        value_op->value = std::stod(ctx->NUMBER()->getText());
-        statement_stack.push(move(value_op));
-    }
-
-    virtual void enterCell(FormulaParser::CellContext* ctx) override {}
-    virtual void exitCell(FormulaParser::CellContext* ctx) override {
-        auto cell_op = std::make_unique<Ast::CellOperation>();
-        Position pos = Position::FromString(ctx->CELL()->getText());
-        cell_op.get()->pos = pos;
-        references.push_back(pos);
-        statement_stack.push(std::move(cell_op));
-    }
-
-    virtual void enterBinaryOp(FormulaParser::BinaryOpContext* ctx) override {}
-    virtual void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        auto binary_op = std::make_unique<Ast::BinaryOperation>();
-
-        auto rhs = std::move(statement_stack.top());
-        statement_stack.pop();
-        auto lhs = std::move(statement_stack.top());
-        statement_stack.pop();
-
-
-        if (ctx->ADD()) {
-            binary_op->operation_type = Ast::OperationType::Add;
-        }
-        else if (ctx->SUB()) {
-            binary_op->operation_type = Ast::OperationType::Sub;
-        }
-        else if (ctx->DIV()) {
-            binary_op->operation_type = Ast::OperationType::Div;
-        }
-        else {
-            binary_op->operation_type = Ast::OperationType::Mul;
-        }
-
-        binary_op->rhs = std::move(rhs);
-        binary_op->lhs = std::move(lhs);
-        statement_stack.push(std::move(binary_op));
-    }
-
-    virtual void enterEveryRule(antlr4::ParserRuleContext* /*ctx*/) override {}
-    virtual void exitEveryRule(antlr4::ParserRuleContext* /*ctx*/) override {}
-    virtual void visitTerminal(antlr4::tree::TerminalNode* /*node*/) override {}
-    virtual void visitErrorNode(antlr4::tree::ErrorNode* /*node*/) override {}
-public:
-    std::unique_ptr<Ast::Statement> GetResult() {
-        return std::move(statement_stack.top());
-    }
-    std::vector<Position> GetReferences() {
-        std::sort(begin(references), end(references));
-        references.erase(std::unique(begin(references), end(references)), end(references));
-        return std::move(references);
-    }
-};
-
-
-std::unique_ptr<IFormula> ParseFormula(std::string expression) {
-	antlr4::ANTLRInputStream input(expression);
-	FormulaLexer lexer(&input);
-    BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-	antlr4::CommonTokenStream tokens(&lexer);
-	FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<antlr4::BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-    antlr4::tree::ParseTree* tree;
-    try {
-        tree = parser.main();
-    }
-    catch (const std::exception& ex) {
-        throw FormulaException(ex.what());
-    }
-    
-    StatementListener statement_listener;
-    antlr4::tree::ParseTreeWalker::DEFAULT.walk(&statement_listener, tree);
-    
-    auto formula = std::make_unique<Formula>();
-    formula.get()->statement = statement_listener.GetResult();
-    formula.get()->references = statement_listener.GetReferences();
-
-    for (const auto& ref : formula.get()->references) {
-        if (!ref.IsValid()) {
-            throw FormulaException("invalid ref in formula");
-        }
-    }
-    
-    return formula;
-}
+﻿#include "formula.h"
+#include "statement.h"
+
+#include <charconv>
+#include <utility>
+
+std::shared_ptr<const FormulaTemplate> FormulaTemplateCache::Find(const std::string& key) const {
+    auto it = templates.find(key);
+    if (it == end(templates)) {
+        return nullptr;
+    }
+    return it->second.lock();
+}
+
+std::shared_ptr<const FormulaTemplate> FormulaTemplateCache::Insert(const std::string& key, std::shared_ptr<const FormulaTemplate> formula_template) {
+    auto& entry = templates[key];
+    if (auto existing = entry.lock()) {
+        return existing;
+    }
+    entry = formula_template;
+    if (templates.size() >= expired_check_size) {
+        RemoveExpired();
+    }
+    return formula_template;
+}
+
+void FormulaTemplateCache::Merge(const FormulaTemplateCache& other) {
+    for (const auto& [key, formula_template] : other.templates) {
+        if (auto live = formula_template.lock()) {
+            Insert(key, std::move(live));
+        }
+    }
+    texts.Merge(other.texts);
+}
+
+size_t FormulaTemplateCache::GetSize() const {
+    return templates.size();
+}
+
+FormulaTextCache& FormulaTemplateCache::GetTextCache() {
+    return texts;
+}
+
+const FormulaTextCache& FormulaTemplateCache::GetTextCache() const {
+    return texts;
+}
+
+void FormulaTemplateCache::RemoveExpired() {
+    for (auto it = begin(templates); it != end(templates);) {
+        if (it->second.expired()) {
+            it = templates.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    expired_check_size = std::max<size_t>(1024, templates.size() * 2);
+}
+
+namespace {
+    // Приблизительно: узлы дерева считаются по размеру самого крупного из них
+    size_t EstimateMemoryUsage(const std::string& expression, const FormulaTemplate& formula_template) {
+        return 2 * expression.size() + sizeof(FormulaTemplate) + 4 * sizeof(void*)
+            + formula_template.postorder.size() * (sizeof(Ast::FunctionOperation) + sizeof(const Ast::Statement*))
+            + formula_template.offsets.size() * sizeof(Position)
+            + formula_template.range_offsets.size() * sizeof(CellRange)
+            + formula_template.program.size() * sizeof(Ast::Instruction);
+    }
+}
+
+std::optional<FormulaTextCache::CachedTemplate> FormulaTextCache::Find(const std::string& expression) {
+    auto it = index.find(expression);
+    if (it == end(index)) {
+        ++stats.misses;
+        return std::nullopt;
+    }
+    ++stats.hits;
+    entries.splice(begin(entries), entries, it->second);
+    return it->second->cached;
+}
+
+void FormulaTextCache::Insert(const std::string& expression, CachedTemplate cached) {
+    size_t bytes = EstimateMemoryUsage(expression, *cached.formula_template);
+    if (bytes > memory_budget || index.count(expression) != 0) {
+        return;
+    }
+    auto it = index.emplace(expression, end(entries)).first;
+    entries.push_front({ &it->first, std::move(cached), bytes });
+    it->second = begin(entries);
+    stats.memory_usage += bytes;
+    EvictToBudget();
+}
+
+void FormulaTextCache::Merge(const FormulaTextCache& other) {
+    for (auto it = other.entries.rbegin(); it != other.entries.rend(); ++it) {
+        Insert(*it->expression, it->cached);
+    }
+    stats.hits += other.stats.hits;
+    stats.misses += other.stats.misses;
+    stats.evictions += other.stats.evictions;
+}
+
+void FormulaTextCache::SetMemoryBudget(size_t bytes) {
+    memory_budget = bytes;
+    EvictToBudget();
+}
+
+size_t FormulaTextCache::GetMemoryBudget() const {
+    return memory_budget;
+}
+
+FormulaTextCache::Stats FormulaTextCache::GetStats() const {
+    Stats result = stats;
+    result.entries = entries.size();
+    return result;
+}
+
+void FormulaTextCache::ResetStats() {
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+}
+
+void FormulaTextCache::EvictToBudget() {
+    while (stats.memory_usage > memory_budget) {
+        stats.memory_usage -= entries.back().bytes;
+        index.erase(*entries.back().expression);
+        entries.pop_back();
+        ++stats.evictions;
+    }
+}
+
+Formula::Formula(std::shared_ptr<const FormulaTemplate> formula_template_, Position anchor_)
+    : formula_template(std::move(formula_template_)), anchor(anchor_) {}
+
+Formula::Value Formula::Evaluate(const ISheet& sheet) const {
+    return Ast::Evaluate(formula_template->postorder, sheet, anchor).ToValue();
+}
+
+std::string Formula::GetExpression() const {
+    return formula_template->statement->ToString(anchor);
+}
+
+void Formula::AppendExpression(std::string& out) const {
+    formula_template->statement->AppendTo(out, anchor);
+}
+
+std::vector<Position> Formula::GetReferencedCells() const {
+    std::vector<Position> references;
+    references.reserve(formula_template->offsets.size());
+    for (const auto& offset : formula_template->offsets) {
+        references.push_back(Ast::Resolve(anchor, offset));
+    }
+    return references;
+}
+
+std::vector<CellRange> Formula::GetReferencedRanges() const {
+    std::vector<CellRange> ranges;
+    ranges.reserve(formula_template->range_offsets.size());
+    for (const auto& offsets : formula_template->range_offsets) {
+        ranges.push_back(Ast::Resolve(anchor, offsets));
+    }
+    return ranges;
+}
+
+const FormulaTemplate* Formula::GetTemplate() const {
+    return formula_template.get();
+}
+
+Position Formula::GetAnchor() const {
+    return anchor;
+}
+
+// Вставка или удаление строк/столбцов [first, first + count)
+struct Formula::StructuralEdit {
+    bool rows;
+    bool insertion;
+    int first;
+    int count;
+
+    int& Coordinate(Position& pos) const {
+        return rows ? pos.row : pos.col;
+    }
+
+    Position Move(Position pos) const {
+        int& coordinate = Coordinate(pos);
+        if (insertion) {
+            if (coordinate >= first) {
+                coordinate += count;
+            }
+        }
+        else if (coordinate >= first + count) {
+            coordinate -= count;
+        }
+        else if (coordinate >= first) {
+            coordinate = -1;
+        }
+        return pos;
+    }
+
+    // Удаление части диапазона сужает его, удаление целиком даёт nullopt
+    std::optional<CellRange> Move(CellRange range) const {
+        if (insertion) {
+            return CellRange{ Move(range.first), Move(range.last) };
+        }
+        int& low = Coordinate(range.first);
+        int& high = Coordinate(range.last);
+        low = low < first ? low : (low >= first + count ? low - count : first);
+        high = high < first ? high : (high >= first + count ? high - count : first - 1);
+        if (low > high) {
+            return std::nullopt;
+        }
+        return range;
+    }
+};
+
+namespace {
+    std::unique_ptr<Ast::Statement> MakeRefError() {
+        auto ref_error = std::make_unique<Ast::ValueOperation>();
+        ref_error->value = FormulaError::Category::Ref;
+        return ref_error;
+    }
+
+    // Копирует дерево, пересчитывая смещения ссылок; ссылки и диапазоны,
+    // которые map_offset/map_range не смогли перенести, заменяются на #REF!.
+    // Узлы строятся в обратном порядке обхода: потомки уже лежат на стеке
+    template <typename MapOffset, typename MapRange>
+    std::unique_ptr<Ast::Statement> RebuildStatement(const Ast::Statement* root, const MapOffset& map_offset, const MapRange& map_range) {
+        std::vector<std::unique_ptr<Ast::Statement>> built;
+        auto pop = [&built]() {
+            auto statement = std::move(built.back());
+            built.pop_back();
+            return statement;
+        };
+        for (const Ast::Statement* statement : Ast::Flatten(root)) {
+            switch (statement->Type()) {
+            case Ast::StatementType::Cell: {
+                auto new_offset = map_offset(static_cast<const Ast::CellOperation*>(statement)->offset);
+                if (!new_offset) {
+                    built.push_back(MakeRefError());
+                    break;
+                }
+                auto new_cell_op = std::make_unique<Ast::CellOperation>();
+                new_cell_op->offset = *new_offset;
+                built.push_back(std::move(new_cell_op));
+                break;
+            }
+            case Ast::StatementType::Range: {
+                auto new_offsets = map_range(static_cast<const Ast::RangeOperation*>(statement)->offsets);
+                if (!new_offsets) {
+                    built.push_back(MakeRefError());
+                    break;
+                }
+                auto new_range_op = std::make_unique<Ast::RangeOperation>();
+                new_range_op->offsets = *new_offsets;
+                built.push_back(std::move(new_range_op));
+                break;
+            }
+            case Ast::StatementType::Function: {
+                auto function_op = static_cast<const Ast::FunctionOperation*>(statement);
+                auto new_function_op = std::make_unique<Ast::FunctionOperation>();
+                new_function_op->function_type = function_op->function_type;
+                auto first_arg = built.end() - function_op->args.size();
+                new_function_op->args.assign(std::make_move_iterator(first_arg), std::make_move_iterator(built.end()));
+                built.erase(first_arg, built.end());
+                built.push_back(std::move(new_function_op));
+                break;
+            }
+            case Ast::StatementType::BinaryOperation: {
+                auto new_binary_op = std::make_unique<Ast::BinaryOperation>();
+                new_binary_op->operation_type = static_cast<const Ast::BinaryOperation*>(statement)->operation_type;
+                new_binary_op->rhs = pop();
+                new_binary_op->lhs = pop();
+                built.push_back(std::move(new_binary_op));
+                break;
+            }
+            case Ast::StatementType::UnaryOperation: {
+                auto new_unary_op = std::make_unique<Ast::UnaryOperation>();
+                new_unary_op->operation_type = static_cast<const Ast::UnaryOperation*>(statement)->operation_type;
+                new_unary_op->rhs = pop();
+                built.push_back(std::move(new_unary_op));
+                break;
+            }
+            case Ast::StatementType::Parentesis: {
+                auto new_parentesis_op = std::make_unique<Ast::ParentesisOperation>();
+                new_parentesis_op->body = pop();
+                built.push_back(std::move(new_parentesis_op));
+                break;
+            }
+            case Ast::StatementType::Value: {
+                auto new_value_op = std::make_unique<Ast::ValueOperation>();
+                new_value_op->value = static_cast<const Ast::ValueOperation*>(statement)->value;
+                built.push_back(std::move(new_value_op));
+                break;
+            }
+            }
+        }
+        return pop();
+    }
+
+    template <typename MapOffset, typename MapRange>
+    std::shared_ptr<FormulaTemplate> RebuildTemplate(const FormulaTemplate& formula_template, const MapOffset& map_offset, const MapRange& map_range) {
+        auto new_template = std::make_shared<FormulaTemplate>();
+        new_template->statement = RebuildStatement(formula_template.statement.get(), map_offset, map_range);
+        for (const auto& offset : formula_template.offsets) {
+            if (auto new_offset = map_offset(offset)) {
+                new_template->offsets.push_back(*new_offset);
+            }
+        }
+        for (const auto& offsets : formula_template.range_offsets) {
+            if (auto new_offsets = map_range(offsets)) {
+                new_template->range_offsets.push_back(*new_offsets);
+            }
+        }
+        new_template->postorder = Ast::Flatten(new_template->statement.get());
+        new_template->program = Ast::Compile(new_template->postorder);
+        return new_template;
+    }
+
+    // Тот же текст формулы в другой ячейке: ссылки указывают на те же
+    // ячейки, меняются только смещения от якоря
+    std::shared_ptr<FormulaTemplate> MoveAnchor(const FormulaTemplate& formula_template, Position from, Position to) {
+        auto map_offset = [from, to](Position offset) -> std::optional<Position> {
+            return Ast::Offset(to, Ast::Resolve(from, offset));
+        };
+        auto map_range = [from, to](const CellRange& offsets) -> std::optional<CellRange> {
+            return Ast::Offset(to, Ast::Resolve(from, offsets));
+        };
+        return RebuildTemplate(formula_template, map_offset, map_range);
+    }
+}
+
+// Якорь сдвигается вместе с ячейкой; шаблон копируется только если
+// изменились смещения ссылок относительно якоря
+Formula::HandlingResult Formula::HandleStructuralEdit(const StructuralEdit& edit) {
+    Position new_anchor = edit.Move(anchor);
+    if (!new_anchor.IsValid()) {
+        new_anchor = anchor;
+    }
+
+    auto map_offset = [&](Position offset) -> std::optional<Position> {
+        Position moved = edit.Move(Ast::Resolve(anchor, offset));
+        if (!moved.IsValid()) {
+            return std::nullopt;
+        }
+        return Ast::Offset(new_anchor, moved);
+    };
+    auto map_range = [&](const CellRange& offsets) -> std::optional<CellRange> {
+        auto moved = edit.Move(Ast::Resolve(anchor, offsets));
+        if (!moved || !moved->IsValid()) {
+            return std::nullopt;
+        }
+        return Ast::Offset(new_anchor, *moved);
+    };
+
+    int n_of_changed = 0;
+    int n_of_deleted = 0;
+    bool offsets_changed = false;
+    for (const auto& offset : formula_template->offsets) {
+        auto new_offset = map_offset(offset);
+        if (!new_offset) {
+            ++n_of_deleted;
+            offsets_changed = true;
+            continue;
+        }
+        if (!(Ast::Resolve(new_anchor, *new_offset) == Ast::Resolve(anchor, offset))) {
+            ++n_of_changed;
+        }
+        offsets_changed = offsets_changed || !(*new_offset == offset);
+    }
+    for (const auto& offsets : formula_template->range_offsets) {
+        auto new_offsets = map_range(offsets);
+        if (!new_offsets) {
+            ++n_of_deleted;
+            offsets_changed = true;
+            continue;
+        }
+        if (!(Ast::Resolve(new_anchor, *new_offsets) == Ast::Resolve(anchor, offsets))) {
+            ++n_of_changed;
+        }
+        offsets_changed = offsets_changed || !(*new_offsets == offsets);
+    }
+
+    if (offsets_changed) {
+        formula_template = RebuildTemplate(*formula_template, map_offset, map_range);
+    }
+    anchor = new_anchor;
+
+    if (n_of_deleted) {
+        return HandlingResult::ReferencesChanged;
+    }
+    else if (n_of_changed) {
+        return HandlingResult::ReferencesRenamedOnly;
+    }
+    else {
+        return HandlingResult::NothingChanged;
+    }
+}
+
+Formula::HandlingResult Formula::HandleInsertedRows(int before, int count) {
+    return HandleStructuralEdit({ true, true, before, count });
+}
+
+Formula::HandlingResult Formula::HandleInsertedCols(int before, int count) {
+    return HandleStructuralEdit({ false, true, before, count });
+}
+
+Formula::HandlingResult Formula::HandleDeletedRows(int first, int count) {
+    return HandleStructuralEdit({ true, false, first, count });
+}
+
+Formula::HandlingResult Formula::HandleDeletedCols(int first, int count) {
+    return HandleStructuralEdit({ false, false, first, count });
+}
+
+namespace {
+    // Как std::stod, но без исключений: nullopt, если число не помещается в double
+    std::optional<double> ParseNumberLiteral(std::string_view text) {
+        double number = 0.0;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+        if (error != std::errc() || end != text.data() + text.size()) {
+            return std::nullopt;
+        }
+        return number;
+    }
+}
+
+class BailErrorListener : public antlr4::BaseErrorListener {
+public:
+    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */, size_t /* line */,
+        size_t /* charPositionInLine */, const std::string& msg, std::exception_ptr /* e */
+    ) override {
+        throw FormulaException("Error when lexing: " + msg);
+    }
+};
+
+
+class StatementListener : public FormulaListener {
+    std::stack<std::unique_ptr<Ast::Statement>> statement_stack;
+    std::vector<Position> references;
+    std::vector<CellRange> ranges;
+    Position anchor;
+
+    virtual void enterMain(FormulaParser::MainContext* /*ctx*/) override {}
+    virtual void exitMain(FormulaParser::MainContext* /*ctx*/) override {}
+
+    virtual void enterUnaryOp(FormulaParser::UnaryOpContext* /*ctx*/) override {}
+    virtual void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        auto unary_op = std::make_unique<Ast::UnaryOperation>();
+        unary_op->operation_type = ctx->ADD() ? Ast::OperationType::Add : Ast::OperationType::Sub;
+        unary_op->rhs = std::move(statement_stack.top());
+        statement_stack.pop();
+        statement_stack.push(move(unary_op));
+    }
+
+    virtual void enterParens(FormulaParser::ParensContext* ctx) override {}
+    virtual void exitParens(FormulaParser::ParensContext* ctx) override  {
+        auto parentesis_op = std::make_unique<Ast::ParentesisOperation>();
+        parentesis_op->body = std::move(statement_stack.top());
+        statement_stack.pop();
+        statement_stack.push(std::move(parentesis_op));
+    }
+
+    virtual void enterLiteral(FormulaParser::LiteralContext* ctx) override  {}
+    virtual void exitLiteral(FormulaParser::LiteralContext* ctx) override  {
+        auto value_op = std::make_unique<Ast::ValueOperation>();
+        auto number = ParseNumberLiteral(ctx->NUMBER()->getText());
+        if (!number) {
+            throw FormulaException("number out of range: " + ctx->NUMBER()->getText());
+        }
+        value_op->value = *number;
+        statement_stack.push(move(value_op));
+    }
+
+    virtual void enterCell(FormulaParser::CellContext* ctx) override {}
+    virtual void exitCell(FormulaParser::CellContext* ctx) override {
+        auto cell_op = std::make_unique<Ast::CellOperation>();
+        Position pos = Position::FromString(ctx->CELL()->getText());
+        cell_op.get()->offset = Ast::Offset(anchor, pos);
+        references.push_back(pos);
+        statement_stack.push(std::move(cell_op));
+    }
+
+    virtual void enterFunction(FormulaParser::FunctionContext* ctx) override {}
+    virtual void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto function_type = Ast::FunctionFromName(ctx->NAME()->getText());
+        if (!function_type) {
+            throw FormulaException("unknown function: " + ctx->NAME()->getText());
+        }
+        auto function_op = std::make_unique<Ast::FunctionOperation>();
+        function_op->function_type = *function_type;
+        function_op->args.resize(ctx->arg().size());
+        for (auto it = function_op->args.rbegin(); it != function_op->args.rend(); ++it) {
+            *it = std::move(statement_stack.top());
+            statement_stack.pop();
+        }
+        statement_stack.push(std::move(function_op));
+    }
+
+    virtual void enterArg(FormulaParser::ArgContext* ctx) override {}
+    virtual void exitArg(FormulaParser::ArgContext* ctx) override {}
+
+    virtual void enterRange(FormulaParser::RangeContext* ctx) override {}
+    virtual void exitRange(FormulaParser::RangeContext* ctx) override {
+        Position first = Position::FromString(ctx->CELL(0)->getText());
+        Position last = Position::FromString(ctx->CELL(1)->getText());
+        CellRange range{
+            { std::min(first.row, last.row), std::min(first.col, last.col) },
+            { std::max(first.row, last.row), std::max(first.col, last.col) }
+        };
+        if (!first.IsValid() || !last.IsValid()) {
+            range = CellRange{ first, last };
+        }
+        auto range_op = std::make_unique<Ast::RangeOperation>();
+        range_op->offsets = Ast::Offset(anchor, range);
+        ranges.push_back(range);
+        statement_stack.push(std::move(range_op));
+    }
+
+    virtual void enterBinaryOp(FormulaParser::BinaryOpContext* ctx) override {}
+    virtual void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        auto binary_op = std::make_unique<Ast::BinaryOperation>();
+
+        auto rhs = std::move(statement_stack.top());
+        statement_stack.pop();
+        auto lhs = std::move(statement_stack.top());
+        statement_stack.pop();
+
+
+        if (ctx->ADD()) {
+            binary_op->operation_type = Ast::OperationType::Add;
+        }
+        else if (ctx->SUB()) {
+            binary_op->operation_type = Ast::OperationType::Sub;
+        }
+        else if (ctx->DIV()) {
+            binary_op->operation_type = Ast::OperationType::Div;
+        }
+        else {
+            binary_op->operation_type = Ast::OperationType::Mul;
+        }
+
+        binary_op->rhs = std::move(rhs);
+        binary_op->lhs = std::move(lhs);
+        statement_stack.push(std::move(binary_op));
+    }
+
+    virtual void enterEveryRule(antlr4::ParserRuleContext* /*ctx*/) override {}
+    virtual void exitEveryRule(antlr4::ParserRuleContext* /*ctx*/) override {}
+    virtual void visitTerminal(antlr4::tree::TerminalNode* /*node*/) override {}
+    virtual void visitErrorNode(antlr4::tree::ErrorNode* /*node*/) override {}
+public:
+    explicit StatementListener(Position anchor_) : anchor(anchor_) {}
+    std::unique_ptr<Ast::Statement> GetResult() {
+        return std::move(statement_stack.top());
+    }
+    std::vector<Position> GetReferences() {
+        std::sort(begin(references), end(references));
+        references.erase(std::unique(begin(references), end(references)), end(references));
+        return std::move(references);
+    }
+    std::vector<CellRange> GetRanges() {
+        auto range_less = [](const CellRange& lhs, const CellRange& rhs) {
+            return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.last < rhs.last);
+        };
+        std::sort(begin(ranges), end(ranges), range_less);
+        ranges.erase(std::unique(begin(ranges), end(ranges)), end(ranges));
+        return std::move(ranges);
+    }
+};
+
+
+namespace {
+    // Лексер и парсер ANTLR создаются один раз на поток и переустанавливаются
+    // на каждый текст: их конструкторы дороже разбора короткой формулы.
+    // Дерево разбора живёт до следующего вызова Parse в том же потоке
+    class ParserContext {
+    public:
+        ParserContext() : lexer(&input), tokens(&lexer), parser(&tokens) {
+            lexer.removeErrorListeners();
+            lexer.addErrorListener(&error_listener);
+            parser.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+            parser.removeErrorListeners();
+        }
+
+        // Сначала SLL, который быстрее и почти всегда достаточен; полный LL
+        // только если SLL не смог разобрать текст
+        antlr4::tree::ParseTree* Parse(const std::string& expression) {
+            input.load(expression);
+            lexer.setInputStream(&input);
+            tokens.setTokenSource(&lexer);
+            parser.setTokenStream(&tokens);
+            auto interpreter = parser.getInterpreter<antlr4::atn::ParserATNSimulator>();
+            interpreter->setPredictionMode(antlr4::atn::PredictionMode::SLL);
+            try {
+                return parser.main();
+            }
+            catch (const antlr4::ParseCancellationException&) {
+                parser.reset();
+                interpreter->setPredictionMode(antlr4::atn::PredictionMode::LL);
+                return parser.main();
+            }
+        }
+
+        static ParserContext& ForThisThread() {
+            thread_local ParserContext context;
+            return context;
+        }
+
+    private:
+        antlr4::ANTLRInputStream input;
+        FormulaLexer lexer;
+        BailErrorListener error_listener;
+        antlr4::CommonTokenStream tokens;
+        FormulaParser parser;
+    };
+
+    // Проверяет текст по грамматике Formula.g4 и ссылки в нём без ANTLR:
+    // ANTLR сообщает об ошибках исключениями, и на данных с множеством
+    // ошибок их раскрутка дороже самого разбора. Принимает ровно то, что
+    // принимает грамматика; TestCheckSyntaxMatchesGrammar сверяет их.
+    // Вложенность скобок - на явном стеке
+    bool CheckSyntax(std::string_view expression, std::string& error) {
+        enum class TokenType { Number, Cell, Name, LeftParen, RightParen, Sign, Operator, Colon, Comma, End, Invalid };
+        struct Token {
+            TokenType type;
+            std::string_view text;
+        };
+        size_t i = 0;
+        auto skip_digits = [&expression](size_t j) {
+            while (j < expression.size() && isdigit(static_cast<unsigned char>(expression[j]))) {
+                ++j;
+            }
+            return j;
+        };
+        auto next_token = [&]() -> Token {
+            while (i < expression.size() && std::string_view(" \t\n\r").find(expression[i]) != std::string_view::npos) {
+                ++i;
+            }
+            if (i == expression.size()) {
+                return { TokenType::End, {} };
+            }
+            const size_t begin = i;
+            const unsigned char c = expression[i];
+            if (isdigit(c) || c == '.') {
+                i = skip_digits(i);
+                if (i < expression.size() && expression[i] == '.' && i + 1 < expression.size()
+                    && isdigit(static_cast<unsigned char>(expression[i + 1]))) {
+                    i = skip_digits(i + 1);
+                }
+                else if (i == begin) {
+                    return { TokenType::Invalid, expression.substr(begin, 1) };
+                }
+                if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                    size_t j = i + 1;
+                    if (j < expression.size() && (expression[j] == '+' || expression[j] == '-')) {
+                        ++j;
+                    }
+                    if (skip_digits(j) > j) {
+                        i = skip_digits(j);
+                    }
+                }
+                return { TokenType::Number, expression.substr(begin, i - begin) };
+            }
+            if (isupper(c)) {
+                while (i < expression.size() && isupper(static_cast<unsigned char>(expression[i]))) {
+                    ++i;
+                }
+                size_t letters_end = i;
+                i = skip_digits(i);
+                return { i == letters_end ? TokenType::Name : TokenType::Cell, expression.substr(begin, i - begin) };
+            }
+            ++i;
+            switch (c) {
+            case '(': return { TokenType::LeftParen, expression.substr(begin, 1) };
+            case ')': return { TokenType::RightParen, expression.substr(begin, 1) };
+            case '+': case '-': return { TokenType::Sign, expression.substr(begin, 1) };
+            case '*': case '/': return { TokenType::Operator, expression.substr(begin, 1) };
+            case ':': return { TokenType::Colon, expression.substr(begin, 1) };
+            case ',': return { TokenType::Comma, expression.substr(begin, 1) };
+            default: return { TokenType::Invalid, expression.substr(begin, 1) };
+            }
+        };
+        auto fail = [&error](std::string message, const Token& token) {
+            error = std::move(message);
+            if (token.type != TokenType::End) {
+                error.append(token.text);
+            }
+            return false;
+        };
+        auto check_cell = [&](const Token& token) {
+            return Position::FromString(token.text).IsValid();
+        };
+
+        // открытые скобки: true - скобки аргументов функции
+        std::vector<bool> parens;
+        bool expect_operand = true;
+        // сразу после '(' функции или ',': здесь допустим диапазон
+        bool arg_start = false;
+        bool after_range = false;
+        for (Token token = next_token();; token = next_token()) {
+            if (token.type == TokenType::Invalid) {
+                return fail("unexpected character: ", token);
+            }
+            if (expect_operand) {
+                const bool at_arg_start = std::exchange(arg_start, false);
+                switch (token.type) {
+                case TokenType::Sign:
+                    continue;
+                case TokenType::LeftParen:
+                    parens.push_back(false);
+                    continue;
+                case TokenType::Number:
+                    if (!ParseNumberLiteral(token.text)) {
+                        return fail("number out of range: ", token);
+                    }
+                    break;
+                case TokenType::Cell: {
+                    if (!check_cell(token)) {
+                        return fail("invalid ref in formula: ", token);
+                    }
+                    if (!at_arg_start) {
+                        break;
+                    }
+                    size_t cell_end = i;
+                    Token colon = next_token();
+                    if (colon.type != TokenType::Colon) {
+                        i = cell_end;
+                        break;
+                    }
+                    Token last = next_token();
+                    if (last.type != TokenType::Cell) {
+                        return fail("expected cell after ':', got ", last);
+                    }
+                    if (!check_cell(last)) {
+                        return fail("invalid range in formula: ", last);
+                    }
+                    after_range = true;
+                    break;
+                }
+                case TokenType::Name:
+                    if (!Ast::FunctionFromName(token.text)) {
+                        return fail("unknown function: ", token);
+                    }
+                    if (next_token().type != TokenType::LeftParen) {
+                        return fail("expected '(' after function ", token);
+                    }
+                    parens.push_back(true);
+                    arg_start = true;
+                    continue;
+                default:
+                    return fail("unexpected token: ", token);
+                }
+                expect_operand = false;
+                continue;
+            }
+
+            const bool range_ends_arg = std::exchange(after_range, false);
+            switch (token.type) {
+            case TokenType::Sign:
+            case TokenType::Operator:
+                if (range_ends_arg) {
+                    return fail("unexpected token after range: ", token);
+                }
+                expect_operand = true;
+                break;
+            case TokenType::RightParen:
+                if (parens.empty()) {
+                    return fail("unexpected token: ", token);
+                }
+                parens.pop_back();
+                break;
+            case TokenType::Comma:
+                if (parens.empty() || !parens.back()) {
+                    return fail("unexpected token: ", token);
+                }
+                expect_operand = true;
+                arg_start = true;
+                break;
+            case TokenType::End:
+                if (!parens.empty()) {
+                    return fail("unexpected end of formula", token);
+                }
+                return true;
+            default:
+                return fail("unexpected token: ", token);
+            }
+        }
+    }
+
+    // Разбор ANTLR без предварительной проверки; nullptr и причина в error,
+    // если текст не формула
+    std::shared_ptr<FormulaTemplate> BuildFormulaTemplate(const std::string& expression, Position anchor, std::string& error) {
+        auto formula_template = std::make_shared<FormulaTemplate>();
+        std::vector<Position> references;
+        std::vector<CellRange> ranges;
+        try {
+            antlr4::tree::ParseTree* tree = ParserContext::ForThisThread().Parse(expression);
+            // цепочка A1+A2+...+An даёт дерево разбора глубины n
+            StatementListener statement_listener(anchor);
+            antlr4::tree::IterativeParseTreeWalker walker;
+            walker.walk(&statement_listener, tree);
+            formula_template->statement = statement_listener.GetResult();
+            references = statement_listener.GetReferences();
+            ranges = statement_listener.GetRanges();
+        }
+        catch (const std::exception& ex) {
+            error = ex.what();
+            return nullptr;
+        }
+
+        for (const auto& ref : references) {
+            if (!ref.IsValid()) {
+                error = "invalid ref in formula";
+                return nullptr;
+            }
+            formula_template->offsets.push_back(Ast::Offset(anchor, ref));
+        }
+        for (const auto& range : ranges) {
+            if (!range.IsValid()) {
+                error = "invalid range in formula";
+                return nullptr;
+            }
+            formula_template->range_offsets.push_back(Ast::Offset(anchor, range));
+        }
+        formula_template->postorder = Ast::Flatten(formula_template->statement.get());
+        formula_template->program = Ast::Compile(formula_template->postorder);
+
+        return formula_template;
+    }
+
+    // Ошибки в тексте находит CheckSyntax, до ANTLR они не доходят
+    std::shared_ptr<FormulaTemplate> ParseFormulaTemplate(const std::string& expression, Position anchor, std::string& error) {
+        if (!CheckSyntax(expression, error)) {
+            return nullptr;
+        }
+        return BuildFormulaTemplate(expression, anchor, error);
+    }
+
+    size_t SkipNumber(std::string_view expression, size_t i) {
+        auto skip_digits = [&](size_t j) {
+            while (j < expression.size() && isdigit(static_cast<unsigned char>(expression[j]))) {
+                ++j;
+            }
+            return j;
+        };
+        i = skip_digits(i);
+        if (i < expression.size() && expression[i] == '.') {
+            i = skip_digits(i + 1);
+        }
+        if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+            size_t j = i + 1;
+            if (j < expression.size() && (expression[j] == '+' || expression[j] == '-')) {
+                ++j;
+            }
+            size_t exponent_end = skip_digits(j);
+            if (exponent_end > j) {
+                i = exponent_end;
+            }
+        }
+        return i;
+    }
+
+    // Ключ шаблона: текст формулы, в котором имена ячеек заменены смещениями
+    // {dr,dc} от якоря, а имена функций сохранены как есть. Лексический проход
+    // без ANTLR; nullopt, если в тексте есть символы вне грамматики или
+    // некорректные ссылки
+    std::optional<std::string> MakeTemplateKey(std::string_view expression, Position anchor) {
+        std::string key;
+        key.reserve(expression.size() + 16);
+        size_t i = 0;
+        while (i < expression.size()) {
+            const unsigned char c = expression[i];
+            if (isdigit(c) || c == '.') {
+                size_t number_end = std::max(SkipNumber(expression, i), i + 1);
+                key.append(expression.substr(i, number_end - i));
+                i = number_end;
+            }
+            else if (isupper(c)) {
+                size_t letters_end = i;
+                while (letters_end < expression.size() && isupper(static_cast<unsigned char>(expression[letters_end]))) {
+                    ++letters_end;
+                }
+                size_t cell_end = letters_end;
+                while (cell_end < expression.size() && isdigit(static_cast<unsigned char>(expression[cell_end]))) {
+                    ++cell_end;
+                }
+                if (cell_end == letters_end) {
+                    key.append(expression.substr(i, letters_end - i));
+                    i = letters_end;
+                    continue;
+                }
+                Position pos = Position::FromString(expression.substr(i, cell_end - i));
+                if (!pos.IsValid()) {
+                    return std::nullopt;
+                }
+                Position offset = Ast::Offset(anchor, pos);
+                char buffer[32];
+                char* buffer_end = buffer + sizeof(buffer);
+                char* out = buffer;
+                *out++ = '{';
+                out = std::to_chars(out, buffer_end, offset.row).ptr;
+                *out++ = ',';
+                out = std::to_chars(out, buffer_end, offset.col).ptr;
+                *out++ = '}';
+                key.append(buffer, out);
+                i = cell_end;
+            }
+            else if (std::string_view("+-*/():, \t\n\r").find(c) != std::string_view::npos) {
+                key.push_back(c);
+                ++i;
+            }
+            else {
+                return std::nullopt;
+            }
+        }
+        return key;
+    }
+}
+
+void WarmUpFormulaParser() {
+    // по формуле на каждую ветку грамматики
+    const char* expressions[] = { "1", "-A1", "+(1.5e3)", "(A1+B2)*C3/D4-E5", "SUM(A1:B2,C3,1)", "MIN(A1)+MAX(1,2)" };
+    std::string error;
+    for (const char* expression : expressions) {
+        ParseFormulaTemplate(expression, Position{ 0, 0 }, error);
+    }
+}
+
+std::unique_ptr<IFormula> TryParseFormula(std::string expression) {
+    Position anchor{ 0, 0 };
+    std::string error;
+    auto formula_template = ParseFormulaTemplate(expression, anchor, error);
+    if (!formula_template) {
+        return nullptr;
+    }
+    return std::make_unique<Formula>(std::move(formula_template), anchor);
+}
+
+std::unique_ptr<IFormula> ParseFormula(std::string expression) {
+    Position anchor{ 0, 0 };
+    std::string error;
+    auto formula_template = ParseFormulaTemplate(expression, anchor, error);
+    if (!formula_template) {
+        throw FormulaException(error);
+    }
+    return std::make_unique<Formula>(std::move(formula_template), anchor);
+}
+
+namespace {
+    // Сначала точный текст, затем относительный ключ; разбор ANTLR - только
+    // если текст не встречался и шаблона с такими смещениями нет
+    std::unique_ptr<Formula> ParseWithCache(const std::string& expression, Position anchor, FormulaTemplateCache& templates, std::string& error) {
+        FormulaTextCache& texts = templates.GetTextCache();
+        auto cached = texts.Find(expression);
+        // шаблон без ссылок от якоря не зависит
+        if (cached && (cached->anchor == anchor
+            || (cached->formula_template->offsets.empty() && cached->formula_template->range_offsets.empty()))) {
+            return std::make_unique<Formula>(std::move(cached->formula_template), anchor);
+        }
+        auto key = MakeTemplateKey(expression, anchor);
+        if (key) {
+            if (auto formula_template = templates.Find(*key)) {
+                return std::make_unique<Formula>(std::move(formula_template), anchor);
+            }
+        }
+
+        std::shared_ptr<const FormulaTemplate> formula_template;
+        if (cached) {
+            formula_template = MoveAnchor(*cached->formula_template, cached->anchor, anchor);
+        }
+        else {
+            formula_template = ParseFormulaTemplate(expression, anchor, error);
+            if (!formula_template) {
+                return nullptr;
+            }
+            texts.Insert(expression, { formula_template, anchor });
+        }
+        if (key) {
+            formula_template = templates.Insert(*key, std::move(formula_template));
+        }
+        return std::make_unique<Formula>(std::move(formula_template), anchor);
+    }
+}
+
+std::unique_ptr<Formula> TryParseFormulaWithGrammar(std::string expression) {
+    Position anchor{ 0, 0 };
+    std::string error;
+    auto formula_template = BuildFormulaTemplate(expression, anchor, error);
+    if (!formula_template) {
+        return nullptr;
+    }
+    return std::make_unique<Formula>(std::move(formula_template), anchor);
+}
+
+std::unique_ptr<Formula> TryParseFormula(std::string expression, Position anchor, FormulaTemplateCache& templates) {
+    std::string error;
+    return ParseWithCache(expression, anchor, templates, error);
+}
+
+std::unique_ptr<Formula> ParseFormula(std::string expression, Position anchor, FormulaTemplateCache& templates) {
+    std::string error;
+    auto formula = ParseWithCache(expression, anchor, templates, error);
+    if (!formula) {
+        throw FormulaException(error);
+    }
+    return formula;
+}
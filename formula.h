@@ -1,27 +1,117 @@
-#pragma once
-#include <memory>
-#include <vector>
-#include "antlr4-runtime.h"
-#include "FormulaLexer.h"
-#include "FormulaListener.h"
-#include "FormulaParser.h"
-#include "common.h"
-#include "statement.h"
-
-class Formula : public IFormula {
-public:
-    using Value = std::variant<double, FormulaError>;
-    virtual Value Evaluate(const ISheet& sheet) const;
-    virtual std::string GetExpression() const;
-    virtual std::vector<Position> GetReferencedCells() const;
-    virtual HandlingResult HandleInsertedRows(int before, int count = 1);
-    virtual HandlingResult HandleInsertedCols(int before, int count = 1);
-    virtual HandlingResult HandleDeletedRows(int first, int count = 1);
-    virtual HandlingResult HandleDeletedCols(int first, int count = 1);
-    virtual void ModifyStatementRowPositions(Ast::Statement* root, int before, int count);
-    virtual void ModifyStatementColumnPositions(Ast::Statement* root, int before, int count);
-    virtual void DeleteStatementRowPositions(Ast::Statement* root, int first, int count);
-    virtual void DeleteStatementColumnPositions(Ast::Statement* root, int first, int count);
-    std::unique_ptr<Ast::Statement> statement;
-    std::vector<Position> references;
-};
\ No newline at end of file
+﻿#pragma once
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "antlr4-runtime.h"
+#include "FormulaLexer.h"
+#include "FormulaListener.h"
+#include "FormulaParser.h"
+#include "common.h"
+#include "statement.h"
+
+// Формула в относительных ссылках (R1C1): ссылки хранятся как смещения от
+// ячейки-якоря, поэтому формулы вида =A1*B1, =A2*B2, ... разделяют один шаблон
+struct FormulaTemplate {
+    std::unique_ptr<Ast::Statement> statement;
+    std::vector<Position> offsets;
+    std::vector<CellRange> range_offsets;
+    // узлы statement в обратном порядке, для вычисления без рекурсии
+    std::vector<const Ast::Statement*> postorder;
+    std::vector<Ast::Instruction> program;
+};
+
+// Шаблоны по точному тексту формулы вместе с якорем, для которого они
+// построены: одинаковый текст в разных ячейках (=A1*1.2 во всём столбце)
+// не разбирается заново. В отличие от кэша по относительному ключу держит
+// шаблоны сам, поэтому давно не использованные записи вытесняются, когда
+// их объём превышает бюджет
+class FormulaTextCache {
+public:
+    struct CachedTemplate {
+        std::shared_ptr<const FormulaTemplate> formula_template;
+        Position anchor;
+    };
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        size_t memory_usage = 0;
+    };
+
+    std::optional<CachedTemplate> Find(const std::string& expression);
+    void Insert(const std::string& expression, CachedTemplate cached);
+    // Добавляет записи other, текстов которых ещё нет, и его счётчики
+    void Merge(const FormulaTextCache& other);
+    // 0 отключает кэш
+    void SetMemoryBudget(size_t bytes);
+    size_t GetMemoryBudget() const;
+    Stats GetStats() const;
+    void ResetStats();
+
+    static const size_t kDefaultMemoryBudget = 16 << 20;
+private:
+    struct Entry {
+        const std::string* expression;
+        CachedTemplate cached;
+        size_t bytes;
+    };
+    void EvictToBudget();
+
+    // от недавно использованных к давним
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t memory_budget = kDefaultMemoryBudget;
+    Stats stats;
+};
+
+class FormulaTemplateCache {
+public:
+    std::shared_ptr<const FormulaTemplate> Find(const std::string& key) const;
+    std::shared_ptr<const FormulaTemplate> Insert(const std::string& key, std::shared_ptr<const FormulaTemplate> formula_template);
+    // Добавляет живые шаблоны other, ключей которых ещё нет
+    void Merge(const FormulaTemplateCache& other);
+    size_t GetSize() const;
+    FormulaTextCache& GetTextCache();
+    const FormulaTextCache& GetTextCache() const;
+private:
+    void RemoveExpired();
+    std::unordered_map<std::string, std::weak_ptr<const FormulaTemplate>> templates;
+    size_t expired_check_size = 1024;
+    FormulaTextCache texts;
+};
+
+class Formula : public IFormula {
+public:
+    Formula(std::shared_ptr<const FormulaTemplate> formula_template_, Position anchor_);
+    virtual Value Evaluate(const ISheet& sheet) const;
+    virtual std::string GetExpression() const;
+    virtual void AppendExpression(std::string& out) const;
+    virtual std::vector<Position> GetReferencedCells() const;
+    virtual std::vector<CellRange> GetReferencedRanges() const;
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1);
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1);
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1);
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1);
+    const FormulaTemplate* GetTemplate() const;
+    Position GetAnchor() const;
+private:
+    struct StructuralEdit;
+    HandlingResult HandleStructuralEdit(const StructuralEdit& edit);
+
+    std::shared_ptr<const FormulaTemplate> formula_template;
+    Position anchor;
+};
+
+std::unique_ptr<Formula> ParseFormula(std::string expression, Position anchor, FormulaTemplateCache& templates);
+// То же без исключений: nullptr, если текст не разбирается как формула
+std::unique_ptr<Formula> TryParseFormula(std::string expression, Position anchor, FormulaTemplateCache& templates);
+// Разбор одним ANTLR, без быстрой проверки синтаксиса: эталон, с которым
+// тесты сверяют TryParseFormula
+std::unique_ptr<Formula> TryParseFormulaWithGrammar(std::string expression);
+
+// Разбирает несколько формул, чтобы заполнить общий для всех парсеров кеш
+// DFA ANTLR; вызывается при запуске программы
+void WarmUpFormulaParser();
@@ -1,601 +1,2331 @@
-#include "common.h"
-#include "formula.h"
-#include "sheet.h"
-#include "cell.h"
-#include "test_runner.h"
-
-std::ostream& operator<<(std::ostream& output, Position pos) {
-  return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-Position operator"" _pos(const char* str, std::size_t) {
-  return Position::FromString(str);
-}
-
-std::ostream& operator<<(std::ostream& output, Size size) {
-  return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-std::ostream& operator<<(std::ostream& output, const ICell::Value& value) {
-  std::visit([&](const auto& x) { output << x; }, value);
-  return output;
-}
-
-std::string_view ToString(IFormula::HandlingResult hr) {
-  switch (hr) {
-    case IFormula::HandlingResult::NothingChanged:
-      return "NothingChanged";
-    case IFormula::HandlingResult::ReferencesRenamedOnly:
-      return "ReferencesRenamedOnly";
-    case IFormula::HandlingResult::ReferencesChanged:
-      return "ReferencesChanged";
-  }
-  return "";
-}
-
-std::ostream& operator<<(std::ostream& output, IFormula::HandlingResult hr) {
-  return output << ToString(hr);
-}
-
-namespace {
-  std::string ToString(FormulaError::Category category) {
-    return std::string(FormulaError(category).ToString());
-  }
-
-  void TestPositionAndStringConversion() {
-    auto testSingle = [](Position pos, std::string_view str) {
-      ASSERT_EQUAL(pos.ToString(), str);
-      ASSERT_EQUAL(Position::FromString(str), pos);
-    };
-
-    for (int i = 0; i < 25; ++i) {
-      testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
-    }
-
-    testSingle(Position{0, 0}, "A1");
-    testSingle(Position{0, 1}, "B1");
-    testSingle(Position{0, 25}, "Z1");
-    testSingle(Position{0, 26}, "AA1");
-    testSingle(Position{0, 27}, "AB1");
-    testSingle(Position{0, 51}, "AZ1");
-    testSingle(Position{0, 52}, "BA1");
-    testSingle(Position{0, 53}, "BB1");
-    testSingle(Position{0, 77}, "BZ1");
-    testSingle(Position{0, 78}, "CA1");
-    testSingle(Position{0, 701}, "ZZ1");
-    testSingle(Position{0, 702}, "AAA1");
-    testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::kMaxRows - 1, Position::kMaxCols - 1},
-               "XFD16384");
-  }
-
-  void TestPositionToStringInvalid() {
-    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
-    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
-    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
-  }
-
-  void TestStringToPositionInvalid() {
-    ASSERT(!Position::FromString("").IsValid());
-    ASSERT(!Position::FromString("A").IsValid());
-    ASSERT(!Position::FromString("1").IsValid());
-    ASSERT(!Position::FromString("e2").IsValid());
-    ASSERT(!Position::FromString("A0").IsValid());
-    ASSERT(!Position::FromString("A-1").IsValid());
-    ASSERT(!Position::FromString("A+1").IsValid());
-    ASSERT(!Position::FromString("R2D2").IsValid());
-    ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
-    ASSERT(!Position::FromString("XFE16384").IsValid());
-    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-  }
-
-  void TestEmpty() {
-    auto sheet = CreateSheet();
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
-  }
-
-  void TestInvalidPosition() {
-    auto sheet = CreateSheet();
-    try {
-      sheet->SetCell(Position{-1, 0}, "");
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-      sheet->GetCell(Position{0, -2});
-    } catch (const InvalidPositionException&) {
-    }
-    try {
-      sheet->ClearCell(Position{Position::kMaxRows, 0});
-    } catch (const InvalidPositionException&) {
-    }
-  }
-
-  void TestSetCellPlainText() {
-    auto sheet = CreateSheet();
-
-    auto checkCell = [&](Position pos, std::string text) {
-      sheet->SetCell(pos, text);
-      ICell* cell = sheet->GetCell(pos);
-      ASSERT(cell != nullptr);
-      ASSERT_EQUAL(cell->GetText(), text);
-      ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-    };
-
-    checkCell("A1"_pos, "Hello");
-    checkCell("A1"_pos, "World");
-    checkCell("B2"_pos, "Purr");
-    checkCell("A3"_pos, "Meow");
-
-    const ISheet& constSheet = *sheet;
-    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-    sheet->SetCell("A3"_pos, "'=escaped");
-    ICell* cell = sheet->GetCell("A3"_pos);
-    ASSERT_EQUAL(cell->GetText(), "'=escaped");
-    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-  }
-
-  void TestClearCell() {
-    auto sheet = CreateSheet();
-
-    sheet->SetCell("C2"_pos, "Me gusta");
-    sheet->ClearCell("C2"_pos);
-    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-    sheet->ClearCell("A1"_pos);
-    sheet->ClearCell("J10"_pos);
-  }
-
-  void TestFormulaArithmetic() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-      return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    ASSERT_EQUAL(evaluate("1"), 1);
-    ASSERT_EQUAL(evaluate("42"), 42);
-    ASSERT_EQUAL(evaluate("2 + 2"), 4);
-    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-  }
-
-  void TestFormulaReferences() {
-    auto sheet = CreateSheet();
-    auto evaluate = [&](std::string expr) {
-      return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-    };
-
-    sheet->SetCell("A1"_pos, "1");
-    ASSERT_EQUAL(evaluate("A1"), 1);
-    sheet->SetCell("A2"_pos, "2");
-    ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-    // Тест на нули:
-    sheet->SetCell("B3"_pos, "");
-    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-  }
-
-  void TestFormulaExpressionFormatting() {
-    auto reformat = [](std::string expr) {
-      return ParseFormula(std::move(expr))->GetExpression();
-    };
-
-    ASSERT_EQUAL(reformat("  1  "), "1");
-    ASSERT_EQUAL(reformat("  -1  "), "-1");
-    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-    ASSERT_EQUAL(reformat("2 + (2 + 2)"), "2+2+2");
-    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-    ASSERT_EQUAL(reformat("-(123 + 456) / -B35 * 1"), "-(123+456)/-B35*1");
-    ASSERT_EQUAL(reformat("+(123 - 456) / -B35 * 1"), "+(123-456)/-B35*1");
-    ASSERT_EQUAL(reformat("(1 / 2) / 3"), "1/2/3");
-    ASSERT_EQUAL(reformat("1 / (2 / 3)"), "1/(2/3)");
-  }
-
-  void TestFormulaReferencedCells() {
-    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-
-    auto a1 = ParseFormula("A1");
-    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
-
-    auto b2c3 = ParseFormula("B2+C3");
-    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
-
-    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-    ASSERT_EQUAL(tricky->GetReferencedCells(),
-                 (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
-  }
-
-  void TestFormulaHandleInsertion() {
-    auto f = ParseFormula("A1");
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A1"_pos});
-
-    auto hr = f->HandleInsertedCols(0);
-    ASSERT_EQUAL(f->GetExpression(), "B1");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B1"_pos});
-
-    hr = f->HandleInsertedRows(0);
-    ASSERT_EQUAL(f->GetExpression(), "B2");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
-
-    hr = f->HandleInsertedRows(2);
-    ASSERT_EQUAL(f->GetExpression(), "B2");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::NothingChanged);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
-
-    f = ParseFormula("A1+B2");
-    ASSERT_EQUAL(f->GetExpression(), "A1+B2");
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
-
-    hr = f->HandleInsertedCols(1);
-    ASSERT_EQUAL(f->GetExpression(), "A1+C2");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C2"_pos}));
-
-    hr = f->HandleInsertedRows(1);
-    ASSERT_EQUAL(f->GetExpression(), "A1+C3");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
-
-    hr = f->HandleInsertedCols(0, 3);
-    ASSERT_EQUAL(f->GetExpression(), "D1+F3");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"D1"_pos, "F3"_pos}));
-
-    hr = f->HandleInsertedRows(0, 3);
-    ASSERT_EQUAL(f->GetExpression(), "D4+F6");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"D4"_pos, "F6"_pos}));
-  }
-
-  void TestInsertionOverflow() {
-    const auto maxp = Position{Position::kMaxRows - 1, Position::kMaxCols - 1};
-
-    auto sheet = CreateSheet();
-    std::string text = "There be dragons";
-    sheet->SetCell(maxp, text);
-    try {
-      sheet->InsertCols(1);
-      ASSERT(false); // InsertCols must throw exception
-    } catch (const TableTooBigException&) {
-      ASSERT_EQUAL(sheet->GetCell(maxp)->GetText(), text);
-    }
-    try {
-      sheet->InsertRows(1);
-    } catch (const TableTooBigException&) {
-      ASSERT_EQUAL(sheet->GetCell(maxp)->GetText(), text);
-    }
-
-    sheet = CreateSheet();
-    text = "=" + maxp.ToString();
-    sheet->SetCell("A1"_pos, text);
-    try {
-      sheet->InsertCols(1);
-      ASSERT(false); // InsertCols must throw exception
-    } catch (const TableTooBigException&) {
-      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), text);
-    }
-    try {
-      sheet->InsertRows(1);
-      ASSERT(false); // InsertRows must throw exception
-    } catch (const TableTooBigException&) {
-      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), text);
-    }
-  }
-
-  void TestFormulaHandleDeletion() {
-    auto f = ParseFormula("B2");
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
-
-    auto hr = f->HandleDeletedCols(0);
-    ASSERT_EQUAL(f->GetExpression(), "A2");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A2"_pos});
-
-    hr = f->HandleDeletedRows(0);
-    ASSERT_EQUAL(f->GetExpression(), "A1");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A1"_pos});
-
-    const auto ref = ToString(FormulaError::Category::Ref);
-
-    f = ParseFormula("A1+C3");
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
-
-    hr = f->HandleDeletedCols(1);
-    ASSERT_EQUAL(f->GetExpression(), "A1+B3");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B3"_pos}));
-
-    hr = f->HandleDeletedRows(1);
-    ASSERT_EQUAL(f->GetExpression(), "A1+B2");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
-    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
-
-    hr = f->HandleDeletedRows(0);
-    ASSERT_EQUAL(f->GetExpression(), ref + "+B1");
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesChanged);
-    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B1"_pos});
-
-    hr = f->HandleDeletedCols(1);
-    ASSERT_EQUAL(f->GetExpression(), ref + "+" + ref);
-    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesChanged);
-    ASSERT(f->GetReferencedCells().empty());
-  }
-
-  void TestErrorValue() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "A1");
-    sheet->SetCell("E4"_pos, "=E2");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Value));
-
-    sheet->SetCell("E2"_pos, "3D");
-    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Value));
-  }
-
-  void TestErrorDiv0() {
-    auto sheet = CreateSheet();
-
-    constexpr double max = std::numeric_limits<double>::max();
-
-    sheet->SetCell("A1"_pos, "=1/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Div0));
-
-    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Div0));
-
-    sheet->SetCell("A1"_pos, "=0/0");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Div0));
-
-    {
-      std::ostringstream formula;
-      formula << '=' << max << '+' << max;
-      sheet->SetCell("A1"_pos, formula.str());
-      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                   ICell::Value(FormulaError::Category::Div0));
-    }
-
-    {
-      std::ostringstream formula;
-      formula << '=' << -max << '-' << max;
-      sheet->SetCell("A1"_pos, formula.str());
-      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                   ICell::Value(FormulaError::Category::Div0));
-    }
-
-    {
-      std::ostringstream formula;
-      formula << '=' << max << '*' << max;
-      sheet->SetCell("A1"_pos, formula.str());
-      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                   ICell::Value(FormulaError::Category::Div0));
-    }
-  }
-
-  void TestEmptyCellTreatedAsZero() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=B2");
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), ICell::Value(0));
-  }
-
-  void TestFormulaInvalidPosition() {
-    auto sheet = CreateSheet();
-    auto try_formula = [&](const std::string& formula) {
-      try {
-        sheet->SetCell("A1"_pos, formula);
-        ASSERT(false);
-      } catch (const FormulaException&) {
-        // we expect this one
-      }
-    };
-
-    try_formula("=X0");
-    try_formula("=ABCD1");
-    try_formula("=A123456");
-    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
-    try_formula("=XFE16384");
-    try_formula("=R2D2");
-  }
-
-  void TestCellErrorPropagation() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=1");
-    sheet->SetCell("A2"_pos, "=A1");
-    sheet->SetCell("A3"_pos, "=A2");
-    sheet->DeleteRows(0);
-
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Ref));
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(),
-                 "=" + ToString(FormulaError::Category::Ref));
-
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Ref));
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=A1");
-
-    sheet->SetCell("B1"_pos, "=1/0");
-    sheet->SetCell("A2"_pos, "=A1+B1");
-    auto value = sheet->GetCell("A2"_pos)->GetValue();
-    ASSERT(value == ICell::Value(FormulaError::Category::Ref) ||
-           value == ICell::Value(FormulaError::Category::Div0));
-  }
-
-  void TestCellsDeletionSimple() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "1");
-    sheet->SetCell("A2"_pos, "2");
-    sheet->SetCell("A3"_pos, "3");
-    sheet->DeleteRows(1);
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "3");
-
-    sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "1");
-    sheet->SetCell("B1"_pos, "2");
-    sheet->SetCell("C1"_pos, "3");
-    sheet->DeleteCols(1);
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
-    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "3");
-  }
-
-  void TestCellsDeletion() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=1");
-    sheet->SetCell("A2"_pos, "=A1");
-    sheet->SetCell("A3"_pos, "=A2");
-    sheet->SetCell("B3"_pos, "=A1+A3");
-    sheet->DeleteRows(1);
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1");
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Ref));
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1+A2");
-
-    sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "=1");
-    sheet->SetCell("B1"_pos, "=A1");
-    sheet->SetCell("C1"_pos, "=B1");
-    sheet->SetCell("C2"_pos, "=A1+C1");
-    sheet->DeleteCols(1);
-    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1");
-    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
-                 ICell::Value(FormulaError::Category::Ref));
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1+B1");
-  }
-
-  void TestCellsDeletionAdjacent() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A2"_pos, "=1");
-    sheet->SetCell("A3"_pos, "=A1+A2");
-    sheet->DeleteRows(0);
-
-    sheet = CreateSheet();
-    sheet->SetCell("B1"_pos, "=1");
-    sheet->SetCell("C1"_pos, "=A1+B1");
-    sheet->DeleteCols(0);
-  }
-
-  void TestPrint() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A2"_pos, "meow");
-    sheet->SetCell("B2"_pos, "=35");
-
-    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
-
-    std::ostringstream texts;
-    sheet->PrintTexts(texts);
-    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-    std::ostringstream values;
-    sheet->PrintValues(values);
-    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-  }
-
-  void TestCellReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("A1"_pos, "1");
-    sheet->SetCell("A2"_pos, "=A1");
-    sheet->SetCell("B2"_pos, "=A1");
-
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(),
-                 std::vector{"A1"_pos});
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(),
-                 std::vector{"A1"_pos});
-
-    // Ссылка на пустую ячейку
-    sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(),
-                 std::vector{"B1"_pos});
-
-    sheet->SetCell("A2"_pos, "");
-    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-    sheet->SetCell("B1"_pos, "=C3");
-    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(),
-                 std::vector{"C3"_pos});
-  }
-
-  void TestFormulaIncorrect() {
-    auto isIncorrect = [](std::string expression) {
-      try {
-        ParseFormula(std::move(expression));
-      } catch (const FormulaException&) {
-        return true;
-      }
-      return false;
-    };
-
-    ASSERT(isIncorrect("A2B"));
-    ASSERT(isIncorrect("3X"));
-    ASSERT(isIncorrect("A0++"));
-    ASSERT(isIncorrect("((1)"));
-    ASSERT(isIncorrect("2+4-"));
-  }
-
-  void TestCellCircularReferences() {
-    auto sheet = CreateSheet();
-    sheet->SetCell("E2"_pos, "=E4");
-    sheet->SetCell("E4"_pos, "=X9");
-    sheet->SetCell("X9"_pos, "=M6");
-    sheet->SetCell("M6"_pos, "Ready");
-
-    bool caught = false;
-    try {
-      sheet->SetCell("M6"_pos, "=E2");
-    } catch (const CircularDependencyException&) {
-      caught = true;
-    }
-
-    ASSERT(caught);
-    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-  }
-}
-
-int main() {
-  TestRunner tr;
-  RUN_TEST(tr, TestPositionAndStringConversion);
-  RUN_TEST(tr, TestPositionToStringInvalid);
-  RUN_TEST(tr, TestStringToPositionInvalid);
-  RUN_TEST(tr, TestEmpty);
-  RUN_TEST(tr, TestInvalidPosition);
-  RUN_TEST(tr, TestSetCellPlainText);
-  RUN_TEST(tr, TestClearCell);
-  RUN_TEST(tr, TestFormulaArithmetic);
-  RUN_TEST(tr, TestFormulaReferences);
-  RUN_TEST(tr, TestFormulaExpressionFormatting);
-  RUN_TEST(tr, TestFormulaReferencedCells);
-  RUN_TEST(tr, TestFormulaHandleInsertion);
-  RUN_TEST(tr, TestInsertionOverflow);
-  RUN_TEST(tr, TestFormulaHandleDeletion);
-  RUN_TEST(tr, TestErrorValue);
-  RUN_TEST(tr, TestErrorDiv0);
-  RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-  RUN_TEST(tr, TestFormulaInvalidPosition);
-  RUN_TEST(tr, TestCellErrorPropagation);
-  RUN_TEST(tr, TestCellsDeletionSimple);
-  RUN_TEST(tr, TestCellsDeletion);
-  RUN_TEST(tr, TestCellsDeletionAdjacent);
-  RUN_TEST(tr, TestPrint);
-  RUN_TEST(tr, TestCellReferences);
-  RUN_TEST(tr, TestFormulaIncorrect);
-  RUN_TEST(tr, TestCellCircularReferences);
-  return 0;
-}
+#include "common.h"
+#include "formula.h"
+#include "mapped_sheet.h"
+#include "sheet.h"
+#include "cell.h"
+#include "concurrent_sheet.h"
+#include "eval_value.h"
+#include "op_log.h"
+#include "profile.h"
+#include "test_runner.h"
+#include "vectorized.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <random>
+#include <thread>
+
+std::ostream& operator<<(std::ostream& output, Position pos) {
+  return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+Position operator"" _pos(const char* str, std::size_t) {
+  return Position::FromString(str);
+}
+
+std::ostream& operator<<(std::ostream& output, Size size) {
+  return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+std::ostream& operator<<(std::ostream& output, const ICell::Value& value) {
+  std::visit([&](const auto& x) { output << x; }, value);
+  return output;
+}
+
+std::string_view ToString(IFormula::HandlingResult hr) {
+  switch (hr) {
+    case IFormula::HandlingResult::NothingChanged:
+      return "NothingChanged";
+    case IFormula::HandlingResult::ReferencesRenamedOnly:
+      return "ReferencesRenamedOnly";
+    case IFormula::HandlingResult::ReferencesChanged:
+      return "ReferencesChanged";
+  }
+  return "";
+}
+
+std::ostream& operator<<(std::ostream& output, IFormula::HandlingResult hr) {
+  return output << ToString(hr);
+}
+
+namespace {
+  std::string ToString(FormulaError::Category category) {
+    return std::string(FormulaError(category).ToString());
+  }
+
+  void TestPositionAndStringConversion() {
+    auto testSingle = [](Position pos, std::string_view str) {
+      ASSERT_EQUAL(pos.ToString(), str);
+      ASSERT_EQUAL(Position::FromString(str), pos);
+    };
+
+    for (int i = 0; i < 25; ++i) {
+      testSingle(Position{i, i}, char('A' + i) + std::to_string(i + 1));
+    }
+
+    testSingle(Position{0, 0}, "A1");
+    testSingle(Position{0, 1}, "B1");
+    testSingle(Position{0, 25}, "Z1");
+    testSingle(Position{0, 26}, "AA1");
+    testSingle(Position{0, 27}, "AB1");
+    testSingle(Position{0, 51}, "AZ1");
+    testSingle(Position{0, 52}, "BA1");
+    testSingle(Position{0, 53}, "BB1");
+    testSingle(Position{0, 77}, "BZ1");
+    testSingle(Position{0, 78}, "CA1");
+    testSingle(Position{0, 701}, "ZZ1");
+    testSingle(Position{0, 702}, "AAA1");
+    testSingle(Position{136, 2}, "C137");
+    testSingle(Position{Position::kMaxRows - 1, Position::kMaxCols - 1},
+               "XFD16384");
+  }
+
+  void TestPositionToStringInvalid() {
+    ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
+    ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
+    ASSERT_EQUAL((Position{1, -3}).ToString(), "");
+  }
+
+  void TestStringToPositionInvalid() {
+    ASSERT(!Position::FromString("").IsValid());
+    ASSERT(!Position::FromString("A").IsValid());
+    ASSERT(!Position::FromString("1").IsValid());
+    ASSERT(!Position::FromString("e2").IsValid());
+    ASSERT(!Position::FromString("A0").IsValid());
+    ASSERT(!Position::FromString("A-1").IsValid());
+    ASSERT(!Position::FromString("A+1").IsValid());
+    ASSERT(!Position::FromString("R2D2").IsValid());
+    ASSERT(!Position::FromString("C3PO").IsValid());
+    ASSERT(!Position::FromString("XFD16385").IsValid());
+    ASSERT(!Position::FromString("XFE16384").IsValid());
+    ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+    ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+  }
+
+  void TestPositionAllColumns() {
+    static_assert(Position::FromString("XFD16384") == Position{Position::kMaxRows - 1, Position::kMaxCols - 1});
+    static_assert(!Position::FromString("XFE1").IsValid());
+
+    char buffer[Position::kMaxNameLength];
+    for (int col = 0; col < Position::kMaxCols; ++col) {
+      Position pos{col % Position::kMaxRows, col};
+      char* end = pos.ToChars(buffer, buffer + sizeof(buffer));
+      std::string_view name(buffer, end - buffer);
+      ASSERT_EQUAL(name, pos.ToString());
+      ASSERT_EQUAL(Position::FromString(name), pos);
+    }
+    Position last{Position::kMaxRows - 1, Position::kMaxCols - 1};
+    ASSERT(last.ToChars(buffer, buffer + 7) == buffer);
+    ASSERT((Position{-1, 0}.ToChars(buffer, buffer + sizeof(buffer)) == buffer));
+  }
+
+  void TestEmpty() {
+    auto sheet = CreateSheet();
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+  }
+
+  void TestInvalidPosition() {
+    auto sheet = CreateSheet();
+    try {
+      sheet->SetCell(Position{-1, 0}, "");
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+      sheet->GetCell(Position{0, -2});
+    } catch (const InvalidPositionException&) {
+    }
+    try {
+      sheet->ClearCell(Position{Position::kMaxRows, 0});
+    } catch (const InvalidPositionException&) {
+    }
+  }
+
+  void TestSetCellPlainText() {
+    auto sheet = CreateSheet();
+
+    auto checkCell = [&](Position pos, std::string text) {
+      sheet->SetCell(pos, text);
+      ICell* cell = sheet->GetCell(pos);
+      ASSERT(cell != nullptr);
+      ASSERT_EQUAL(cell->GetText(), text);
+      ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+    };
+
+    checkCell("A1"_pos, "Hello");
+    checkCell("A1"_pos, "World");
+    checkCell("B2"_pos, "Purr");
+    checkCell("A3"_pos, "Meow");
+
+    const ISheet& constSheet = *sheet;
+    ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+    sheet->SetCell("A3"_pos, "'=escaped");
+    ICell* cell = sheet->GetCell("A3"_pos);
+    ASSERT_EQUAL(cell->GetText(), "'=escaped");
+    ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+  }
+
+  void TestClearCell() {
+    auto sheet = CreateSheet();
+
+    sheet->SetCell("C2"_pos, "Me gusta");
+    sheet->ClearCell("C2"_pos);
+    ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+    sheet->ClearCell("A1"_pos);
+    sheet->ClearCell("J10"_pos);
+  }
+
+  void TestFormulaArithmetic() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+      return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    ASSERT_EQUAL(evaluate("1"), 1);
+    ASSERT_EQUAL(evaluate("42"), 42);
+    ASSERT_EQUAL(evaluate("2 + 2"), 4);
+    ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+    ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+    ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+    ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+  }
+
+  void TestFormulaReferences() {
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+      return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(evaluate("A1"), 1);
+    sheet->SetCell("A2"_pos, "2");
+    ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+    // Тест на нули:
+    sheet->SetCell("B3"_pos, "");
+    ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+    ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+    ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+  }
+
+  void TestFormulaExpressionFormatting() {
+    auto reformat = [](std::string expr) {
+      return ParseFormula(std::move(expr))->GetExpression();
+    };
+
+    ASSERT_EQUAL(reformat("  1  "), "1");
+    ASSERT_EQUAL(reformat("  -1  "), "-1");
+    ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+    ASSERT_EQUAL(reformat("2 + (2 + 2)"), "2+2+2");
+    ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+    ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+    ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+    ASSERT_EQUAL(reformat("-(123 + 456) / -B35 * 1"), "-(123+456)/-B35*1");
+    ASSERT_EQUAL(reformat("+(123 - 456) / -B35 * 1"), "+(123-456)/-B35*1");
+    ASSERT_EQUAL(reformat("(1 / 2) / 3"), "1/2/3");
+    ASSERT_EQUAL(reformat("1 / (2 / 3)"), "1/(2/3)");
+    ASSERT_EQUAL(reformat("(1 + 2) * 3"), "(1+2)*3");
+    ASSERT_EQUAL(reformat("(A1) * 3"), "A1*3");
+    ASSERT_EQUAL(reformat("-(B1 - 2)"), "-(B1-2)");
+    ASSERT_EQUAL(reformat("1 - (2 - 3)"), "1-(2-3)");
+    ASSERT_EQUAL(reformat("1 - (2 * 3)"), "1-2*3");
+    ASSERT_EQUAL(reformat("2 * (3 * 4)"), "2*3*4");
+    ASSERT_EQUAL(reformat("2 / (3 * 4)"), "2/(3*4)");
+    ASSERT_EQUAL(reformat("(1 + 2)"), "1+2");
+    ASSERT_EQUAL(reformat("SUM((1 + 2), A1:B2) * (3)"), "SUM(1+2,A1:B2)*3");
+  }
+
+  void TestFormulaReferencedCells() {
+    ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+
+    auto a1 = ParseFormula("A1");
+    ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{"A1"_pos}));
+
+    auto b2c3 = ParseFormula("B2+C3");
+    ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{"B2"_pos, "C3"_pos}));
+
+    auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+    ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+    ASSERT_EQUAL(tricky->GetReferencedCells(),
+                 (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+  }
+
+  void TestFormulaHandleInsertion() {
+    auto f = ParseFormula("A1");
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A1"_pos});
+
+    auto hr = f->HandleInsertedCols(0);
+    ASSERT_EQUAL(f->GetExpression(), "B1");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B1"_pos});
+
+    hr = f->HandleInsertedRows(0);
+    ASSERT_EQUAL(f->GetExpression(), "B2");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
+
+    hr = f->HandleInsertedRows(2);
+    ASSERT_EQUAL(f->GetExpression(), "B2");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::NothingChanged);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
+
+    f = ParseFormula("A1+B2");
+    ASSERT_EQUAL(f->GetExpression(), "A1+B2");
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
+
+    hr = f->HandleInsertedCols(1);
+    ASSERT_EQUAL(f->GetExpression(), "A1+C2");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C2"_pos}));
+
+    hr = f->HandleInsertedRows(1);
+    ASSERT_EQUAL(f->GetExpression(), "A1+C3");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
+
+    hr = f->HandleInsertedCols(0, 3);
+    ASSERT_EQUAL(f->GetExpression(), "D1+F3");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"D1"_pos, "F3"_pos}));
+
+    hr = f->HandleInsertedRows(0, 3);
+    ASSERT_EQUAL(f->GetExpression(), "D4+F6");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"D4"_pos, "F6"_pos}));
+  }
+
+  void TestInsertionOverflow() {
+    const auto maxp = Position{Position::kMaxRows - 1, Position::kMaxCols - 1};
+
+    auto sheet = CreateSheet();
+    std::string text = "There be dragons";
+    sheet->SetCell(maxp, text);
+    try {
+      sheet->InsertCols(1);
+      ASSERT(false); // InsertCols must throw exception
+    } catch (const TableTooBigException&) {
+      ASSERT_EQUAL(sheet->GetCell(maxp)->GetText(), text);
+    }
+    try {
+      sheet->InsertRows(1);
+    } catch (const TableTooBigException&) {
+      ASSERT_EQUAL(sheet->GetCell(maxp)->GetText(), text);
+    }
+
+    sheet = CreateSheet();
+    text = "=" + maxp.ToString();
+    sheet->SetCell("A1"_pos, text);
+    try {
+      sheet->InsertCols(1);
+      ASSERT(false); // InsertCols must throw exception
+    } catch (const TableTooBigException&) {
+      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), text);
+    }
+    try {
+      sheet->InsertRows(1);
+      ASSERT(false); // InsertRows must throw exception
+    } catch (const TableTooBigException&) {
+      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), text);
+    }
+  }
+
+  void TestFormulaHandleDeletion() {
+    auto f = ParseFormula("B2");
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B2"_pos});
+
+    auto hr = f->HandleDeletedCols(0);
+    ASSERT_EQUAL(f->GetExpression(), "A2");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A2"_pos});
+
+    hr = f->HandleDeletedRows(0);
+    ASSERT_EQUAL(f->GetExpression(), "A1");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"A1"_pos});
+
+    const auto ref = ToString(FormulaError::Category::Ref);
+
+    f = ParseFormula("A1+C3");
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
+
+    hr = f->HandleDeletedCols(1);
+    ASSERT_EQUAL(f->GetExpression(), "A1+B3");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B3"_pos}));
+
+    hr = f->HandleDeletedRows(1);
+    ASSERT_EQUAL(f->GetExpression(), "A1+B2");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesRenamedOnly);
+    ASSERT_EQUAL(f->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
+
+    hr = f->HandleDeletedRows(0);
+    ASSERT_EQUAL(f->GetExpression(), ref + "+B1");
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesChanged);
+    ASSERT_EQUAL(f->GetReferencedCells(), std::vector{"B1"_pos});
+
+    hr = f->HandleDeletedCols(1);
+    ASSERT_EQUAL(f->GetExpression(), ref + "+" + ref);
+    ASSERT_EQUAL(hr, IFormula::HandlingResult::ReferencesChanged);
+    ASSERT(f->GetReferencedCells().empty());
+  }
+
+  void TestErrorValue() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "A1");
+    sheet->SetCell("E4"_pos, "=E2");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("E2"_pos, "3D");
+    ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Value));
+  }
+
+  void TestErrorDiv0() {
+    auto sheet = CreateSheet();
+
+    constexpr double max = std::numeric_limits<double>::max();
+
+    sheet->SetCell("A1"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Div0));
+
+    sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Div0));
+
+    sheet->SetCell("A1"_pos, "=0/0");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Div0));
+
+    {
+      std::ostringstream formula;
+      formula << '=' << max << '+' << max;
+      sheet->SetCell("A1"_pos, formula.str());
+      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                   ICell::Value(FormulaError::Category::Div0));
+    }
+
+    {
+      std::ostringstream formula;
+      formula << '=' << -max << '-' << max;
+      sheet->SetCell("A1"_pos, formula.str());
+      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                   ICell::Value(FormulaError::Category::Div0));
+    }
+
+    {
+      std::ostringstream formula;
+      formula << '=' << max << '*' << max;
+      sheet->SetCell("A1"_pos, formula.str());
+      ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                   ICell::Value(FormulaError::Category::Div0));
+    }
+  }
+
+  void TestEmptyCellTreatedAsZero() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), ICell::Value(0.0));
+  }
+
+  void TestFormulaInvalidPosition() {
+    auto sheet = CreateSheet();
+    auto try_formula = [&](const std::string& formula) {
+      try {
+        sheet->SetCell("A1"_pos, formula);
+        ASSERT(false);
+      } catch (const FormulaException&) {
+        // we expect this one
+      }
+    };
+
+    try_formula("=X0");
+    try_formula("=ABCD1");
+    try_formula("=A123456");
+    try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+    try_formula("=XFD16385");
+    try_formula("=XFE16384");
+    try_formula("=R2D2");
+  }
+
+  void TestCellErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1");
+    sheet->SetCell("A2"_pos, "=A1");
+    sheet->SetCell("A3"_pos, "=A2");
+    sheet->DeleteRows(0);
+
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(),
+                 "=" + ToString(FormulaError::Category::Ref));
+
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=A1");
+
+    sheet->SetCell("B1"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "=A1+B1");
+    auto value = sheet->GetCell("A2"_pos)->GetValue();
+    ASSERT(value == ICell::Value(FormulaError::Category::Ref) ||
+           value == ICell::Value(FormulaError::Category::Div0));
+  }
+
+  void TestCellsDeletionSimple() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "2");
+    sheet->SetCell("A3"_pos, "3");
+    sheet->DeleteRows(1);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "3");
+
+    sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "2");
+    sheet->SetCell("C1"_pos, "3");
+    sheet->DeleteCols(1);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "3");
+  }
+
+  void TestCellsDeletion() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1");
+    sheet->SetCell("A2"_pos, "=A1");
+    sheet->SetCell("A3"_pos, "=A2");
+    sheet->SetCell("B3"_pos, "=A1+A3");
+    sheet->DeleteRows(1);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1+A2");
+
+    sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1");
+    sheet->SetCell("B1"_pos, "=A1");
+    sheet->SetCell("C1"_pos, "=B1");
+    sheet->SetCell("C2"_pos, "=A1+C1");
+    sheet->DeleteCols(1);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
+                 ICell::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1+B1");
+  }
+
+  void TestCellsDeletionAdjacent() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A2"_pos, "=1");
+    sheet->SetCell("A3"_pos, "=A1+A2");
+    sheet->DeleteRows(0);
+
+    sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=1");
+    sheet->SetCell("C1"_pos, "=A1+B1");
+    sheet->DeleteCols(0);
+  }
+
+  void TestPrint() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A2"_pos, "meow");
+    sheet->SetCell("B2"_pos, "=35");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+  }
+
+  void TestCellReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1");
+    sheet->SetCell("B2"_pos, "=A1");
+
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(),
+                 std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(),
+                 std::vector{"A1"_pos});
+
+    // Ссылка на пустую ячейку
+    sheet->SetCell("B2"_pos, "=B1");
+    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(),
+                 std::vector{"B1"_pos});
+
+    sheet->SetCell("A2"_pos, "");
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+    sheet->SetCell("B1"_pos, "=C3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(),
+                 std::vector{"C3"_pos});
+  }
+
+  void TestFormulaIncorrect() {
+    auto isIncorrect = [](std::string expression) {
+      try {
+        ParseFormula(std::move(expression));
+      } catch (const FormulaException&) {
+        return true;
+      }
+      return false;
+    };
+
+    ASSERT(isIncorrect("A2B"));
+    ASSERT(isIncorrect("3X"));
+    ASSERT(isIncorrect("A0++"));
+    ASSERT(isIncorrect("((1)"));
+    ASSERT(isIncorrect("2+4-"));
+  }
+
+  void TestFormulaTemplateSharing() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+      std::string r = std::to_string(row + 1);
+      sheet.SetCell(Position{row, 0}, r);
+      sheet.SetCell(Position{row, 1}, "2");
+      sheet.SetCell(Position{row, 2}, "=A" + r + "*B" + r);
+    }
+    auto template_of = [&](Position pos) {
+      return static_cast<Formula*>(sheet.GetCell(pos)->GetFormula())->GetTemplate();
+    };
+    ASSERT(template_of("C1"_pos) == template_of("C100"_pos));
+    ASSERT_EQUAL(sheet.GetCell("C37"_pos)->GetText(), "=A37*B37");
+    ASSERT_EQUAL(sheet.GetCell("C37"_pos)->GetReferencedCells(),
+                 (std::vector{"A37"_pos, "B37"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("C37"_pos)->GetValue(), ICell::Value(74.0));
+
+    sheet.SetCell("D5"_pos, "=A1*B1");
+    ASSERT(template_of("D5"_pos) != template_of("C1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=A1*B1");
+
+    sheet.InsertRows(50, 2);
+    ASSERT(template_of("C1"_pos) == template_of("C102"_pos));
+    ASSERT_EQUAL(sheet.GetCell("C102"_pos)->GetText(), "=A102*B102");
+    ASSERT(sheet.GetCell("C51"_pos) == nullptr);
+  }
+
+  void TestVectorizedColumnEvaluation() {
+    Sheet sheet;
+    const int rows = 1000;
+    std::vector<std::string> texts;
+    for (int row = 0; row < rows; ++row) {
+      std::string r = std::to_string(row + 1);
+      sheet.SetCell(Position{row, 0}, std::to_string(row - 300));
+      sheet.SetCell(Position{row, 1}, std::to_string(row % 7));
+      texts.push_back("A" + r + "/B" + r + "+1");
+      texts.push_back("-C" + r + "*A" + r + "-(B" + r + "-2)");
+      sheet.SetCell(Position{row, 2}, "=" + texts[2 * row]);
+      sheet.SetCell(Position{row, 3}, "=" + texts[2 * row + 1]);
+    }
+    sheet.SetCell("A500"_pos, "text");
+    sheet.SetCell("B600"_pos, "=1/0");
+
+    auto to_cell_value = [](const IFormula::Value& value) {
+      return std::visit([](const auto& x) { return ICell::Value(x); }, value);
+    };
+    auto evaluate_scalar = [&](Position pos) {
+      auto formula = ParseFormula(texts[2 * pos.row + pos.col - 2]);
+      return to_cell_value(formula->Evaluate(sheet));
+    };
+
+    std::vector<ICell::Value> expected;
+    for (int col = 2; col < 4; ++col) {
+      for (int row = 0; row < rows; ++row) {
+        expected.push_back(evaluate_scalar(Position{row, col}));
+        sheet.GetCell(Position{row, col})->SetValue(expected.back());
+      }
+    }
+    for (int col = 2; col < 4; ++col) {
+      for (int row = 0; row < rows; ++row) {
+        sheet.GetCell(Position{row, col})->SetValue(0.0);
+      }
+    }
+
+    sheet.RecalculateAll();
+    for (int col = 2, i = 0; col < 4; ++col) {
+      for (int row = 0; row < rows; ++row, ++i) {
+        ASSERT_EQUAL(sheet.GetCell(Position{row, col})->GetValue(), expected[i]);
+      }
+    }
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), ICell::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("D500"_pos)->GetValue(), ICell::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("C600"_pos)->GetValue(), ICell::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(-298.0 / 2 + 1));
+
+    // шаблоны с функциями не векторизуются и считаются по одной ячейке
+    Sheet ranges;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 10; ++row) {
+      std::string r = std::to_string(row + 1);
+      cells.push_back({Position{row, 0}, r});
+      cells.push_back({Position{row, 1}, "=SUM(A" + r + ":A" + r + ")"});
+    }
+    ranges.SetCells(cells);
+    for (int row = 0; row < 10; ++row) {
+      ASSERT_EQUAL(ranges.GetCell(Position{row, 1})->GetValue(), ICell::Value(row + 1.0));
+      ranges.GetCell(Position{row, 1})->SetValue(0.0);
+    }
+    ranges.RecalculateAll();
+    for (int row = 0; row < 10; ++row) {
+      ASSERT_EQUAL(ranges.GetCell(Position{row, 1})->GetValue(), ICell::Value(row + 1.0));
+    }
+  }
+
+  void TestCellCircularReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("E2"_pos, "=E4");
+    sheet->SetCell("E4"_pos, "=X9");
+    sheet->SetCell("X9"_pos, "=M6");
+    sheet->SetCell("M6"_pos, "Ready");
+
+    bool caught = false;
+    try {
+      sheet->SetCell("M6"_pos, "=E2");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+  }
+  void TestRangeFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("B2"_pos, "7");
+    sheet.SetCell("B3"_pos, "=1/0");
+
+    auto evaluate = [&sheet](const std::string& expr) {
+      return ParseFormula(expr)->Evaluate(sheet);
+    };
+    ASSERT_EQUAL(std::get<double>(evaluate("SUM(A1:B2)")), 10);
+    ASSERT_EQUAL(std::get<double>(evaluate("SUM(B2:A1, 5)")), 15);
+    ASSERT_EQUAL(std::get<double>(evaluate("AVERAGE(A1:A2)")), 1.5);
+    ASSERT_EQUAL(std::get<double>(evaluate("MIN(A1:B2)")), 1);
+    ASSERT_EQUAL(std::get<double>(evaluate("MAX(A1:B2)")), 7);
+    ASSERT_EQUAL(std::get<double>(evaluate("COUNT(A1:B3)")), 3);
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("SUM(A1:B3)")), FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(std::get<FormulaError>(evaluate("AVERAGE(C1:C9)")), FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(ParseFormula("SUM(A1:B2)*2")->GetExpression(), "SUM(A1:B2)*2");
+
+    bool caught = false;
+    try {
+      ParseFormula("FOO(A1:B2)");
+    } catch (const FormulaException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+
+    sheet.SetCell("D1"_pos, "=SUM(A1:A2)");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(3.0));
+    sheet.SetCell("A2"_pos, "10");
+    sheet.RecalculateAll();
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(11.0));
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(A1:A4)");
+    sheet.DeleteRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(A1:A2)");
+    sheet.DeleteRows(1, 1);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(A1:A1)");
+    sheet.RecalculateAll();
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(1.0));
+    sheet.SetCell("E5"_pos, "=SUM(A2:A3)");
+    sheet.DeleteRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=SUM(#REF!)");
+    sheet.RecalculateAll();
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("E3"_pos)->GetValue()), FormulaError(FormulaError::Category::Ref));
+
+    caught = false;
+    try {
+      sheet.SetCell("F1"_pos, "=1");
+      sheet.SetCell("F5"_pos, "=SUM(F1:F3)");
+      sheet.SetCell("F2"_pos, "=F5");
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+
+    // широкий диапазон по высокому листу: деревья только у занятых столбцов
+    Sheet tall;
+    for (int row = 0; row < 6000; ++row) {
+      tall.SetCell(Position{row, 0}, "1");
+    }
+    tall.SetCell("C2"_pos, "5");
+    tall.SetCell("AB3"_pos, "=SUM(A1:ZZ2)");
+    ASSERT_EQUAL(tall.GetCell("AB3"_pos)->GetValue(), ICell::Value(7.0));
+    tall.SetCell("C1"_pos, "3");
+    tall.SetCell("E2"_pos, "4");
+    ASSERT_EQUAL(tall.GetCell("AB3"_pos)->GetValue(), ICell::Value(14.0));
+    ASSERT_EQUAL(tall.SummarizeRange({"C1"_pos, "E6000"_pos}).sum, 12.0);
+  }
+  void TestRangeDependencyIndex() {
+    RangeDependencyIndex index;
+    std::vector<std::pair<CellRange, Position>> entries;
+    for (int i = 0; i < 200; ++i) {
+      CellRange range{ Position{ (i * 7) % 50, i % 5 }, Position{ (i * 7) % 50 + i % 13, i % 5 + i % 3 } };
+      Position dependent{ i, 10 };
+      index.Add(range, dependent);
+      entries.push_back({ range, dependent });
+    }
+    for (int i = 0; i < 200; i += 3) {
+      index.Remove(Position{ i, 10 });
+    }
+    ASSERT_EQUAL(index.GetSize(), 133u);
+
+    for (int row = 0; row < 70; ++row) {
+      for (int col = 0; col < 8; ++col) {
+        Position pos{ row, col };
+        std::vector<Position> expected;
+        for (const auto& [range, dependent] : entries) {
+          if (dependent.row % 3 != 0 && range.Contains(pos)) {
+            expected.push_back(dependent);
+          }
+        }
+        ASSERT_EQUAL(index.FindDependents(pos), expected);
+      }
+    }
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("C1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("C2"_pos, "=C1*2");
+    sheet.SetCell("C3"_pos, "=MAX(C1:C2)");
+    sheet.SetCell("A500"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(13.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), ICell::Value(26.0));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(26.0));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), ICell::Value(22.0));
+    sheet.DeleteRows(400, 200);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(A1:A800)");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(1.0));
+    sheet.SetCell("C1"_pos, "5");
+    sheet.SetCell("A1"_pos, "100");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(5.0));
+  }
+  void TestConcurrentReaders() {
+    const int rows = 100;
+    ConcurrentSheet sheet;
+    for (int row = 0; row < rows; ++row) {
+      sheet.GetSheet().SetCell(Position{row, 0}, "0");
+    }
+    sheet.GetSheet().SetCell("C1"_pos, "=SUM(A1:A100)");
+    sheet.GetSheet().SetCell("C2"_pos, "=C1*2");
+    sheet.Commit();
+
+    std::atomic<bool> done{false};
+    std::atomic<int> inconsistent{0};
+    auto read = [&]() {
+      uint64_t last_version = 0;
+      while (!done.load()) {
+        auto view = sheet.GetView();
+        if (view->GetVersion() < last_version) {
+          ++inconsistent;
+        }
+        last_version = view->GetVersion();
+        double sum = 0;
+        for (int row = 0; row < rows; ++row) {
+          sum += std::get<double>(view->GetCell(Position{row, 0})->GetValue());
+        }
+        double total = std::get<double>(view->GetCell("C1"_pos)->GetValue());
+        double doubled = std::get<double>(view->GetCell("C2"_pos)->GetValue());
+        if (sum != total || doubled != 2 * total) {
+          ++inconsistent;
+        }
+        std::ostringstream values;
+        view->PrintValues(values);
+      }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+      readers.emplace_back(read);
+    }
+    for (int i = 1; i <= 2000; ++i) {
+      sheet.GetSheet().SetCell(Position{i % rows, 0}, std::to_string(i));
+      sheet.Commit();
+      if (i % 500 == 0) {
+        sheet.GetSheet().InsertRows(rows + 10);
+        sheet.Commit();
+      }
+    }
+    done = true;
+    for (auto& reader : readers) {
+      reader.join();
+    }
+
+    ASSERT_EQUAL(inconsistent.load(), 0);
+    auto view = sheet.GetView();
+    ASSERT_EQUAL(view->GetVersion(), 2005u);
+    std::ostringstream expected;
+    std::ostringstream actual;
+    sheet.GetSheet().PrintValues(expected);
+    view->PrintValues(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+    ASSERT_EQUAL(view->GetCell("A1"_pos)->GetText(), "2000");
+    ASSERT_EQUAL(view->GetCell("B1"_pos), nullptr);
+  }
+  void TestSheetVersions() {
+    ConcurrentSheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+      sheet.GetSheet().SetCell(Position{row, 0}, std::to_string(row));
+    }
+    sheet.GetSheet().SetCell("B1"_pos, "=SUM(A1:A1000)");
+    sheet.Commit();
+    auto first = sheet.GetView();
+
+    sheet.GetSheet().SetCell("A501"_pos, "0");
+    sheet.Commit();
+    auto second = sheet.GetView();
+    ASSERT_EQUAL(second->GetChangedRows(*first), (std::vector<int>{0, 500}));
+    ASSERT(first->GetRow(700) == second->GetRow(700));
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->GetValue(), ICell::Value(499500.0));
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->GetValue(), ICell::Value(499000.0));
+
+    sheet.GetSheet().InsertRows(0, 2);
+    sheet.GetSheet().SetCell("A1"_pos, "=B3");
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetView()->GetCell("A1"_pos)->GetValue(), ICell::Value(499000.0));
+
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetView() == second);
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("B1"_pos)->GetText(), "=SUM(A1:A1000)");
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("A1"_pos)->GetText(), "0");
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetView() == first);
+    ASSERT(sheet.Undo());
+    ASSERT(!sheet.Undo());
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("B1"_pos), nullptr);
+
+    std::ostringstream expected;
+    std::ostringstream actual;
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.GetView() == first);
+    first->PrintTexts(expected);
+    sheet.GetSheet().PrintTexts(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("B1"_pos)->GetValue(), ICell::Value(499500.0));
+
+    sheet.GetSheet().SetCell("A1"_pos, "1");
+    sheet.Commit();
+    ASSERT(!sheet.Redo());
+    ASSERT_EQUAL(sheet.GetView()->GetCell("B1"_pos)->GetValue(), ICell::Value(499501.0));
+  }
+  void TestSheetVersionsRestore() {
+    ConcurrentSheet sheet;
+    sheet.GetSheet().SetCell("A1"_pos, "1");
+    for (int row = 1; row < 2000; ++row) {
+      sheet.GetSheet().SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    sheet.GetSheet().SetCell("B1"_pos, "=Z50");
+    sheet.Commit();
+    auto first = sheet.GetView();
+
+    sheet.GetSheet().SetCell("A1"_pos, "5");
+    sheet.GetSheet().SetCell("B1"_pos, "2");
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetSheet().GetPrintableSize(), (Size{2000, 2}));
+
+    sheet.GetSheet().ResetRecalculationStats();
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetView() == first);
+    ASSERT_EQUAL(sheet.GetSheet().GetRecalculationStats().evaluated, 0u);
+    ASSERT_EQUAL(sheet.GetSheet().GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("A2000"_pos)->GetValue(), ICell::Value(2000.0));
+    ASSERT_EQUAL(sheet.GetSheet().GetPrintableSize(), first->GetPrintableSize());
+
+    // заглушка не становится настоящей ячейкой и пропадает вместе со ссылкой
+    sheet.GetSheet().SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetSheet().GetPrintableSize(), (Size{2000, 2}));
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("Z50"_pos), nullptr);
+    sheet.GetSheet().SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("A2000"_pos)->GetValue(), ICell::Value(2002.0));
+
+    sheet.GetSheet().SetCalculationMode(Sheet::CalculationMode::Manual);
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.GetSheet().GetCalculationMode() == Sheet::CalculationMode::Manual);
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("A2000"_pos)->GetValue(), ICell::Value(2004.0));
+    sheet.GetSheet().Recalculate();
+    ASSERT_EQUAL(sheet.GetSheet().GetCell("A2000"_pos)->GetValue(), ICell::Value(2004.0));
+
+    // формула со ссылкой на заглушку лежит в строке, которую откат не трогает
+    ConcurrentSheet other;
+    other.GetSheet().SetCell("A1"_pos, "=B5");
+    other.Commit();
+    auto with_placeholder = other.GetView();
+    other.GetSheet().SetCell("C5"_pos, "x");
+    other.Commit();
+    other.GetSheet().SetCell("B5"_pos, "7");
+    other.Commit();
+    ASSERT(other.Undo());
+    ASSERT(other.Undo());
+    ASSERT(other.GetView() == with_placeholder);
+    ASSERT(other.GetSheet().GetCell("B5"_pos) != nullptr);
+    ASSERT_EQUAL(other.GetSheet().GetCell("B5"_pos)->GetText(), "");
+    ASSERT_EQUAL(other.GetSheet().GetPrintableSize(), (Size{5, 2}));
+    ASSERT_EQUAL(other.GetSheet().GetPrintableSize(), with_placeholder->GetPrintableSize());
+    other.GetSheet().SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(other.GetSheet().GetCell("B5"_pos), nullptr);
+    ASSERT_EQUAL(other.GetSheet().GetPrintableSize(), (Size{1, 1}));
+  }
+  void TestOperationLogRecovery() {
+    namespace fs = std::filesystem;
+    const fs::path directory = fs::temp_directory_path()
+        / ("spreadsheet_oplog_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    fs::remove_all(directory);
+
+    std::vector<std::function<void(ISheet&)>> operations = {
+      [](ISheet& sheet) { sheet.SetCell("A1"_pos, "1"); },
+      [](ISheet& sheet) { sheet.SetCell("A2"_pos, "2"); },
+      [](ISheet& sheet) { sheet.SetCell("B1"_pos, "=SUM(A1:A5)"); },
+      [](ISheet& sheet) { sheet.SetCell("C3"_pos, "'=text"); },
+      [](ISheet& sheet) { sheet.InsertRows(1, 2); },
+      [](ISheet& sheet) { sheet.SetCell("A2"_pos, "=A1*2"); },
+      [](ISheet& sheet) { sheet.ClearCell("C5"_pos); },
+      [](ISheet& sheet) { sheet.DeleteCols(2); },
+      [](ISheet& sheet) { sheet.InsertCols(0); },
+      [](ISheet& sheet) { sheet.DeleteRows(5); },
+    };
+    auto texts_of = [](const ISheet& sheet) {
+      std::ostringstream texts;
+      sheet.PrintTexts(texts);
+      return texts.str();
+    };
+
+    std::vector<std::string> expected_texts{ texts_of(Sheet()) };
+    std::vector<uintmax_t> log_sizes{ 0 };
+    {
+      Sheet reference;
+      LoggedSheet sheet(directory, 1);
+      for (const auto& operation : operations) {
+        operation(reference);
+        operation(sheet);
+        expected_texts.push_back(texts_of(reference));
+        log_sizes.push_back(fs::file_size(directory / "oplog.0"));
+      }
+    }
+
+    // сбой посреди записи: журнал обрывается на произвольном байте
+    std::vector<char> log_data;
+    {
+      std::ifstream input(directory / "oplog.0", std::ios::binary);
+      log_data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    }
+    for (size_t i = 0; i < operations.size(); ++i) {
+      for (uintmax_t cut : { log_sizes[i], log_sizes[i] + 3, log_sizes[i + 1] - 1 }) {
+        {
+          std::ofstream output(directory / "oplog.0", std::ios::binary | std::ios::trunc);
+          output.write(log_data.data(), cut);
+        }
+        LoggedSheet recovered(directory, 1);
+        ASSERT_EQUAL(texts_of(recovered), expected_texts[i]);
+        ASSERT_EQUAL(fs::file_size(directory / "oplog.0"), log_sizes[i]);
+      }
+    }
+    {
+      std::ofstream output(directory / "oplog.0", std::ios::binary | std::ios::trunc);
+      output.write(log_data.data(), log_data.size());
+    }
+
+    {
+      LoggedSheet sheet(directory, 1 << 16, 1 << 20);
+      ASSERT_EQUAL(texts_of(sheet), expected_texts.back());
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(B1:B6)");
+      ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(5.0));
+      sheet.Compact();
+      sheet.SetCell("D1"_pos, "=C1+1");
+      sheet.Sync();
+      sheet.SetCell("D2"_pos, "lost");
+      expected_texts.push_back(texts_of(sheet));
+    }
+    ASSERT(fs::exists(directory / "snapshot"));
+    ASSERT(!fs::exists(directory / "oplog.0"));
+    // сбой во время свёртки: недописанный снимок и журнал прошлого поколения
+    std::ofstream(directory / "snapshot.tmp") << "garbage";
+    std::ofstream(directory / "oplog.0") << "stale";
+    {
+      LoggedSheet recovered(directory);
+      ASSERT_EQUAL(texts_of(recovered), expected_texts.back());
+      ASSERT_EQUAL(recovered.GetCell("D1"_pos)->GetValue(), ICell::Value(6.0));
+    }
+    ASSERT(!fs::exists(directory / "oplog.0"));
+
+    {
+      LoggedSheet sheet(directory, 1 << 16, 256);
+      for (int i = 0; i < 100; ++i) {
+        sheet.SetCell(Position{i, 5}, std::to_string(i));
+      }
+      expected_texts.push_back(texts_of(sheet));
+    }
+    ASSERT_EQUAL(texts_of(LoggedSheet(directory)), expected_texts.back());
+    fs::remove_all(directory);
+
+    // цепочка из снимка загружается одним пакетом, заглушки в снимок не попадают
+    const int chain = 2000;
+    Size chain_size;
+    {
+      LoggedSheet sheet(directory);
+      sheet.SetCell("A1"_pos, "1");
+      for (int row = 1; row < chain; ++row) {
+        sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+      }
+      sheet.SetCell("B1"_pos, "=Z50");
+      chain_size = sheet.GetPrintableSize();
+      sheet.Compact();
+    }
+    {
+      LoggedSheet recovered(directory);
+      ASSERT_EQUAL(recovered.GetCell(Position{chain - 1, 0})->GetValue(), ICell::Value(double(chain)));
+      ASSERT_EQUAL(recovered.GetPrintableSize(), chain_size);
+      recovered.SetCell("B1"_pos, "1");
+      ASSERT_EQUAL(recovered.GetPrintableSize(), (Size{chain, 2}));
+    }
+    fs::remove_all(directory);
+
+    // запись, которую лист отвергает, прерывает восстановление, но режим вычислений возвращается
+    fs::create_directories(directory);
+    {
+      OperationLog log(directory, 0, 1 << 16);
+      log.AppendSetCell("A1"_pos, "2");
+      log.AppendSetCell("B1"_pos, "=B1");
+    }
+    Sheet target;
+    bool caught = false;
+    try {
+      OperationLog::Recover(directory, target);
+    } catch (const CircularDependencyException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(target.GetCalculationMode() == Sheet::CalculationMode::Automatic);
+    fs::remove_all(directory);
+  }
+  void TestEvalValue() {
+    static_assert(sizeof(EvalValue) == sizeof(double));
+    for (auto category : {FormulaError::Category::Ref, FormulaError::Category::Value, FormulaError::Category::Div0}) {
+      EvalValue value = category;
+      ASSERT(value.IsError());
+      ASSERT_EQUAL(value.GetError(), FormulaError(category));
+      ASSERT_EQUAL(std::get<FormulaError>(value.ToValue()), FormulaError(category));
+    }
+    for (double number : {0.0, -0.0, 1.5, -1e300, std::numeric_limits<double>::infinity()}) {
+      EvalValue value = number;
+      ASSERT(!value.IsError());
+      ASSERT_EQUAL(std::get<double>(value.ToValue()), number);
+    }
+    ASSERT(!EvalValue(std::numeric_limits<double>::quiet_NaN()).IsError());
+    ASSERT(!EvalValue(-std::numeric_limits<double>::quiet_NaN()).IsError());
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    sheet.SetCell("A2"_pos, "'");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "2.5");
+    ASSERT_EQUAL(EvalValue::FromCell(sheet.GetCell("A1"_pos)).GetError(), FormulaError(FormulaError::Category::Value));
+    ASSERT_EQUAL(EvalValue::FromCell(sheet.GetCell("A2"_pos)).GetNumber(), 0.0);
+    ASSERT_EQUAL(EvalValue::FromCell(sheet.GetCell("A3"_pos)).GetError(), FormulaError(FormulaError::Category::Div0));
+    ASSERT_EQUAL(EvalValue::FromCell(sheet.GetCell("A4"_pos)).GetNumber(), 2.5);
+    ASSERT_EQUAL(EvalValue::FromCell(sheet.GetCell("B9"_pos)).GetNumber(), 0.0);
+  }
+  void TestNumericTextClassification() {
+    Sheet sheet;
+    const std::pair<std::string, ICell::Value> cases[] = {
+        {"3", 3.0}, {"-2.5", -2.5}, {"+7", 7.0}, {"1e3", 1000.0}, {".5", 0.5},
+        {"3D", "3D"}, {"12 ", "12 "}, {" 12", " 12"}, {"+-1", "+-1"}, {"inf", "inf"},
+        {"nan", "nan"}, {"1e999", "1e999"}, {"abc", "abc"}, {"'5", "5"},
+    };
+    int row = 0;
+    for (const auto& [text, expected] : cases) {
+      Position pos{row++, 0};
+      sheet.SetCell(pos, text);
+      ASSERT_EQUAL(sheet.GetCell(pos)->GetValue(), expected);
+      ASSERT_EQUAL(sheet.GetCell(pos)->GetText(), text);
+    }
+
+    sheet.SetCell("B1"_pos, "=A1+A6");
+    sheet.SetCell("B2"_pos, "=A1+A5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), ICell::Value(3.5));
+    sheet.SetCell("A6"_pos, "4");
+    sheet.RecalculateAll();
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ICell::Value(7.0));
+  }
+  void TestMappedSheet() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path()
+        / ("spreadsheet_mapped_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2.5");
+    sheet.SetCell("A3"_pos, "'=text");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=A3*2");
+    sheet.SetCell("B3"_pos, "=SUM(A1:B1)");
+    sheet.SetCell("C5"_pos, "label");
+    sheet.SetCell("D4"_pos, "=1/0");
+    sheet.SetCell("E1"_pos, "x");
+    sheet.ClearCell("E1"_pos);
+    MappedSheet::Write(sheet, path);
+
+    {
+      MappedSheet mapped(path);
+      ASSERT_EQUAL(mapped.GetCellCount(), 8u);
+      ASSERT_EQUAL(mapped.GetPrintableSize(), sheet.GetPrintableSize());
+      std::ostringstream expected_values, expected_texts, values, texts;
+      sheet.PrintValues(expected_values);
+      sheet.PrintTexts(expected_texts);
+      mapped.PrintValues(values);
+      mapped.PrintTexts(texts);
+      ASSERT_EQUAL(values.str(), expected_values.str());
+      ASSERT_EQUAL(texts.str(), expected_texts.str());
+
+      for (int row = 0; row < 6; ++row) {
+        for (int col = 0; col < 6; ++col) {
+          Position pos{row, col};
+          const ICell* expected = sheet.GetCell(pos);
+          const ICell* cell = mapped.GetCell(pos);
+          ASSERT_EQUAL(cell == nullptr, expected == nullptr);
+          if (cell != nullptr) {
+            ASSERT_EQUAL(cell->GetValue(), expected->GetValue());
+            ASSERT_EQUAL(cell->GetText(), expected->GetText());
+            ASSERT_EQUAL(cell->GetReferencedCells(), expected->GetReferencedCells());
+          }
+        }
+      }
+      ASSERT_EQUAL(mapped.GetCellView("B1"_pos)->GetValue(), mapped.GetCell("B1"_pos)->GetValue());
+      ASSERT(!mapped.GetCellView("F9"_pos));
+      // указатели на представления остаются действительными, пока жив лист
+      const ICell* first_view = mapped.GetCell("A1"_pos);
+      for (int i = 0; i < 5000; ++i) {
+        ASSERT(mapped.GetCell("A2"_pos) != first_view);
+      }
+      ASSERT_EQUAL(mapped.GetCell("A1"_pos), first_view);
+      ASSERT_EQUAL(first_view->GetText(), "1");
+
+      CellRange range{"A1"_pos, "D5"_pos};
+      RangeSummary summary = mapped.SummarizeRange(range);
+      RangeSummary expected_summary = sheet.SummarizeRange(range);
+      ASSERT_EQUAL(summary.sum, expected_summary.sum);
+      ASSERT_EQUAL(summary.count, expected_summary.count);
+      ASSERT(summary.first_error == expected_summary.first_error);
+
+      ASSERT_EQUAL(std::get<double>(ParseFormula("B3+SUM(A1:A2)")->Evaluate(mapped)), 8.0);
+      ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("A3+1")->Evaluate(mapped)),
+                   FormulaError(FormulaError::Category::Value));
+
+      bool caught = false;
+      try {
+        mapped.SetCell("A1"_pos, "2");
+      } catch (const MappedSheetException&) {
+        caught = true;
+      }
+      ASSERT(caught);
+    }
+
+    // в файл попадают значения после пересчёта, а не устаревшие
+    sheet.SetCalculationMode(Sheet::CalculationMode::Manual);
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("F1"_pos, "=A1*3");
+    MappedSheet::Write(sheet, path);
+    {
+      MappedSheet mapped(path);
+      ASSERT_EQUAL(mapped.GetCell("B1"_pos)->GetValue(), ICell::Value(12.5));
+      ASSERT_EQUAL(mapped.GetCell("F1"_pos)->GetValue(), ICell::Value(30.0));
+    }
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    // испорченные вид ячейки, код ошибки и смещение ссылок находятся при чтении ячейки
+    auto expect_corrupted = [&path](uint64_t offset, char byte, Position pos) {
+      {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(offset);
+        file.put(byte);
+      }
+      MappedSheet mapped(path);
+      ASSERT_EQUAL(mapped.GetCellCount(), 9u);
+      bool caught = false;
+      try {
+        const ICell* cell = mapped.GetCell(pos);
+        cell->GetValue();
+        cell->GetReferencedCells();
+      } catch (const MappedSheetException&) {
+        caught = true;
+      }
+      ASSERT(caught);
+    };
+    auto read_header_field = [&path](uint64_t offset) {
+      std::ifstream file(path, std::ios::binary);
+      file.seekg(offset);
+      uint64_t value = 0;
+      file.read(reinterpret_cast<char*>(&value), sizeof(value));
+      return value;
+    };
+    const uint64_t cell_count = read_header_field(24);
+    const uint64_t heap_size = read_header_field(40);
+    const uint64_t kinds_offset = fs::file_size(path) - heap_size - cell_count;
+    const uint64_t numbers_offset = 48 + cell_count * 8;
+    const uint64_t ref_offsets_offset = 48 + 3 * cell_count * 8 + 8;
+    expect_corrupted(kinds_offset + 3, 7, "A2"_pos);
+    MappedSheet::Write(sheet, path);
+    // ячейки упорядочены по номерам: A1 B1 F1 A2 B2 A3 B3 D4 C5; старший байт
+    // делает код ошибки D4 огромным
+    expect_corrupted(numbers_offset + 7 * 8 + 7, 0x7f, "D4"_pos);
+    MappedSheet::Write(sheet, path);
+    expect_corrupted(ref_offsets_offset + 8 + 7, 1, "A1"_pos);
+
+    {
+      std::ofstream truncated(path, std::ios::binary | std::ios::trunc);
+      truncated << "SSHEETMM";
+    }
+    bool caught = false;
+    try {
+      MappedSheet mapped(path);
+    } catch (const MappedSheetException&) {
+      caught = true;
+    }
+    ASSERT(caught);
+    fs::remove(path);
+  }
+  void TestDependencyGraph() {
+    DependencyGraph graph;
+    std::map<Position, std::set<Position>> expected;
+    auto to_set = [](const std::vector<Position>& positions) {
+      return std::set<Position>(begin(positions), end(positions));
+    };
+    std::vector<std::pair<Position, std::vector<Position>>> batch;
+    for (int i = 0; i < 3000; ++i) {
+      Position pos{(i * 37) % 60, (i * 11) % 7};
+      std::vector<Position> precedents;
+      for (int j = 0; j < i % 4; ++j) {
+        precedents.push_back({(i + j * 13) % 50, j});
+      }
+      precedents.push_back(precedents.empty() ? Position{0, 0} : precedents.front());
+      if (i % 5 == 0) {
+        precedents.clear();
+      }
+      // последняя треть ставится одним пакетом, поверх ссылок из буфера
+      if (i < 2000) {
+        graph.SetPrecedents(pos, precedents);
+      }
+      else {
+        batch.push_back({pos, precedents});
+      }
+      expected[pos] = to_set(precedents);
+    }
+    graph.SetPrecedents(std::move(batch));
+
+    size_t edge_count = 0;
+    std::map<Position, std::set<Position>> expected_dependents;
+    for (const auto& [pos, precedents] : expected) {
+      ASSERT_EQUAL(to_set(graph.GetPrecedents(pos)), precedents);
+      ASSERT_EQUAL(graph.GetPrecedents(pos).size(), precedents.size());
+      edge_count += precedents.size();
+      for (const auto& precedent : precedents) {
+        expected_dependents[precedent].insert(pos);
+      }
+    }
+    ASSERT_EQUAL(graph.GetEdgeCount(), edge_count);
+    for (int row = 0; row < 60; ++row) {
+      for (int col = 0; col < 7; ++col) {
+        Position pos{row, col};
+        auto dependents = graph.GetDependents(pos);
+        ASSERT_EQUAL(dependents.size(), expected_dependents[pos].size());
+        ASSERT_EQUAL(to_set(dependents), expected_dependents[pos]);
+      }
+    }
+    ASSERT(graph.GetMemoryUsage() > 0);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(15.0));
+    sheet.SetCell("B1"_pos, "=A2");
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetDependents("A1"_pos), std::vector<Position>{"C1"_pos});
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ICell::Value(7.0));
+    sheet.ClearCell("C1"_pos);
+    ASSERT(sheet.GetDependencyGraph().GetDependents("A1"_pos).empty());
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetEdgeCount(), 1u);
+
+    sheet.SetCell("D5"_pos, "=A2+B1");
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=A1+#REF!");
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetDependents("A1"_pos), std::vector<Position>{"D4"_pos});
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("D4"_pos)->GetValue()), FormulaError(FormulaError::Category::Ref));
+  }
+  void TestStaleEdgeCleanup() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    ASSERT(sheet.GetCell("B1"_pos) != nullptr && sheet.GetCell("C1"_pos) != nullptr);
+    sheet.SetCell("A1"_pos, "=D1");
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr && sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("D1"_pos) != nullptr);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetEdgeCount(), 0u);
+
+    sheet.SetCell("A1"_pos, "=B2");
+    sheet.SetCell("A2"_pos, "=B2*2");
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("B2"_pos) != nullptr);
+    sheet.SetCell("A2"_pos, "3");
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+
+    sheet.SetCell("E1"_pos, "");
+    sheet.SetCell("A3"_pos, "=E1");
+    sheet.ClearCell("A3"_pos);
+    ASSERT(sheet.GetCell("E1"_pos) != nullptr);
+
+    std::mt19937 generator(42);
+    auto random_pos = [&generator]() {
+      return Position{static_cast<int>(generator() % 20), static_cast<int>(generator() % 5)};
+    };
+    for (int i = 0; i < 20000; ++i) {
+      Position pos = random_pos();
+      switch (generator() % 3) {
+        case 0:
+          sheet.SetCell(pos, std::to_string(i));
+          break;
+        case 1:
+          try {
+            sheet.SetCell(pos, "=" + random_pos().ToString() + "+" + random_pos().ToString());
+          } catch (const CircularDependencyException&) {
+          }
+          break;
+        default:
+          sheet.ClearCell(pos);
+      }
+    }
+
+    size_t edge_count = 0;
+    for (int row : sheet.GetRowIndexes()) {
+      for (const auto& [col, cell] : *sheet.GetRow(row)) {
+        Position pos{row, col};
+        auto referenced = cell->GetReferencedCells();
+        edge_count += referenced.size();
+        ASSERT_EQUAL(sheet.GetDependencyGraph().GetPrecedents(pos), referenced);
+        for (const auto& ref : referenced) {
+          auto dependents = sheet.GetDependencyGraph().GetDependents(ref);
+          ASSERT(std::count(begin(dependents), end(dependents), pos) == 1);
+        }
+        if (cell->IsPlaceholder()) {
+          ASSERT(sheet.GetDependencyGraph().HasDependents(pos));
+        }
+      }
+    }
+    ASSERT_EQUAL(sheet.GetDependencyGraph().GetEdgeCount(), edge_count);
+  }
+  void TestCalculationModes() {
+    Sheet sheet;
+    auto value_of = [&sheet](Position pos) {
+      return sheet.GetCell(pos)->GetValue();
+    };
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("E1"_pos, "=SUM(A1:A3)");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    sheet.SetCalculationMode(Sheet::CalculationMode::Manual);
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("D1"_pos, "=A1");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 4u);
+    ASSERT_EQUAL(value_of("B1"_pos), ICell::Value(2.0));
+    ASSERT_EQUAL(value_of("E1"_pos), ICell::Value(1.0));
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 4u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(value_of("B2"_pos), ICell::Value(10.0));
+    ASSERT_EQUAL(value_of("C2"_pos), ICell::Value(11.0));
+    ASSERT_EQUAL(value_of("D2"_pos), ICell::Value(5.0));
+    ASSERT_EQUAL(value_of("E2"_pos), ICell::Value(5.0));
+
+    sheet.SetCalculationMode(Sheet::CalculationMode::Deferred);
+    sheet.SetCell("A2"_pos, "7");
+    sheet.SetCell("A3"_pos, "1");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 4u);
+    ASSERT_EQUAL(value_of("C2"_pos), ICell::Value(15.0));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 2u);
+    ASSERT_EQUAL(sheet.SummarizeRange({"D2"_pos, "E2"_pos}).sum, 15.0);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    sheet.SetCell("A2"_pos, "3");
+    sheet.DeleteRows(0);
+    sheet.ClearCell("D1"_pos);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 3u);
+    sheet.SetCalculationMode(Sheet::CalculationMode::Automatic);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(value_of("C1"_pos), ICell::Value(7.0));
+    ASSERT_EQUAL(value_of("E1"_pos), ICell::Value(4.0));
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(value_of("C1"_pos), ICell::Value(1.0));
+  }
+  void TestEarlyCutoff() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "20");
+    sheet.SetCell("B1"_pos, "=MIN(A1,10)");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    for (int row = 1; row < 100; ++row) {
+      sheet.SetCell(Position{row, 2}, "=" + Position{row - 1, 2}.ToString() + "+1");
+    }
+    sheet.SetCell("D1"_pos, "=SUM(C1:C100)");
+    sheet.SetCell("E1"_pos, "=A1*0");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(6050.0));
+
+    sheet.ResetRecalculationStats();
+    sheet.SetCell("A1"_pos, "30");
+    ASSERT_EQUAL(sheet.GetRecalculationStats().evaluated, 2u);
+    ASSERT_EQUAL(sheet.GetRecalculationStats().pruned, 101u);
+
+    sheet.ResetRecalculationStats();
+    sheet.SetCell("A1"_pos, "9");
+    ASSERT_EQUAL(sheet.GetRecalculationStats().evaluated, 103u);
+    ASSERT_EQUAL(sheet.GetRecalculationStats().pruned, 0u);
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), ICell::Value(109.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(5950.0));
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), ICell::Value(0.0));
+  }
+  void TestDeepFormula() {
+    const int terms = 50'000;
+    std::string expression;
+    for (int i = 0; i < terms; ++i) {
+      if (i > 0) {
+        expression += '+';
+      }
+      expression += Position{i % 1000, 0}.ToString();
+    }
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+      sheet.SetCell(Position{row, 0}, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1001"_pos, "=" + expression + "+SUM(A1:A2)");
+    ASSERT_EQUAL(sheet.GetCell("B1001"_pos)->GetValue(), ICell::Value(25'025'003.0));
+    ASSERT_EQUAL(sheet.GetCell("B1001"_pos)->GetText(), "=" + expression + "+SUM(A1:A2)");
+
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("B1000"_pos)->GetValue()), FormulaError(FormulaError::Category::Ref));
+    std::string text = sheet.GetCell("B1000"_pos)->GetText();
+    ASSERT_EQUAL(text.substr(0, 13), "=#REF!+A1+A2+");
+    ASSERT_EQUAL(text.substr(text.size() - 11), "+SUM(A1:A1)");
+
+    // унарные операции и скобки вложены справа, такие цепочки собираются вручную
+    auto chain = std::make_unique<Ast::ValueOperation>();
+    chain->value = 1.0;
+    std::unique_ptr<Ast::Statement> root = std::move(chain);
+    for (int i = 0; i < 200'000; ++i) {
+      if (i % 2 == 0) {
+        auto unary_op = std::make_unique<Ast::UnaryOperation>();
+        unary_op->operation_type = Ast::OperationType::Sub;
+        unary_op->rhs = std::move(root);
+        root = std::move(unary_op);
+      } else {
+        auto parentesis_op = std::make_unique<Ast::ParentesisOperation>();
+        parentesis_op->body = std::move(root);
+        root = std::move(parentesis_op);
+      }
+    }
+    ASSERT_EQUAL(std::get<double>(root->Evaluate(sheet, Position{0, 0}).ToValue()), 1.0);
+    ASSERT_EQUAL(root->ToString(Position{0, 0}), std::string(100'000, '-') + "1");
+    ASSERT_EQUAL(Ast::Compile(Ast::Flatten(root.get())).size(), 100'001u);
+    root.reset();
+  }
+  void TestFormulaParserReuse() {
+    auto evaluate = [](std::string expression) {
+      Sheet sheet;
+      sheet.SetCell("A1"_pos, "2");
+      return std::get<double>(ParseFormula(std::move(expression))->Evaluate(sheet));
+    };
+    // парсер потока остаётся рабочим после ошибок лексера и парсера
+    for (const std::string invalid : {"3X", "((1)", "2+4-", "SUM(A1:)"}) {
+      try {
+        ParseFormula(invalid);
+        ASSERT(false);
+      } catch (const FormulaException&) {
+      }
+      ASSERT_EQUAL(evaluate("(A1+1)*SUM(A1:A2,3)"), 15.0);
+    }
+
+    std::vector<std::thread> parsers;
+    std::atomic<int> failures = 0;
+    for (int i = 0; i < 4; ++i) {
+      parsers.emplace_back([&failures, &evaluate, i]() {
+        for (int j = 0; j < 200; ++j) {
+          if (evaluate("A1*" + std::to_string(i * 1000 + j)) != 2.0 * (i * 1000 + j)) {
+            ++failures;
+          }
+        }
+      });
+    }
+    for (auto& parser : parsers) {
+      parser.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0);
+  }
+  void TestBulkLoad() {
+    auto texts_and_values = [](const Sheet& sheet) {
+      std::ostringstream out;
+      sheet.PrintTexts(out);
+      sheet.PrintValues(out);
+      return out.str();
+    };
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 3000; ++row) {
+      std::string r = std::to_string(row + 1);
+      // формулы ссылаются и на ячейки, загружаемые позже
+      cells.push_back({Position{row, 1}, "=A" + r + "*2+C" + r});
+      cells.push_back({Position{row, 0}, r});
+      cells.push_back({Position{row, 2}, row % 2 == 0 ? "text" : "=SUM(A1:A" + r + ")"});
+    }
+    cells.push_back({"D1"_pos, "=E1+1"});
+    cells.push_back({"A1"_pos, "10"});
+
+    Sheet expected;
+    expected.SetCell("E1"_pos, "5");
+    for (const auto& [pos, text] : cells) {
+      expected.SetCell(pos, text);
+    }
+    for (size_t thread_count : {1u, 4u}) {
+      Sheet sheet;
+      sheet.SetCell("E1"_pos, "5");
+      sheet.SetCells(cells, thread_count);
+      ASSERT_EQUAL(sheet.GetPrintableSize(), expected.GetPrintableSize());
+      ASSERT_EQUAL(texts_and_values(sheet), texts_and_values(expected));
+      sheet.SetCell("E1"_pos, "7");
+      ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ICell::Value(8.0));
+    }
+
+    // ошибка разбора и цикл не меняют лист
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1");
+    sheet.SetCell("B1"_pos, "1");
+    std::string before = texts_and_values(sheet);
+    try {
+      sheet.SetCells({{"C1"_pos, "=A1"}, {"B1"_pos, "=1+"}});
+      ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+    ASSERT_EQUAL(texts_and_values(sheet), before);
+    try {
+      sheet.SetCells({{"C1"_pos, "=A1"}, {"B1"_pos, "=SUM(C1:C2)"}, {"Z100"_pos, "1"}});
+      ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(texts_and_values(sheet), before);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(2.0));
+  }
+  void TestFormulaTextCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "10");
+    for (int row = 0; row < 100; ++row) {
+      sheet.SetCell(Position{row, 2}, "=A1*1.2");
+    }
+    auto stats = sheet.GetFormulaCacheStats();
+    ASSERT_EQUAL(stats.misses, 1u);
+    ASSERT_EQUAL(stats.hits, 99u);
+    ASSERT_EQUAL(stats.entries, 1u);
+    ASSERT(stats.memory_usage > 0);
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetText(), "=A1*1.2");
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), ICell::Value(12.0));
+    // шаблоны из кэша не меняются при сдвиге ссылок
+    sheet.InsertRows(0);
+    sheet.SetCell("A2"_pos, "20");
+    ASSERT_EQUAL(sheet.GetCell("C101"_pos)->GetText(), "=A2*1.2");
+    ASSERT_EQUAL(sheet.GetCell("C101"_pos)->GetValue(), ICell::Value(24.0));
+    sheet.SetCell("D1"_pos, "=A1*1.2");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=A1*1.2");
+
+    // вытесняется давно не использованный текст
+    FormulaTemplateCache templates;
+    FormulaTextCache& texts = templates.GetTextCache();
+    ParseFormula("A1+1", Position{0, 0}, templates);
+    size_t entry_size = texts.GetStats().memory_usage;
+    texts.SetMemoryBudget(entry_size * 5 / 2);
+    ParseFormula("A1+2", Position{0, 0}, templates);
+    ASSERT_EQUAL(ParseFormula("A1+1", Position{5, 5}, templates)->GetExpression(), "A1+1");
+    ParseFormula("A1+3", Position{0, 0}, templates);
+    ParseFormula("A1+2", Position{0, 0}, templates);
+    stats = texts.GetStats();
+    ASSERT_EQUAL(stats.hits, 1u);
+    ASSERT_EQUAL(stats.misses, 4u);
+    ASSERT_EQUAL(stats.evictions, 2u);
+    ASSERT_EQUAL(stats.entries, 2u);
+    texts.SetMemoryBudget(0);
+    ASSERT_EQUAL(texts.GetStats().entries, 0u);
+    ASSERT_EQUAL(texts.GetStats().memory_usage, 0u);
+  }
+  void TestTrySetCell() {
+    Sheet sheet;
+    ASSERT(sheet.TrySetCell("A1"_pos, "=B1*2") == CellStatus::Ok);
+    ASSERT(sheet.TrySetCell("B1"_pos, "3") == CellStatus::Ok);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), ICell::Value(6.0));
+    std::ostringstream before;
+    sheet.PrintTexts(before);
+
+    ASSERT(sheet.TrySetCell(Position{-1, 0}, "1") == CellStatus::InvalidPosition);
+    ASSERT(sheet.TrySetCell(Position{0, Position::kMaxCols}, "1") == CellStatus::InvalidPosition);
+    for (std::string text : {"=", "=1+", "=(1", "=1)", "=A1 B1", "=a1", "=1.", "=1e400", "=ZZZZZ1",
+                             "=FOO(1)", "=SUM()", "=SUM(A1:B2+1)", "=A1:B2", "=SUM(-A1:B2)", "=SUM(1,)", "=#"}) {
+      ASSERT(sheet.TrySetCell("B1"_pos, text) == CellStatus::InvalidFormula);
+      ASSERT(TryParseFormula(text.substr(1)) == nullptr);
+      try {
+        sheet.SetCell("B1"_pos, text);
+        ASSERT(false);
+      } catch (const FormulaException&) {
+      }
+    }
+    ASSERT(sheet.TrySetCell("B1"_pos, "=A1+1") == CellStatus::CircularDependency);
+    ASSERT(sheet.TrySetCell("B1"_pos, "=SUM(A1:A2)") == CellStatus::CircularDependency);
+    std::ostringstream after;
+    sheet.PrintTexts(after);
+    ASSERT_EQUAL(after.str(), before.str());
+
+    for (std::string text : {"=1", "=-+-1", "=.5e-3", "=1E+2", "=(((A1)))", "=SUM(A1:B2, 1, C3)", "=MAX( A1 : A2 )*2"}) {
+      ASSERT(TryParseFormula(text.substr(1)) != nullptr);
+      ASSERT(sheet.TrySetCell("C1"_pos, text) == CellStatus::Ok);
+    }
+  }
+  // CheckSyntax повторяет Formula.g4 вручную: ответы с ним и без него совпадают
+  void TestCheckSyntaxMatchesGrammar() {
+    for (std::string text : {"1.", ".5", "1E", "1E+5", "1e-", "1.e5", "..5", "SUM(A1:B2+1)", "SUM((A1:B2))",
+                             "SUM(-A1:B2)", "SUM()", "SUM(A1:B2)", "SUM(A1:B2,)", "(1,2)", "1e400", "1e-400",
+                             "A1:B2", "A1 B2", "((1)", "-(-(1))", "SUM(1)(2)", "MAX(A1,-B2*3)", "A", "A0",
+                             "ZZZZZ1", "FOO(1)", "1+\xC3\xA9", "\xC3\xA9", "", "a1"}) {
+      auto fast = TryParseFormula(text);
+      auto reference = TryParseFormulaWithGrammar(text);
+      AssertEqual(fast != nullptr, reference != nullptr, "formula " + text);
+      if (fast != nullptr) {
+        AssertEqual(fast->GetExpression(), reference->GetExpression(), "formula " + text);
+      }
+    }
+  }
+
+  void TestPrintableSizeShrinks() {
+    Sheet sheet;
+    sheet.SetCell("C5"_pos, "far");
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 3}));
+    sheet.ClearCell("C5"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet.GetRowIndexes(), std::vector<int>{0});
+
+    // заглушка под ссылку входит в размер, пока на неё ссылаются
+    sheet.SetCell("A1"_pos, "=D10");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{10, 4}));
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    sheet.SetCell("B2"_pos, "x");
+    sheet.SetCell("D4"_pos, "y");
+    sheet.DeleteCols(3);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+    ASSERT_EQUAL(sheet.GetRowIndexes(), std::vector<int>{1});
+    sheet.DeleteRows(10, 5);
+    sheet.DeleteCols(10, 5);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+    sheet.InsertRows(5, 3);
+    sheet.InsertCols(0, 2);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 4}));
+    sheet.DeleteRows(0, 1);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+    sheet.DeleteRows(0, 1);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+    ASSERT(sheet.GetRowIndexes().empty());
+  }
+  // Ресурс поверх new/delete, считающий выданные и ещё не возвращённые блоки
+  class CountingResource : public std::pmr::memory_resource {
+  public:
+    size_t allocated = 0;
+    size_t outstanding = 0;
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) {
+      ++allocated;
+      ++outstanding;
+      return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* block, size_t bytes, size_t alignment) {
+      --outstanding;
+      std::pmr::new_delete_resource()->deallocate(block, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+      return this == &other;
+    }
+  };
+
+  void TestSheetMemoryResource() {
+    CountingResource resource;
+    {
+      Sheet sheet(&resource);
+      sheet.SetCell("A1"_pos, "1");
+      sheet.SetCell("B1"_pos, "=A1+C1");
+      size_t after_set = resource.outstanding;
+      ASSERT(after_set > 0);
+      sheet.ClearCell("B1"_pos);
+      ASSERT(resource.outstanding < after_set);
+
+      std::vector<std::pair<Position, std::string>> cells;
+      for (int row = 0; row < 100; ++row) {
+        cells.push_back({Position{row, 0}, std::to_string(row)});
+        cells.push_back({Position{row, 1}, "=A" + std::to_string(row + 1) + "*2"});
+      }
+      sheet.SetCells(cells);
+      ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), ICell::Value(198.0));
+
+      // при ошибке разбора заготовленная под ячейки память возвращается
+      size_t before_error = resource.outstanding;
+      cells.back().second = "=1+";
+      try {
+        sheet.SetCells(cells);
+        ASSERT(false);
+      } catch (const FormulaException&) {
+      }
+      ASSERT_EQUAL(resource.outstanding, before_error);
+      ASSERT(sheet.TrySetCell("C1"_pos, "=(") == CellStatus::InvalidFormula);
+      ASSERT_EQUAL(resource.outstanding, before_error);
+    }
+    ASSERT(resource.allocated > 0);
+    ASSERT_EQUAL(resource.outstanding, 0u);
+  }
+  void TestReadRange() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("A2"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=A1*2+D9");
+    sheet.SetCell("B3"_pos, "");
+
+    const CellRange range{"A1"_pos, "C3"_pos};
+    double numbers[9];
+    CellValueType types[9];
+    std::string_view texts[9];
+    sheet.ReadRange(range, numbers, types, texts);
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 3; ++col) {
+        int index = row * 3 + col;
+        ICell::Value value = ICell::Value("");
+        if (const ICell* cell = sheet.GetCell(Position{row, col})) {
+          value = cell->GetValue();
+        }
+        if (const double* number = std::get_if<double>(&value)) {
+          ASSERT(types[index] == CellValueType::Number);
+          ASSERT_EQUAL(numbers[index], *number);
+        } else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+          ASSERT(types[index] == CellValueType::Error);
+          ASSERT_EQUAL(texts[index], error->ToString());
+        } else if (std::get<std::string>(value).empty()) {
+          ASSERT(types[index] == CellValueType::Empty);
+          ASSERT_EQUAL(numbers[index], 0.0);
+        } else {
+          ASSERT(types[index] == CellValueType::Text);
+          ASSERT_EQUAL(texts[index], std::get<std::string>(value));
+        }
+      }
+    }
+    ASSERT_EQUAL(numbers[5], 3.0);
+    // текст не копируется: представление указывает в значение ячейки
+    ASSERT(texts[1].data() == std::get<std::string>(sheet.GetCell("B1"_pos)->PeekValue()).data());
+
+    // отложенные формулы досчитываются при чтении
+    sheet.SetCalculationMode(Sheet::CalculationMode::Deferred);
+    sheet.SetCell("A1"_pos, "4");
+    sheet.ReadRange(CellRange{"C2"_pos, "C2"_pos}, numbers, types, texts);
+    ASSERT_EQUAL(numbers[0], 8.0);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    try {
+      sheet.ReadRange(CellRange{"B2"_pos, "A1"_pos}, numbers, types, texts);
+      ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+  }
+  void TestPriorityRecalculation() {
+    Sheet sheet;
+    auto value_of = [&sheet](Position pos) {
+      return sheet.GetCell(pos)->GetValue();
+    };
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 0; row < 100; ++row) {
+      std::string number = std::to_string(row + 1);
+      sheet.SetCell(Position{row, 1}, "=A1*" + number);
+      sheet.SetCell(Position{row, 2}, "=B" + number + "+1");
+    }
+    sheet.SetCell("D1"_pos, "=SUM(C1:C3)");
+
+    sheet.SetCalculationMode(Sheet::CalculationMode::Manual);
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 201u);
+    sheet.RecalculateRegions({CellRange{"C1"_pos, "D3"_pos}});
+    // видимые формулы и их предшественники, остальное ждёт
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 194u);
+    ASSERT_EQUAL(value_of("C3"_pos), ICell::Value(7.0));
+    ASSERT_EQUAL(value_of("D1"_pos), ICell::Value(15.0));
+    ASSERT_EQUAL(value_of("C100"_pos), ICell::Value(101.0));
+    sheet.RecalculateRegions({CellRange{"C1"_pos, "D3"_pos}});
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 194u);
+
+    size_t remaining = sheet.GetDirtyCount();
+    while (remaining > 0) {
+      size_t next = sheet.RecalculatePending(10);
+      ASSERT(next < remaining);
+      remaining = next;
+    }
+    ASSERT_EQUAL(value_of("C100"_pos), ICell::Value(201.0));
+    ASSERT_EQUAL(sheet.RecalculatePending(10), 0u);
+
+    try {
+      sheet.RecalculateRegions({CellRange{"B2"_pos, "A1"_pos}});
+      ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+  }
+  void BenchmarkRandomEdits(int edits) {
+    Sheet sheet;
+    std::mt19937 generator(42);
+    auto random_pos = [&generator]() {
+      return Position{static_cast<int>(generator() % 1000), static_cast<int>(generator() % 26)};
+    };
+    LOG_DURATION(std::to_string(edits) + " random edits");
+    for (int i = 1; i <= edits; ++i) {
+      Position pos = random_pos();
+      switch (generator() % 4) {
+        case 0:
+        case 1:
+          sheet.SetCell(pos, std::to_string(i));
+          break;
+        case 2:
+          try {
+            sheet.SetCell(pos, "=" + random_pos().ToString() + "+" + random_pos().ToString());
+          } catch (const CircularDependencyException&) {
+          }
+          break;
+        default:
+          sheet.ClearCell(pos);
+      }
+      if (i % (edits / 10) == 0) {
+        size_t cells = 0;
+        for (int row : sheet.GetRowIndexes()) {
+          cells += sheet.GetRow(row)->size();
+        }
+        std::cerr << i << " edits: " << cells << " cells, " << sheet.GetDependencyGraph().GetEdgeCount()
+                  << " edges, " << sheet.GetDependencyGraph().GetMemoryUsage() << " graph bytes" << std::endl;
+      }
+    }
+  }
+  void BenchmarkPositionConversion() {
+    const int repeats = 100;
+    char buffer[Position::kMaxNameLength];
+    std::vector<std::string> names;
+    for (int col = 0; col < Position::kMaxCols; ++col) {
+      names.push_back(Position{Position::kMaxRows - 1 - col, col}.ToString());
+    }
+    size_t checksum = 0;
+    {
+      LOG_DURATION("Position::ToChars, all columns x" + std::to_string(repeats));
+      for (int i = 0; i < repeats; ++i) {
+        for (int col = 0; col < Position::kMaxCols; ++col) {
+          checksum += Position{Position::kMaxRows - 1 - col, col}.ToChars(buffer, buffer + sizeof(buffer)) - buffer;
+        }
+      }
+    }
+    {
+      LOG_DURATION("Position::FromString, all columns x" + std::to_string(repeats));
+      for (int i = 0; i < repeats; ++i) {
+        for (const auto& name : names) {
+          checksum += Position::FromString(name).col;
+        }
+      }
+    }
+    std::cerr << "checksum " << checksum << std::endl;
+  }
+  void BenchmarkFormulaParsing(int count) {
+    std::vector<std::string> expressions;
+    expressions.reserve(count);
+    for (int i = 0; i < count; ++i) {
+      expressions.push_back(Position{i % 1000, i % 26}.ToString() + "*" + std::to_string(i) + "+SUM(A1:" +
+                            Position{i % 100, 3}.ToString() + ")-(B2/3)");
+    }
+    size_t references = 0;
+#ifdef SPREADSHEET_COUNT_ALLOCATIONS
+    size_t allocations = GetAllocationCount();
+#endif
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& expression : expressions) {
+      references += ParseFormula(expression)->GetReferencedCells().size();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    std::cerr << "parse " << count << " formulas: " << elapsed.count() / 1'000'000 << " ms, "
+              << elapsed.count() / count << " ns per formula, ";
+#ifdef SPREADSHEET_COUNT_ALLOCATIONS
+    allocations = GetAllocationCount() - allocations;
+    std::cerr << static_cast<double>(allocations) / count << " allocations per formula, ";
+#endif
+    std::cerr << references << " references" << std::endl;
+  }
+  void BenchmarkRepeatedFormula(int count) {
+    for (size_t budget : {size_t{0}, FormulaTextCache::kDefaultMemoryBudget}) {
+      Sheet sheet;
+      sheet.SetFormulaCacheBudget(budget);
+      sheet.SetCell("A1"_pos, "10");
+      {
+        LOG_DURATION("=A1*1.2 in " + std::to_string(count) + " cells, cache budget " + std::to_string(budget));
+        for (int i = 0; i < count; ++i) {
+          sheet.SetCell(Position{i % 10'000, 2 + i / 10'000}, "=A1*1.2");
+        }
+      }
+      auto stats = sheet.GetFormulaCacheStats();
+      std::cerr << "hits " << stats.hits << ", misses " << stats.misses << ", " << stats.memory_usage << " bytes" << std::endl;
+    }
+  }
+  void BenchmarkDirtyImport(int count) {
+    // каждая вторая формула с ошибкой
+    std::vector<std::string> texts;
+    for (int i = 0; i < count; ++i) {
+      texts.push_back(i % 2 == 0 ? "=A1*" + std::to_string(i) : "=A1*" + std::to_string(i) + "+");
+    }
+    size_t failed = 0;
+    {
+      Sheet sheet;
+      LOG_DURATION("SetCell with exceptions, " + std::to_string(count) + " cells");
+      for (int i = 0; i < count; ++i) {
+        try {
+          sheet.SetCell(Position{i % 10'000, 1 + i / 10'000}, texts[i]);
+        } catch (const FormulaException&) {
+          ++failed;
+        }
+      }
+    }
+    {
+      Sheet sheet;
+      LOG_DURATION("TrySetCell, " + std::to_string(count) + " cells");
+      for (int i = 0; i < count; ++i) {
+        failed += sheet.TrySetCell(Position{i % 10'000, 1 + i / 10'000}, texts[i]) != CellStatus::Ok;
+      }
+    }
+    std::cerr << failed << " rejected" << std::endl;
+  }
+  void BenchmarkBulkLoad(int formulas) {
+    std::vector<std::pair<Position, std::string>> cells;
+    // тройки столбцов "число, =A*2, =B+A" по 10000 строк
+    for (int i = 0; i < formulas / 2; ++i) {
+      Position value{i % 10'000, i / 10'000 * 3};
+      Position doubled{value.row, value.col + 1};
+      cells.push_back({value, std::to_string(i)});
+      cells.push_back({doubled, "=" + value.ToString() + "*2"});
+      cells.push_back({Position{value.row, value.col + 2}, "=" + doubled.ToString() + "+" + value.ToString()});
+    }
+    const std::string label = std::to_string(formulas) + " formulas";
+    {
+      Sheet sheet;
+      LOG_DURATION("SetCell, " + label);
+      for (const auto& [pos, text] : cells) {
+        sheet.SetCell(pos, text);
+      }
+    }
+    const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t thread_count = 1; thread_count <= threads; thread_count *= 2) {
+      Sheet sheet;
+      LOG_DURATION("SetCells, " + label + ", " + std::to_string(thread_count) + " threads");
+      sheet.SetCells(cells, thread_count);
+    }
+  }
+  void BenchmarkCellAllocation(int cells) {
+    std::vector<std::pair<Position, std::string>> texts;
+    for (int i = 0; i < cells; ++i) {
+      Position pos{i / 100, i % 100};
+      texts.push_back({pos, i % 2 == 0 ? std::to_string(i) : "=" + Position{pos.row, pos.col - 1}.ToString() + "+1"});
+    }
+    const std::string label = std::to_string(cells) + " cells";
+    auto load_and_drop = [&texts](Sheet& sheet) {
+      for (const auto& [pos, text] : texts) {
+        sheet.SetCell(pos, text);
+      }
+      for (const auto& item : texts) {
+        sheet.ClearCell(item.first);
+      }
+      for (const auto& [pos, text] : texts) {
+        sheet.SetCell(pos, text);
+      }
+    };
+    {
+      LOG_DURATION("malloc, " + label);
+      Sheet sheet(std::pmr::new_delete_resource());
+      load_and_drop(sheet);
+    }
+    {
+      LOG_DURATION("sheet pool, " + label);
+      Sheet sheet;
+      load_and_drop(sheet);
+    }
+  }
+  void BenchmarkReadRange(int reads) {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+      for (int col = 0; col < 100; ++col) {
+        Position pos{row, col};
+        sheet.SetCell(pos, col % 10 == 0 ? "label " + pos.ToString() : std::to_string(row * col));
+      }
+    }
+    const CellRange window{Position{0, 0}, Position{99, 99}};
+    const std::string label = std::to_string(reads) + " reads of 10000 cells";
+    double checksum = 0.0;
+    {
+      LOG_DURATION("GetCell, " + label);
+      for (int i = 0; i < reads; ++i) {
+        for (int row = window.first.row; row <= window.last.row; ++row) {
+          for (int col = window.first.col; col <= window.last.col; ++col) {
+            ICell::Value value = sheet.GetCell(Position{row, col})->GetValue();
+            if (const double* number = std::get_if<double>(&value)) {
+              checksum += *number;
+            }
+          }
+        }
+      }
+    }
+    std::vector<double> numbers(10'000);
+    std::vector<CellValueType> types(10'000);
+    std::vector<std::string_view> texts(10'000);
+    {
+      LOG_DURATION("ReadRange, " + label);
+      for (int i = 0; i < reads; ++i) {
+        sheet.ReadRange(window, numbers.data(), types.data(), texts.data());
+        for (double number : numbers) {
+          checksum -= number;
+        }
+      }
+    }
+    std::cerr << "checksum " << checksum << std::endl;
+  }
+  void BenchmarkPriorityRecalculation(int rows) {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 0; row < rows; ++row) {
+      std::string number = std::to_string(row + 1);
+      sheet.SetCell(Position{row, 1}, "=A1*" + number);
+      // столбец C - цепочка, каждая формула зависит от всех строк выше
+      sheet.SetCell(Position{row, 2}, "=B" + number + (row > 0 ? "+C" + std::to_string(row) : ""));
+    }
+    sheet.SetCalculationMode(Sheet::CalculationMode::Manual);
+    const std::string label = std::to_string(2 * rows) + " dirty formulas";
+    sheet.SetCell("A1"_pos, "2");
+    {
+      LOG_DURATION("first 50 rows, " + label);
+      sheet.RecalculateRegions({CellRange{Position{0, 0}, Position{49, 2}}});
+    }
+    {
+      LOG_DURATION("rest in chunks of 1000, " + label);
+      while (sheet.RecalculatePending(1000) > 0) {
+      }
+    }
+    sheet.SetCell("A1"_pos, "3");
+    {
+      LOG_DURATION("Recalculate, " + label);
+      sheet.Recalculate();
+    }
+  }
+  void BenchmarkVectorizedRun(int repeats) {
+    const int rows = 10'000;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+      std::string name = std::to_string(row + 1);
+      sheet.SetCell(Position{row, 0}, std::to_string(row % 97 + 1));
+      sheet.SetCell(Position{row, 1}, "=A" + name + "*2+A" + name + "/3-(A" + name + "-1)*A" + name);
+    }
+    std::vector<const Formula*> formulas;
+    for (int row = 0; row < rows; ++row) {
+      formulas.push_back(dynamic_cast<const Formula*>(sheet.GetCell(Position{row, 1})->GetFormula()));
+    }
+    const std::string label = std::to_string(repeats) + " x " + std::to_string(rows) + " formulas";
+    double checksum = 0.0;
+    {
+      LOG_DURATION("scalar Evaluate, " + label);
+      for (int i = 0; i < repeats; ++i) {
+        for (const Formula* formula : formulas) {
+          checksum += std::get<double>(formula->Evaluate(sheet));
+        }
+      }
+    }
+    std::vector<double> values(rows);
+    std::vector<uint8_t> errors(rows);
+    {
+      LOG_DURATION("Vectorized::EvaluateRun, " + label);
+      for (int i = 0; i < repeats; ++i) {
+        Vectorized::EvaluateRun(formulas[0]->GetTemplate()->program, sheet, Position{0, 1}, rows, values.data(), errors.data());
+        for (double value : values) {
+          checksum -= value;
+        }
+      }
+    }
+    std::cerr << "checksum " << checksum << std::endl;
+  }
+  void BenchmarkOperationLog(int operations) {
+    namespace fs = std::filesystem;
+    const fs::path directory = fs::temp_directory_path()
+        / ("spreadsheet_oplog_benchmark_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    fs::remove_all(directory);
+    const std::string label = std::to_string(operations) + " operations";
+    {
+      // свёртка отключена, чтобы весь хвост журнала пришлось применять при восстановлении
+      LoggedSheet sheet(directory, 1 << 16, uint64_t{1} << 40);
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < operations; ++i) {
+        Position pos{i % 10'000, i / 10'000 % 100};
+        sheet.SetCell(pos, pos.col == 0 ? std::to_string(i) : "=" + Position{pos.row, 0}.ToString() + "+" + std::to_string(pos.col));
+      }
+      sheet.Sync();
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+      std::cerr << "log " << label << ": " << elapsed.count() << " ms, "
+                << operations * 1000.0 / std::max<long long>(elapsed.count(), 1) << " operations per second" << std::endl;
+    }
+    {
+      LOG_DURATION("recover from log, " + label);
+      LoggedSheet sheet(directory);
+    }
+    LoggedSheet(directory).Compact();
+    {
+      LOG_DURATION("recover from snapshot, " + label);
+      LoggedSheet sheet(directory);
+    }
+    fs::remove_all(directory);
+  }
+  void BenchmarkDeepFormula(int terms) {
+    std::string expression;
+    for (int i = 0; i < terms; ++i) {
+      if (i > 0) {
+        expression += '+';
+      }
+      expression += Position{i % 1000, i / 1000}.ToString();
+    }
+    Sheet sheet;
+    FormulaTemplateCache templates;
+    std::unique_ptr<Formula> formula;
+    const std::string label = std::to_string(terms) + "-term formula";
+    {
+      LOG_DURATION("parse " + label);
+      formula = ParseFormula(expression, Position{0, 100}, templates);
+    }
+    const int repeats = 100;
+    double checksum = 0.0;
+    {
+      LOG_DURATION("evaluate " + label + " x" + std::to_string(repeats));
+      for (int i = 0; i < repeats; ++i) {
+        checksum += std::get<double>(formula->Evaluate(sheet));
+      }
+    }
+    size_t length = 0;
+    {
+      LOG_DURATION("print " + label + " x" + std::to_string(repeats));
+      for (int i = 0; i < repeats; ++i) {
+        length += formula->GetExpression().size();
+      }
+    }
+    {
+      LOG_DURATION("insert columns into " + label + " x10");
+      for (int i = 0; i < 10; ++i) {
+        formula->HandleInsertedCols(60);
+      }
+    }
+    {
+      LOG_DURATION("destroy " + label);
+      formula.reset();
+    }
+    std::cerr << "checksum " << checksum << ", " << length << " chars" << std::endl;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  WarmUpFormulaParser();
+  TestRunner tr;
+  RUN_TEST(tr, TestPositionAndStringConversion);
+  RUN_TEST(tr, TestPositionToStringInvalid);
+  RUN_TEST(tr, TestStringToPositionInvalid);
+  RUN_TEST(tr, TestPositionAllColumns);
+  RUN_TEST(tr, TestEmpty);
+  RUN_TEST(tr, TestInvalidPosition);
+  RUN_TEST(tr, TestSetCellPlainText);
+  RUN_TEST(tr, TestClearCell);
+  RUN_TEST(tr, TestFormulaArithmetic);
+  RUN_TEST(tr, TestFormulaReferences);
+  RUN_TEST(tr, TestFormulaExpressionFormatting);
+  RUN_TEST(tr, TestFormulaReferencedCells);
+  RUN_TEST(tr, TestFormulaHandleInsertion);
+  RUN_TEST(tr, TestInsertionOverflow);
+  RUN_TEST(tr, TestFormulaHandleDeletion);
+  RUN_TEST(tr, TestErrorValue);
+  RUN_TEST(tr, TestErrorDiv0);
+  RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+  RUN_TEST(tr, TestFormulaInvalidPosition);
+  RUN_TEST(tr, TestCellErrorPropagation);
+  RUN_TEST(tr, TestCellsDeletionSimple);
+  RUN_TEST(tr, TestCellsDeletion);
+  RUN_TEST(tr, TestCellsDeletionAdjacent);
+  RUN_TEST(tr, TestPrint);
+  RUN_TEST(tr, TestCellReferences);
+  RUN_TEST(tr, TestFormulaIncorrect);
+  RUN_TEST(tr, TestCellCircularReferences);
+  RUN_TEST(tr, TestFormulaTemplateSharing);
+  RUN_TEST(tr, TestVectorizedColumnEvaluation);
+  RUN_TEST(tr, TestRangeFunctions);
+  RUN_TEST(tr, TestRangeDependencyIndex);
+  RUN_TEST(tr, TestConcurrentReaders);
+  RUN_TEST(tr, TestSheetVersions);
+  RUN_TEST(tr, TestSheetVersionsRestore);
+  RUN_TEST(tr, TestOperationLogRecovery);
+  RUN_TEST(tr, TestEvalValue);
+  RUN_TEST(tr, TestNumericTextClassification);
+  RUN_TEST(tr, TestMappedSheet);
+  RUN_TEST(tr, TestDependencyGraph);
+  RUN_TEST(tr, TestStaleEdgeCleanup);
+  RUN_TEST(tr, TestCalculationModes);
+  RUN_TEST(tr, TestEarlyCutoff);
+  RUN_TEST(tr, TestDeepFormula);
+  RUN_TEST(tr, TestFormulaParserReuse);
+  RUN_TEST(tr, TestBulkLoad);
+  RUN_TEST(tr, TestFormulaTextCache);
+  RUN_TEST(tr, TestTrySetCell);
+  RUN_TEST(tr, TestCheckSyntaxMatchesGrammar);
+  RUN_TEST(tr, TestPrintableSizeShrinks);
+  RUN_TEST(tr, TestSheetMemoryResource);
+  RUN_TEST(tr, TestReadRange);
+  RUN_TEST(tr, TestPriorityRecalculation);
+
+  if (argc > 1 && std::string_view(argv[1]) == "--benchmark") {
+    BenchmarkPositionConversion();
+    BenchmarkDeepFormula(50'000);
+    BenchmarkFormulaParsing(1'000'000);
+    BenchmarkRepeatedFormula(200'000);
+    BenchmarkDirtyImport(200'000);
+    BenchmarkBulkLoad(2'000'000);
+    BenchmarkCellAllocation(1'000'000);
+    BenchmarkReadRange(1'000);
+    BenchmarkPriorityRecalculation(10'000);
+    BenchmarkVectorizedRun(100);
+    BenchmarkOperationLog(1'000'000);
+    BenchmarkRandomEdits(argc > 2 ? std::stoi(argv[2]) : 10'000'000);
+  }
+  return 0;
+}
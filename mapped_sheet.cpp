@@ -0,0 +1,477 @@
+#include "mapped_sheet.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <tuple>
+#include <utility>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	namespace fs = std::filesystem;
+
+	const char kMagic[8] = { 'S', 'S', 'H', 'E', 'E', 'T', 'M', 'M' };
+	const uint32_t kVersion = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		int32_t rows;
+		int32_t cols;
+		uint32_t reserved;
+		uint64_t cell_count;
+		uint64_t ref_count;
+		uint64_t heap_size;
+	};
+
+	// Смещения массивов в файле. Сначала идут массивы с 8-байтными
+	// элементами, затем ссылки и байтовые данные, поэтому выравнивание
+	// соблюдается без заполнения
+	struct Layout {
+		uint64_t ids;
+		uint64_t numbers;
+		uint64_t text_offsets;
+		uint64_t ref_offsets;
+		uint64_t refs;
+		uint64_t kinds;
+		uint64_t heap;
+		uint64_t end;
+	};
+
+	Layout GetLayout(uint64_t cell_count, uint64_t ref_count, uint64_t heap_size) {
+		Layout layout;
+		layout.ids = sizeof(Header);
+		layout.numbers = layout.ids + cell_count * sizeof(uint64_t);
+		layout.text_offsets = layout.numbers + cell_count * sizeof(double);
+		layout.ref_offsets = layout.text_offsets + (cell_count + 1) * sizeof(uint64_t);
+		layout.refs = layout.ref_offsets + (cell_count + 1) * sizeof(uint64_t);
+		layout.kinds = layout.refs + ref_count * 2 * sizeof(int32_t);
+		layout.heap = layout.kinds + cell_count;
+		layout.end = layout.heap + heap_size;
+		return layout;
+	}
+
+	uint64_t GetId(Position pos) {
+		return PositionHasher{}(pos);
+	}
+
+	template <typename T>
+	void WriteArray(std::ofstream& output, const std::vector<T>& values) {
+		output.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	std::pair<const char*, size_t> MapFile(const fs::path& path) {
+#ifdef _WIN32
+		HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw MappedSheetException("cannot open sheet file " + path.string());
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+			CloseHandle(file);
+			throw MappedSheetException("cannot read sheet file " + path.string());
+		}
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (mapping == nullptr) {
+			throw MappedSheetException("cannot map sheet file " + path.string());
+		}
+		// отображение держит объект проекции, пока вид не освобождён
+		void* address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (address == nullptr) {
+			throw MappedSheetException("cannot map sheet file " + path.string());
+		}
+		return { static_cast<const char*>(address), static_cast<size_t>(file_size.QuadPart) };
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw MappedSheetException("cannot open sheet file " + path.string());
+		}
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+			close(fd);
+			throw MappedSheetException("cannot read sheet file " + path.string());
+		}
+		size_t file_size = static_cast<size_t>(file_stat.st_size);
+		void* address = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED) {
+			throw MappedSheetException("cannot map sheet file " + path.string());
+		}
+		return { static_cast<const char*>(address), file_size };
+#endif
+	}
+
+	void UnmapFile(const char* data, size_t size) {
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(const_cast<char*>(data), size);
+#endif
+	}
+}
+
+MappedSheet::CellView::CellView(const MappedSheet& sheet, uint64_t index) : sheet(sheet), index(index) {}
+
+ICell::Value MappedSheet::CellView::GetValue() const {
+	switch (sheet.GetKind(index)) {
+	case CellKind::Number:
+	case CellKind::FormulaNumber:
+		return sheet.numbers[index];
+	case CellKind::FormulaError:
+		return FormulaError(sheet.GetErrorCategory(index));
+	case CellKind::Text:
+		break;
+	}
+	std::string_view text = sheet.GetTextView(index);
+	if (!text.empty() && text[0] == kEscapeSign) {
+		text.remove_prefix(1);
+	}
+	return std::string(text);
+}
+
+std::string MappedSheet::CellView::GetText() const {
+	return std::string(sheet.GetTextView(index));
+}
+
+std::vector<Position> MappedSheet::CellView::GetReferencedCells() const {
+	uint64_t begin = sheet.ref_offsets[index];
+	uint64_t end = sheet.ref_offsets[index + 1];
+	if (begin > end || end > sheet.ref_count) {
+		throw MappedSheetException("sheet file is corrupted");
+	}
+	std::vector<Position> cells;
+	for (uint64_t i = begin; i < end; ++i) {
+		cells.push_back({ sheet.refs[2 * i], sheet.refs[2 * i + 1] });
+	}
+	return cells;
+}
+
+EvalValue MappedSheet::CellView::GetOperand() const {
+	switch (sheet.GetKind(index)) {
+	case CellKind::Number:
+	case CellKind::FormulaNumber:
+		return sheet.numbers[index];
+	case CellKind::FormulaError:
+		return sheet.GetErrorCategory(index);
+	case CellKind::Text:
+		break;
+	}
+	std::string_view text = sheet.GetTextView(index);
+	bool empty = text.empty() || (text.size() == 1 && text[0] == kEscapeSign);
+	return empty ? EvalValue(0.0) : EvalValue(FormulaError::Category::Value);
+}
+
+MappedSheet::MappedSheet(const std::filesystem::path& path) {
+	std::tie(data, data_size) = MapFile(path);
+
+	Header header;
+	if (data_size < sizeof(header)) {
+		UnmapFile(data, data_size);
+		throw MappedSheetException("sheet file is truncated: " + path.string());
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+		UnmapFile(data, data_size);
+		throw MappedSheetException("not a sheet file: " + path.string());
+	}
+	// размеры массивов ограничены размером файла, иначе смещения могли бы переполниться
+	Layout layout = GetLayout(header.cell_count, header.ref_count, header.heap_size);
+	if (header.cell_count > data_size || header.ref_count > data_size || header.heap_size > data_size
+		|| layout.end != data_size) {
+		UnmapFile(data, data_size);
+		throw MappedSheetException("sheet file is truncated: " + path.string());
+	}
+
+	size = { header.rows, header.cols };
+	cell_count = header.cell_count;
+	ref_count = header.ref_count;
+	heap_size = header.heap_size;
+	ids = reinterpret_cast<const uint64_t*>(data + layout.ids);
+	numbers = reinterpret_cast<const double*>(data + layout.numbers);
+	text_offsets = reinterpret_cast<const uint64_t*>(data + layout.text_offsets);
+	ref_offsets = reinterpret_cast<const uint64_t*>(data + layout.ref_offsets);
+	refs = reinterpret_cast<const int32_t*>(data + layout.refs);
+	kinds = reinterpret_cast<const uint8_t*>(data + layout.kinds);
+	heap = data + layout.heap;
+	view_blocks.reset(new std::atomic<const ViewBlock*>[(cell_count + kViewBlockSize - 1) / kViewBlockSize]());
+}
+
+MappedSheet::~MappedSheet() {
+	for (uint64_t i = 0; i < (cell_count + kViewBlockSize - 1) / kViewBlockSize; ++i) {
+		delete view_blocks[i].load(std::memory_order_relaxed);
+	}
+	UnmapFile(data, data_size);
+}
+
+void MappedSheet::SetCell(Position pos, std::string text) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+std::optional<MappedSheet::CellView> MappedSheet::GetCellView(Position pos) const {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException("invalid position: " + pos.ToString());
+	}
+	auto index = FindIndex(pos);
+	if (!index) {
+		return std::nullopt;
+	}
+	return CellView(*this, *index);
+}
+
+const ICell* MappedSheet::GetCell(Position pos) const {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException("invalid position: " + pos.ToString());
+	}
+	auto index = FindIndex(pos);
+	if (!index) {
+		return nullptr;
+	}
+	std::atomic<const ViewBlock*>& slot = view_blocks[*index / kViewBlockSize];
+	const ViewBlock* block = slot.load(std::memory_order_acquire);
+	if (block == nullptr) {
+		uint64_t first = *index / kViewBlockSize * kViewBlockSize;
+		uint64_t last = std::min(first + kViewBlockSize, cell_count);
+		auto created = std::make_unique<ViewBlock>();
+		created->reserve(last - first);
+		for (uint64_t i = first; i < last; ++i) {
+			created->emplace_back(*this, i);
+		}
+		if (slot.compare_exchange_strong(block, created.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+			block = created.release();
+		}
+	}
+	return &(*block)[*index % kViewBlockSize];
+}
+
+ICell* MappedSheet::GetCell(Position pos) {
+	// представления неизменяемы: ICell не содержит изменяющих методов
+	return const_cast<ICell*>(std::as_const(*this).GetCell(pos));
+}
+
+void MappedSheet::ClearCell(Position pos) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+void MappedSheet::InsertRows(int before, int count) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+void MappedSheet::InsertCols(int before, int count) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+void MappedSheet::DeleteRows(int first, int count) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+void MappedSheet::DeleteCols(int first, int count) {
+	throw MappedSheetException("mapped sheet is read-only");
+}
+
+Size MappedSheet::GetPrintableSize() const {
+	return size;
+}
+
+void MappedSheet::PrintValues(std::ostream& output) const {
+	Print(output, [this, &output](uint64_t index) {
+		CellView cell(*this, index);
+		CellKind kind = GetKind(index);
+		if (kind == CellKind::FormulaNumber || kind == CellKind::FormulaError) {
+			std::visit([&output](const auto& value) { output << value; }, cell.GetValue());
+		}
+		else {
+			output << GetTextView(index);
+		}
+	});
+}
+
+void MappedSheet::PrintTexts(std::ostream& output) const {
+	Print(output, [this, &output](uint64_t index) {
+		output << GetTextView(index);
+	});
+}
+
+RangeSummary MappedSheet::SummarizeRange(const CellRange& range) const {
+	RangeSummary summary;
+	// первой считается ошибка, встреченная первой при обходе по столбцам
+	std::optional<Position> error_pos;
+	for (int row = range.first.row; row <= range.last.row; ++row) {
+		const uint64_t* first = std::lower_bound(ids, ids + cell_count, GetId({ row, range.first.col }));
+		const uint64_t* last = std::upper_bound(first, ids + cell_count, GetId({ row, range.last.col }));
+		for (const uint64_t* id = first; id != last; ++id) {
+			uint64_t index = id - ids;
+			switch (GetKind(index)) {
+			case CellKind::Number:
+			case CellKind::FormulaNumber:
+				summary.Add(numbers[index]);
+				break;
+			case CellKind::FormulaError: {
+				Position pos = GetPosition(index);
+				if (!error_pos || pos.col < error_pos->col) {
+					error_pos = pos;
+					summary.first_error = GetErrorCategory(index);
+				}
+				break;
+			}
+			case CellKind::Text:
+				break;
+			}
+		}
+	}
+	return summary;
+}
+
+uint64_t MappedSheet::GetCellCount() const {
+	return cell_count;
+}
+
+std::optional<uint64_t> MappedSheet::FindIndex(Position pos) const {
+	uint64_t id = GetId(pos);
+	const uint64_t* it = std::lower_bound(ids, ids + cell_count, id);
+	if (it == ids + cell_count || *it != id) {
+		return std::nullopt;
+	}
+	return it - ids;
+}
+
+Position MappedSheet::GetPosition(uint64_t index) const {
+	return { static_cast<int>(ids[index] / Position::kMaxCols), static_cast<int>(ids[index] % Position::kMaxCols) };
+}
+
+MappedSheet::CellKind MappedSheet::GetKind(uint64_t index) const {
+	if (kinds[index] > static_cast<uint8_t>(CellKind::FormulaError)) {
+		throw MappedSheetException("sheet file is corrupted");
+	}
+	return static_cast<CellKind>(kinds[index]);
+}
+
+// Код ошибки хранится в числе и проверяется до приведения: значение вне
+// перечисления привело бы к неопределённому поведению
+FormulaError::Category MappedSheet::GetErrorCategory(uint64_t index) const {
+	double code = numbers[index];
+	if (!(code >= 0.0 && code <= static_cast<double>(FormulaError::Category::Div0)) || code != static_cast<int>(code)) {
+		throw MappedSheetException("sheet file is corrupted");
+	}
+	return static_cast<FormulaError::Category>(static_cast<int>(code));
+}
+
+std::string_view MappedSheet::GetTextView(uint64_t index) const {
+	uint64_t begin = text_offsets[index];
+	uint64_t end = text_offsets[index + 1];
+	if (begin > end || end > heap_size) {
+		throw MappedSheetException("sheet file is corrupted");
+	}
+	return std::string_view(heap + begin, end - begin);
+}
+
+// Тот же формат, что и у Sheet: пустые ячейки пропускаются без
+// разделителя, пустая строка печатается одной табуляцией
+template <typename PrintCell>
+void MappedSheet::Print(std::ostream& output, PrintCell print_cell) const {
+	uint64_t index = 0;
+	for (int row = 0; row < size.rows; ++row) {
+		index = std::lower_bound(ids + index, ids + cell_count, GetId({ row, 0 })) - ids;
+		bool blank = true;
+		for (; index < cell_count && GetPosition(index).row == row; ++index) {
+			int col = GetPosition(index).col;
+			if (col >= size.cols) {
+				continue;
+			}
+			blank = false;
+			print_cell(index);
+			if (col + 1 != size.cols) {
+				output << '\t';
+			}
+		}
+		if (blank) {
+			output << '\t';
+		}
+		output << '\n';
+	}
+}
+
+void MappedSheet::Write(Sheet& sheet, const std::filesystem::path& path) {
+	sheet.Recalculate();
+	std::vector<std::pair<uint64_t, const Cell*>> cells;
+	for (int row : sheet.GetRowIndexes()) {
+		for (const auto& [col, cell] : *sheet.GetRow(row)) {
+			if (cell != nullptr) {
+				cells.push_back({ GetId({ row, col }), cell.get() });
+			}
+		}
+	}
+	std::sort(begin(cells), end(cells), [](const auto& lhs, const auto& rhs) {
+		return lhs.first < rhs.first;
+	});
+
+	std::vector<uint64_t> ids;
+	std::vector<double> numbers;
+	std::vector<uint64_t> text_offsets{ 0 };
+	std::vector<uint64_t> ref_offsets{ 0 };
+	std::vector<int32_t> refs;
+	std::vector<CellKind> kinds;
+	std::string heap;
+	for (const auto& [id, cell] : cells) {
+		ids.push_back(id);
+		ICell::Value value = cell->GetValue();
+		if (const double* number = std::get_if<double>(&value)) {
+			numbers.push_back(*number);
+			kinds.push_back(cell->IsFormula() ? CellKind::FormulaNumber : CellKind::Number);
+		}
+		else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+			numbers.push_back(static_cast<double>(error->GetCategory()));
+			kinds.push_back(CellKind::FormulaError);
+		}
+		else {
+			numbers.push_back(0.0);
+			kinds.push_back(CellKind::Text);
+		}
+		heap += cell->GetText();
+		text_offsets.push_back(heap.size());
+		for (Position ref : cell->GetReferencedCells()) {
+			refs.push_back(ref.row);
+			refs.push_back(ref.col);
+		}
+		ref_offsets.push_back(refs.size() / 2);
+	}
+
+	Header header = {};
+	std::memcpy(header.magic, kMagic, sizeof(kMagic));
+	header.version = kVersion;
+	Size printable_size = sheet.GetPrintableSize();
+	header.rows = printable_size.rows;
+	header.cols = printable_size.cols;
+	header.cell_count = ids.size();
+	header.ref_count = refs.size() / 2;
+	header.heap_size = heap.size();
+
+	// файл пишется рядом и подменяется целиком, чтобы открытые отображения
+	// старой версии и читатели не увидели наполовину записанные данные
+	fs::path temp_path = path;
+	temp_path += ".tmp";
+	{
+		std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		WriteArray(output, ids);
+		WriteArray(output, numbers);
+		WriteArray(output, text_offsets);
+		WriteArray(output, ref_offsets);
+		WriteArray(output, refs);
+		WriteArray(output, kinds);
+		output.write(heap.data(), heap.size());
+		if (!output) {
+			throw MappedSheetException("cannot write sheet file " + temp_path.string());
+		}
+	}
+	fs::rename(temp_path, path);
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include "sheet.h"
+#include "eval_value.h"
+
+// Исключение, выбрасываемое при ошибке открытия файла листа или попытке его изменить
+class MappedSheetException : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Неизменяемый лист поверх отображённого в память файла. Файл хранит
+// данные по столбцам: отсортированные номера ячеек, их виды, числа и
+// заранее вычисленные значения формул, смещения в общей куче строк и
+// ссылки формул. При открытии проверяются только заголовок и размеры
+// массивов, а смещения, виды и коды ошибок - при чтении ячейки, поэтому
+// страницы подгружаются ОС по мере обращения. Изменяющие методы бросают
+// MappedSheetException
+class MappedSheet : public ISheet {
+public:
+	// Лёгкое представление ячейки: ссылка на лист и номер в массивах файла
+	class CellView : public ICell {
+	public:
+		CellView(const MappedSheet& sheet, uint64_t index);
+		Value GetValue() const override;
+		std::string GetText() const override;
+		std::vector<Position> GetReferencedCells() const override;
+		EvalValue GetOperand() const override;
+	private:
+		const MappedSheet& sheet;
+		uint64_t index;
+	};
+
+	explicit MappedSheet(const std::filesystem::path& path);
+	MappedSheet(const MappedSheet&) = delete;
+	MappedSheet& operator=(const MappedSheet&) = delete;
+	~MappedSheet();
+
+	void SetCell(Position pos, std::string text);
+	// Представление возвращается по значению, без памяти на стороне листа
+	std::optional<CellView> GetCellView(Position pos) const;
+	// Представления создаются блоками при первом чтении и живут, пока жив лист
+	const ICell* GetCell(Position pos) const;
+	ICell* GetCell(Position pos);
+	void ClearCell(Position pos);
+	void InsertRows(int before, int count = 1);
+	void InsertCols(int before, int count = 1);
+	void DeleteRows(int first, int count = 1);
+	void DeleteCols(int first, int count = 1);
+	Size GetPrintableSize() const;
+	void PrintValues(std::ostream& output) const;
+	void PrintTexts(std::ostream& output) const;
+	RangeSummary SummarizeRange(const CellRange& range) const;
+
+	uint64_t GetCellCount() const;
+
+	// Записывает текущие тексты и значения листа в файл для MappedSheet.
+	// Формулы, ждущие пересчёта в режимах Manual и Deferred, сначала вычисляются
+	static void Write(Sheet& sheet, const std::filesystem::path& path);
+private:
+	enum class CellKind : uint8_t { Text, Number, FormulaNumber, FormulaError };
+	using ViewBlock = std::vector<CellView>;
+	static const uint64_t kViewBlockSize = 4096;
+
+	std::optional<uint64_t> FindIndex(Position pos) const;
+	Position GetPosition(uint64_t index) const;
+	CellKind GetKind(uint64_t index) const;
+	FormulaError::Category GetErrorCategory(uint64_t index) const;
+	std::string_view GetTextView(uint64_t index) const;
+	template <typename PrintCell>
+	void Print(std::ostream& output, PrintCell print_cell) const;
+
+	const char* data = nullptr;
+	size_t data_size = 0;
+	Size size;
+	uint64_t cell_count = 0;
+	const uint64_t* ids = nullptr;
+	const double* numbers = nullptr;
+	const uint64_t* text_offsets = nullptr;
+	const uint64_t* ref_offsets = nullptr;
+	const int32_t* refs = nullptr;
+	uint64_t ref_count = 0;
+	const uint8_t* kinds = nullptr;
+	const char* heap = nullptr;
+	uint64_t heap_size = 0;
+	// блок вставляется сравнением с обменом, проигравший поток удаляет свой
+	std::unique_ptr<std::atomic<const ViewBlock*>[]> view_blocks;
+};
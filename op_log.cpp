@@ -0,0 +1,435 @@
+#include "op_log.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	namespace fs = std::filesystem;
+
+	const char kSnapshotMagic[4] = { 'S', 'S', 'N', 'P' };
+	const char* kSnapshotName = "snapshot";
+	const char* kSnapshotTempName = "snapshot.tmp";
+	// заголовок записи: длина данных и их контрольная сумма
+	const size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+	fs::path GetLogPath(const fs::path& directory, uint64_t generation) {
+		return directory / ("oplog." + std::to_string(generation));
+	}
+
+	uint32_t Checksum(const char* data, size_t size) {
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < size; ++i) {
+			hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+		}
+		return hash;
+	}
+
+	template <typename T>
+	void Put(std::vector<char>& out, T value) {
+		const char* bytes = reinterpret_cast<const char*>(&value);
+		out.insert(end(out), bytes, bytes + sizeof(T));
+	}
+
+	void PutString(std::vector<char>& out, const std::string& text) {
+		Put(out, static_cast<uint32_t>(text.size()));
+		out.insert(end(out), begin(text), end(text));
+	}
+
+	class Reader {
+	public:
+		Reader(const char* data, size_t size) : data(data), size(size) {}
+
+		template <typename T>
+		bool Get(T& value) {
+			if (size - offset < sizeof(T)) {
+				return false;
+			}
+			std::memcpy(&value, data + offset, sizeof(T));
+			offset += sizeof(T);
+			return true;
+		}
+
+		bool GetString(std::string& text) {
+			uint32_t length = 0;
+			if (!Get(length) || size - offset < length) {
+				return false;
+			}
+			text.assign(data + offset, length);
+			offset += length;
+			return true;
+		}
+
+		bool AtEnd() const {
+			return offset == size;
+		}
+	private:
+		const char* data;
+		size_t size;
+		size_t offset = 0;
+	};
+
+	std::vector<char> ReadFile(const fs::path& path) {
+		std::ifstream input(path, std::ios::binary);
+		return std::vector<char>(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+	}
+
+	void SyncFile(std::FILE* file) {
+		if (std::fflush(file) != 0) {
+			throw OperationLogException("cannot flush operation log");
+		}
+#ifdef _WIN32
+		_commit(_fileno(file));
+#else
+		if (fsync(fileno(file)) != 0) {
+			throw OperationLogException("cannot fsync operation log");
+		}
+#endif
+	}
+
+	void SyncDirectory(const fs::path& directory) {
+#ifndef _WIN32
+		int fd = open(directory.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+#endif
+	}
+
+	// Переводит лист в другой режим вычислений и возвращает прежний, в том
+	// числе при выходе по исключению
+	class CalculationModeGuard {
+	public:
+		CalculationModeGuard(Sheet& sheet, Sheet::CalculationMode mode) : sheet(sheet), saved_mode(sheet.GetCalculationMode()) {
+			sheet.SetCalculationMode(mode);
+		}
+		~CalculationModeGuard() {
+			try {
+				sheet.SetCalculationMode(saved_mode);
+			}
+			catch (const std::exception&) {
+				// режим уже возвращён, не удался только пересчёт
+			}
+		}
+	private:
+		Sheet& sheet;
+		Sheet::CalculationMode saved_mode;
+	};
+
+	void ApplyRecord(Reader& reader, Sheet& sheet) {
+		uint8_t op = 0;
+		int32_t first = 0;
+		int32_t second = 0;
+		if (!reader.Get(op) || !reader.Get(first) || !reader.Get(second)) {
+			throw OperationLogException("malformed operation log record");
+		}
+		std::string text;
+		switch (static_cast<OperationLog::OpCode>(op)) {
+		case OperationLog::OpCode::SetCell:
+			if (!reader.GetString(text)) {
+				throw OperationLogException("malformed operation log record");
+			}
+			sheet.SetCell({ first, second }, std::move(text));
+			break;
+		case OperationLog::OpCode::ClearCell:
+			sheet.ClearCell({ first, second });
+			break;
+		case OperationLog::OpCode::InsertRows:
+			sheet.InsertRows(first, second);
+			break;
+		case OperationLog::OpCode::InsertCols:
+			sheet.InsertCols(first, second);
+			break;
+		case OperationLog::OpCode::DeleteRows:
+			sheet.DeleteRows(first, second);
+			break;
+		case OperationLog::OpCode::DeleteCols:
+			sheet.DeleteCols(first, second);
+			break;
+		default:
+			throw OperationLogException("unknown operation in log");
+		}
+	}
+
+	uint64_t LoadSnapshot(const fs::path& path, Sheet& sheet) {
+		if (!fs::exists(path)) {
+			return 0;
+		}
+		std::vector<char> data = ReadFile(path);
+		Reader reader(data.data(), data.size());
+		char magic[sizeof(kSnapshotMagic)];
+		uint64_t generation = 0;
+		int32_t rows = 0;
+		int32_t cols = 0;
+		uint64_t cell_count = 0;
+		bool valid = reader.Get(magic) && std::equal(std::begin(magic), std::end(magic), kSnapshotMagic)
+			&& reader.Get(generation) && reader.Get(rows) && reader.Get(cols) && reader.Get(cell_count);
+		std::vector<std::pair<Position, std::string>> cells;
+		for (uint64_t i = 0; valid && i < cell_count; ++i) {
+			int32_t row = 0;
+			int32_t col = 0;
+			std::string text;
+			valid = reader.Get(row) && reader.Get(col) && reader.GetString(text);
+			if (valid) {
+				cells.push_back({ { row, col }, std::move(text) });
+			}
+		}
+		if (!valid) {
+			throw OperationLogException("malformed snapshot " + path.string());
+		}
+		// одним пакетом: формулы не пересчитываются после каждой ячейки
+		sheet.SetCells(std::move(cells));
+		// размер в снимке только для проверки формата: лист считает его по ячейкам
+		return generation;
+	}
+}
+
+OperationLog::OperationLog(std::filesystem::path directory_, uint64_t generation_, size_t group_commit_bytes_)
+	: directory(std::move(directory_)), generation(generation_), group_commit_bytes(group_commit_bytes_) {
+	Open();
+}
+
+OperationLog::~OperationLog() {
+	try {
+		Sync();
+	}
+	catch (const OperationLogException&) {
+	}
+	Close();
+}
+
+void OperationLog::Open() {
+	fs::path path = GetLogPath(directory, generation);
+	file = std::fopen(path.string().c_str(), "ab");
+	if (file == nullptr) {
+		throw OperationLogException("cannot open operation log " + path.string());
+	}
+	log_size = fs::file_size(path);
+}
+
+void OperationLog::Close() {
+	if (file != nullptr) {
+		std::fclose(file);
+		file = nullptr;
+	}
+}
+
+size_t OperationLog::BeginRecord(OpCode op, int first, int second) {
+	size_t record_offset = buffer.size();
+	buffer.resize(record_offset + kRecordHeaderSize);
+	Put(buffer, static_cast<uint8_t>(op));
+	Put(buffer, static_cast<int32_t>(first));
+	Put(buffer, static_cast<int32_t>(second));
+	return record_offset;
+}
+
+void OperationLog::EndRecord(size_t record_offset) {
+	const char* payload = buffer.data() + record_offset + kRecordHeaderSize;
+	uint32_t size = static_cast<uint32_t>(buffer.size() - record_offset - kRecordHeaderSize);
+	uint32_t checksum = Checksum(payload, size);
+	std::memcpy(buffer.data() + record_offset, &size, sizeof(size));
+	std::memcpy(buffer.data() + record_offset + sizeof(size), &checksum, sizeof(checksum));
+	if (buffer.size() >= group_commit_bytes) {
+		Sync();
+	}
+}
+
+void OperationLog::AppendSetCell(Position pos, const std::string& text) {
+	size_t record_offset = BeginRecord(OpCode::SetCell, pos.row, pos.col);
+	PutString(buffer, text);
+	EndRecord(record_offset);
+}
+
+void OperationLog::AppendClearCell(Position pos) {
+	EndRecord(BeginRecord(OpCode::ClearCell, pos.row, pos.col));
+}
+
+void OperationLog::AppendStructural(OpCode op, int first, int count) {
+	EndRecord(BeginRecord(op, first, count));
+}
+
+void OperationLog::Sync() {
+	if (buffer.empty()) {
+		return;
+	}
+	if (std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+		throw OperationLogException("cannot write operation log");
+	}
+	SyncFile(file);
+	log_size += buffer.size();
+	buffer.clear();
+}
+
+uint64_t OperationLog::GetLogSize() const {
+	return log_size + buffer.size();
+}
+
+void OperationLog::Compact(const Sheet& sheet) {
+	Sync();
+
+	std::vector<char> data(std::begin(kSnapshotMagic), std::end(kSnapshotMagic));
+	Put(data, generation + 1);
+	Size size = sheet.GetPrintableSize();
+	Put(data, static_cast<int32_t>(size.rows));
+	Put(data, static_cast<int32_t>(size.cols));
+	size_t count_offset = data.size();
+	Put(data, uint64_t{ 0 });
+	uint64_t cell_count = 0;
+	for (int row : sheet.GetRowIndexes()) {
+		for (const auto& item : *sheet.GetRow(row)) {
+			// заглушки лист создаст сам по ссылкам формул
+			if (item.second != nullptr && !item.second->IsPlaceholder()) {
+				Put(data, static_cast<int32_t>(row));
+				Put(data, static_cast<int32_t>(item.first));
+				PutString(data, item.second->GetText());
+				++cell_count;
+			}
+		}
+	}
+	std::memcpy(data.data() + count_offset, &cell_count, sizeof(cell_count));
+
+	fs::path temp_path = directory / kSnapshotTempName;
+	std::FILE* snapshot = std::fopen(temp_path.string().c_str(), "wb");
+	if (snapshot == nullptr) {
+		throw OperationLogException("cannot create snapshot " + temp_path.string());
+	}
+	bool written = std::fwrite(data.data(), 1, data.size(), snapshot) == data.size();
+	if (written) {
+		SyncFile(snapshot);
+	}
+	std::fclose(snapshot);
+	if (!written) {
+		throw OperationLogException("cannot write snapshot " + temp_path.string());
+	}
+	fs::rename(temp_path, directory / kSnapshotName);
+	SyncDirectory(directory);
+
+	Close();
+	fs::remove(GetLogPath(directory, generation));
+	++generation;
+	Open();
+}
+
+uint64_t OperationLog::Recover(const std::filesystem::path& directory, Sheet& sheet) {
+	fs::create_directories(directory);
+	// до конца восстановления формулы только помечаются, а вычисляются один
+	// раз в RecalculateAll
+	CalculationModeGuard manual_mode(sheet, Sheet::CalculationMode::Manual);
+	uint64_t generation = LoadSnapshot(directory / kSnapshotName, sheet);
+
+	fs::path log_path = GetLogPath(directory, generation);
+	std::vector<char> data = fs::exists(log_path) ? ReadFile(log_path) : std::vector<char>();
+	size_t offset = 0;
+	while (data.size() - offset >= kRecordHeaderSize) {
+		uint32_t size = 0;
+		uint32_t checksum = 0;
+		std::memcpy(&size, data.data() + offset, sizeof(size));
+		std::memcpy(&checksum, data.data() + offset + sizeof(size), sizeof(checksum));
+		const char* payload = data.data() + offset + kRecordHeaderSize;
+		// оборванная или повреждённая запись - конец журнала
+		if (data.size() - offset - kRecordHeaderSize < size || Checksum(payload, size) != checksum) {
+			break;
+		}
+		Reader reader(payload, size);
+		ApplyRecord(reader, sheet);
+		offset += kRecordHeaderSize + size;
+	}
+	if (offset < data.size()) {
+		fs::resize_file(log_path, offset);
+	}
+
+	for (const auto& entry : fs::directory_iterator(directory)) {
+		const std::string name = entry.path().filename().string();
+		if (name.rfind("oplog.", 0) == 0 && entry.path() != log_path) {
+			fs::remove(entry.path());
+		}
+	}
+	sheet.RecalculateAll();
+	return generation;
+}
+
+LoggedSheet::LoggedSheet(std::filesystem::path directory, size_t group_commit_bytes, uint64_t compact_log_bytes_)
+	: log(directory, OperationLog::Recover(directory, sheet), group_commit_bytes)
+	, compact_log_bytes(compact_log_bytes_) {
+}
+
+void LoggedSheet::SetCell(Position pos, std::string text) {
+	sheet.SetCell(pos, text);
+	log.AppendSetCell(pos, text);
+	CompactIfNeeded();
+}
+
+const ICell* LoggedSheet::GetCell(Position pos) const {
+	return sheet.GetCell(pos);
+}
+
+ICell* LoggedSheet::GetCell(Position pos) {
+	return sheet.GetCell(pos);
+}
+
+void LoggedSheet::ClearCell(Position pos) {
+	sheet.ClearCell(pos);
+	log.AppendClearCell(pos);
+	CompactIfNeeded();
+}
+
+void LoggedSheet::InsertRows(int before, int count) {
+	sheet.InsertRows(before, count);
+	log.AppendStructural(OperationLog::OpCode::InsertRows, before, count);
+	CompactIfNeeded();
+}
+
+void LoggedSheet::InsertCols(int before, int count) {
+	sheet.InsertCols(before, count);
+	log.AppendStructural(OperationLog::OpCode::InsertCols, before, count);
+	CompactIfNeeded();
+}
+
+void LoggedSheet::DeleteRows(int first, int count) {
+	sheet.DeleteRows(first, count);
+	log.AppendStructural(OperationLog::OpCode::DeleteRows, first, count);
+	CompactIfNeeded();
+}
+
+void LoggedSheet::DeleteCols(int first, int count) {
+	sheet.DeleteCols(first, count);
+	log.AppendStructural(OperationLog::OpCode::DeleteCols, first, count);
+	CompactIfNeeded();
+}
+
+Size LoggedSheet::GetPrintableSize() const {
+	return sheet.GetPrintableSize();
+}
+
+void LoggedSheet::PrintValues(std::ostream& output) const {
+	sheet.PrintValues(output);
+}
+
+void LoggedSheet::PrintTexts(std::ostream& output) const {
+	sheet.PrintTexts(output);
+}
+
+RangeSummary LoggedSheet::SummarizeRange(const CellRange& range) const {
+	return sheet.SummarizeRange(range);
+}
+
+void LoggedSheet::Sync() {
+	log.Sync();
+}
+
+void LoggedSheet::Compact() {
+	log.Compact(sheet);
+}
+
+void LoggedSheet::CompactIfNeeded() {
+	if (log.GetLogSize() >= compact_log_bytes) {
+		Compact();
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "sheet.h"
+
+// Исключение, выбрасываемое при ошибке чтения или записи журнала операций
+class OperationLogException : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Журнал изменений листа, пишется только дописыванием. Записи копятся
+// в буфере и сбрасываются на диск группой с одним fsync; периодически
+// журнал сворачивается в снимок. Каталог содержит снимок с номером
+// поколения и журнал этого поколения, поэтому сбой между записью снимка
+// и созданием нового журнала не приводит к повторному применению операций
+class OperationLog {
+public:
+	enum class OpCode : uint8_t {
+		SetCell = 1,
+		ClearCell,
+		InsertRows,
+		InsertCols,
+		DeleteRows,
+		DeleteCols,
+	};
+
+	OperationLog(std::filesystem::path directory, uint64_t generation, size_t group_commit_bytes);
+	OperationLog(const OperationLog&) = delete;
+	OperationLog& operator=(const OperationLog&) = delete;
+	~OperationLog();
+
+	void AppendSetCell(Position pos, const std::string& text);
+	void AppendClearCell(Position pos);
+	void AppendStructural(OpCode op, int first, int count);
+	void Sync();
+	void Compact(const Sheet& sheet);
+	uint64_t GetLogSize() const;
+
+	// загружает снимок и применяет хвост журнала; возвращает поколение журнала
+	static uint64_t Recover(const std::filesystem::path& directory, Sheet& sheet);
+private:
+	void Open();
+	void Close();
+	// запись собирается прямо в buffer: заголовок заполняется в EndRecord
+	size_t BeginRecord(OpCode op, int first, int second);
+	void EndRecord(size_t record_offset);
+
+	std::filesystem::path directory;
+	uint64_t generation;
+	size_t group_commit_bytes;
+	std::FILE* file = nullptr;
+	std::vector<char> buffer;
+	uint64_t log_size = 0;
+};
+
+// Лист, записывающий каждое успешное изменение в журнал операций
+class LoggedSheet : public ISheet {
+public:
+	explicit LoggedSheet(std::filesystem::path directory, size_t group_commit_bytes = 1 << 16,
+		uint64_t compact_log_bytes = 64 << 20);
+
+	void SetCell(Position pos, std::string text);
+	const ICell* GetCell(Position pos) const;
+	ICell* GetCell(Position pos);
+	void ClearCell(Position pos);
+	void InsertRows(int before, int count = 1);
+	void InsertCols(int before, int count = 1);
+	void DeleteRows(int first, int count = 1);
+	void DeleteCols(int first, int count = 1);
+	Size GetPrintableSize() const;
+	void PrintValues(std::ostream& output) const;
+	void PrintTexts(std::ostream& output) const;
+	RangeSummary SummarizeRange(const CellRange& range) const;
+
+	void Sync();
+	void Compact();
+private:
+	void CompactIfNeeded();
+
+	Sheet sheet;
+	OperationLog log;
+	uint64_t compact_log_bytes;
+};
@@ -0,0 +1,42 @@
+#include "profile.h"
+
+#ifdef SPREADSHEET_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+  std::atomic<size_t> allocation_count = 0;
+}
+
+size_t GetAllocationCount() {
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (size == 0) {
+    size = 1;
+  }
+  while (true) {
+    if (void* memory = std::malloc(size)) {
+      return memory;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+  std::free(memory);
+}
+
+#endif
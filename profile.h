@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+class LogDuration {
+public:
+  explicit LogDuration(const std::string& msg = "")
+    : message(msg + ": ")
+    , start(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~LogDuration() {
+    auto finish = std::chrono::steady_clock::now();
+    auto dur = finish - start;
+    std::cerr << message
+       << std::chrono::duration_cast<std::chrono::milliseconds>(dur).count()
+       << " ms" << std::endl;
+  }
+private:
+  std::string message;
+  std::chrono::steady_clock::time_point start;
+};
+
+#define UNIQ_ID_IMPL(lineno) _a_local_var_##lineno
+#define UNIQ_ID(lineno) UNIQ_ID_IMPL(lineno)
+
+#define LOG_DURATION(message) \
+  LogDuration UNIQ_ID(__LINE__){message};
+
+#ifdef SPREADSHEET_COUNT_ALLOCATIONS
+// Число вызовов глобального operator new с начала работы программы. Замена
+// operator new добавляет атомарную операцию в каждое выделение памяти во всех
+// потоках, поэтому собирается только с опцией SPREADSHEET_COUNT_ALLOCATIONS
+size_t GetAllocationCount();
+#endif
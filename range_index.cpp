@@ -0,0 +1,106 @@
+#include "range_index.h"
+#include <algorithm>
+
+void RangeDependencyIndex::Add(const CellRange& range, const Position& dependent) {
+	pending.push_back({ range, dependent });
+	if (pending.size() > kMinPendingToRebuild + sorted.size() / 8) {
+		Rebuild();
+	}
+}
+
+void RangeDependencyIndex::Remove(const Position& dependent) {
+	pending.erase(std::remove_if(begin(pending), end(pending), [&dependent](const Entry& entry) {
+		return entry.dependent == dependent;
+	}), end(pending));
+
+	auto it = sorted_by_dependent.find(dependent);
+	if (it == end(sorted_by_dependent)) {
+		return;
+	}
+	for (int index : it->second) {
+		alive[index] = false;
+		++dead_count;
+	}
+	sorted_by_dependent.erase(it);
+	if (dead_count > kMinPendingToRebuild && dead_count > sorted.size() / 2) {
+		Rebuild();
+	}
+}
+
+void RangeDependencyIndex::Clear() {
+	sorted.clear();
+	max_last_row.clear();
+	alive.clear();
+	sorted_by_dependent.clear();
+	dead_count = 0;
+	pending.clear();
+}
+
+size_t RangeDependencyIndex::GetSize() const {
+	return sorted.size() - dead_count + pending.size();
+}
+
+void RangeDependencyIndex::Rebuild() {
+	std::vector<Entry> entries;
+	entries.reserve(GetSize());
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		if (alive[i]) {
+			entries.push_back(sorted[i]);
+		}
+	}
+	entries.insert(end(entries), begin(pending), end(pending));
+	std::sort(begin(entries), end(entries), [](const Entry& lhs, const Entry& rhs) {
+		return lhs.range.first.row < rhs.range.first.row;
+	});
+
+	sorted = std::move(entries);
+	alive.assign(sorted.size(), true);
+	max_last_row.assign(sorted.size(), -1);
+	BuildMaxLastRow(0, static_cast<int>(sorted.size()));
+	sorted_by_dependent.clear();
+	for (size_t i = 0; i < sorted.size(); ++i) {
+		sorted_by_dependent[sorted[i].dependent].push_back(static_cast<int>(i));
+	}
+	dead_count = 0;
+	pending.clear();
+}
+
+int RangeDependencyIndex::BuildMaxLastRow(int lo, int hi) {
+	if (lo >= hi) {
+		return -1;
+	}
+	int mid = (lo + hi) / 2;
+	int max_row = std::max({ sorted[mid].range.last.row, BuildMaxLastRow(lo, mid), BuildMaxLastRow(mid + 1, hi) });
+	max_last_row[mid] = max_row;
+	return max_row;
+}
+
+void RangeDependencyIndex::Stab(int lo, int hi, const Position& pos, std::vector<Position>& result) const {
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (max_last_row[mid] < pos.row) {
+			return;
+		}
+		Stab(lo, mid, pos, result);
+		if (sorted[mid].range.first.row > pos.row) {
+			return;
+		}
+		if (alive[mid] && sorted[mid].range.Contains(pos)) {
+			result.push_back(sorted[mid].dependent);
+		}
+		lo = mid + 1;
+	}
+}
+
+std::vector<Position> RangeDependencyIndex::FindDependents(const Position& pos) const {
+	std::vector<Position> result;
+	Stab(0, static_cast<int>(sorted.size()), pos, result);
+	for (const auto& entry : pending) {
+		if (entry.range.Contains(pos)) {
+			result.push_back(entry.dependent);
+		}
+	}
+	std::sort(begin(result), end(result));
+	result.erase(std::unique(begin(result), end(result)), end(result));
+	return result;
+}
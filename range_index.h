@@ -0,0 +1,37 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+
+// Пространственный индекс "диапазон -> формула, читающая его". Память
+// пропорциональна числу ссылок на диапазоны, а не их площади; поиск формул,
+// зависящих от ячейки, - запрос протыкания по интервальному дереву строк
+class RangeDependencyIndex {
+public:
+	void Add(const CellRange& range, const Position& dependent);
+	void Remove(const Position& dependent);
+	void Clear();
+	std::vector<Position> FindDependents(const Position& pos) const;
+	size_t GetSize() const;
+private:
+	struct Entry {
+		CellRange range;
+		Position dependent;
+	};
+
+	void Rebuild();
+	int BuildMaxLastRow(int lo, int hi);
+	void Stab(int lo, int hi, const Position& pos, std::vector<Position>& result) const;
+
+	static const size_t kMinPendingToRebuild = 32;
+
+	// отсортированы по первой строке; max_last_row[mid] - максимум последней
+	// строки по поддереву [lo, hi) с корнем в mid = (lo + hi) / 2
+	std::vector<Entry> sorted;
+	std::vector<int> max_last_row;
+	std::vector<bool> alive;
+	std::unordered_map<Position, std::vector<int>, PositionHasher> sorted_by_dependent;
+	size_t dead_count = 0;
+	// добавленные после последней перестройки, просматриваются линейно
+	std::vector<Entry> pending;
+};
@@ -1,311 +1,1327 @@
-﻿#include "sheet.h"
-
-void Sheet::SetToSize(int row_size, int col_size) {
-	size.rows = row_size;
-	size.cols = col_size;
-}
-
-void Sheet::UpdateSizeAfterCellInsertion(Cell* cell, const Position& pos) {
-	if (pos.row + 1 > size.rows) { SetToSize(pos.row + 1, size.cols); }
-	if (pos.col + 1 > size.cols) { SetToSize(size.rows, pos.col + 1); }
-
-	if (cell->IsFormula()) {
-		for (const auto& ref : cell->GetReferencedCells()) {
-			if (ref.row > size.rows) { SetToSize(ref.row, size.cols); }
-			if (ref.col > size.cols) { SetToSize(size.rows, ref.col); }
-		}
-	}
-}
-
-void Sheet::UpdateDependenedCells(const Position& pos, Cell* cell) {
-	auto cell_formula = cell->GetFormula();
-
-	for (const auto& dep_pos : cell_formula->GetReferencedCells()) {
-		if (GetCell(dep_pos) == nullptr) {
-			SetCell(dep_pos, "");
-		}
-		else {
-			Cell* ref_cel = GetCell(dep_pos);
-			ref_cel->AddDependentCell(pos);
-		}
-	}
-}
-
-void Sheet::UpdateCellText(Cell* cell) {
-	auto cell_formula = cell->GetFormula();
-	cell->SetText("=" + cell_formula->GetExpression());
-}
-
-void Sheet::UpdateCellValue(Cell* cell) {
-	auto cell_formula = cell->GetFormula();
-	auto formula_eval_res = cell_formula->Evaluate(*this);
-	if (std::holds_alternative<FormulaError>(formula_eval_res)) {
-		cell->SetValue(Cell::Value(std::get<FormulaError>(formula_eval_res)));
-	}
-	else if (std::holds_alternative<double>(formula_eval_res)) {
-		cell->SetValue(Cell::Value(std::get<double>(formula_eval_res)));
-	}
-}
-
-void Sheet::EvaluateFormula(const Position& pos, Cell* cell) {
-	if (cell->IsFormula()) {
-		UpdateDependenedCells(pos, cell);
-		UpdateCellText(cell);
-		UpdateCellValue(cell);
-	}
-}
-
-void Sheet::ThrowErrorIfInvalidPosition(const Position& pos) const {
-	if (!pos.IsValid()) {
-		std::stringstream message;
-		message << "invalid position: " << pos.ToString();
-		throw InvalidPositionException(message.str());
-	}
-}
-
-void Sheet::CheckForCircularDependency(const Position& pos, Cell* cell) {
-	if (cell != nullptr) {
-		auto referenced_cells = cell->GetReferencedCells();
-		for (const auto& ref_pos : referenced_cells) {
-			if (ref_pos == pos) {
-				throw CircularDependencyException("");
-			}
-			else {
-				CheckForCircularDependency(pos, GetCell(ref_pos));
-			}
-		}
-	}
-}
-
-void Sheet::SetCell(Position pos, std::string text) {
-	ThrowErrorIfInvalidPosition(pos);
-	auto cell_ptr = std::make_unique<Cell>(text, *this);
-	Cell* cell = cell_ptr.get();
-	CheckForCircularDependency(pos, cell);
-	
-	data[pos.row][pos.col] = std::move(cell_ptr);
-	UpdateSizeAfterCellInsertion(cell, pos);
-	EvaluateFormula(pos, cell);
-}
-
-const Cell* Sheet::GetCell(Position pos) const {
-	ThrowErrorIfInvalidPosition(pos);
-	if (data.find(pos.row) != end(data)) {
-		if (data.at(pos.row).find(pos.col) != end(data.at(pos.row))) {
-			return data.at(pos.row).at(pos.col).get();
-		}
-	}
-	return nullptr;
-}
-
-Cell* Sheet::GetCell(Position pos) {
-	ThrowErrorIfInvalidPosition(pos);
-	if (data.find(pos.row) != end(data)) {
-		if (data.at(pos.row).find(pos.col) != end(data.at(pos.row))) {
-			return data.at(pos.row).at(pos.col).get();
-		}
-	}
-	return nullptr;
-}
-
-void Sheet::ClearCell(Position pos) {
-	ThrowErrorIfInvalidPosition(pos);
-	if (data.find(pos.row) != end(data)) {
-		if (data.at(pos.row).find(pos.col) != end(data.at(pos.row))) {
-			data.at(pos.row).at(pos.col) = nullptr;
-		}
-	}
-}
-
-void Sheet::ThrowIfTooBigAfterInsertion(int row_count, int col_count) const {
-	Position pos;
-	pos.row = size.rows + row_count;
-	if (!pos.IsValid()) {
-		throw TableTooBigException("table will be too big after insertion of number of rows: " + std::to_string(row_count));
-	}
-	pos.col = size.cols + col_count;
-	if (!pos.IsValid()) {
-		throw TableTooBigException("table will be too big after insertion of number of cols: " + std::to_string(col_count));
-	}
-}
-
-void Sheet::InsertRows(int before, int count) {
-	ThrowIfTooBigAfterInsertion(count, 0);
-	for (auto it_r = begin(data); it_r != end(data); ++it_r) {
-		for (auto it_c = begin(data.at(it_r->first)); it_c != end(data.at(it_r->first)); ++it_c) {
-			it_c->second.get()->GetFormula()->HandleInsertedRows(before, count);
-		}
-	}
-}
-void Sheet::InsertCols(int before, int count) {
-	ThrowIfTooBigAfterInsertion(0, count);
-	for (auto it_r = begin(data); it_r != end(data); ++it_r) {
-		for (auto it_c = begin(data.at(it_r->first)); it_c != end(data.at(it_r->first)); ++it_c) {
-			it_c->second.get()->GetFormula()->HandleInsertedCols(before, count);
-		}
-	}
-}
-
-void Sheet::UpdateDependenedCellPositions(Cell* cell, int row_count, int col_count) {
-	auto& dependent_cells_pos = cell->GetDependentCells();
-	for (auto& pos : dependent_cells_pos) {
-		pos.row -= row_count;
-		pos.col -= col_count;
-	}
-}
-
-void Sheet::UpdateDeletedCellDependencies(Cell* cell, int first_row, int row_count, int first_col, int col_count) {
-	auto& dependent_cells = cell->GetDependentCells();
-	for (const auto& pos : dependent_cells) {
-		Cell* dependent_cell = GetCell(pos);
-		dependent_cell->UpdateValueIfFormula();
-		if (!dependent_cell->GetDependentCells().empty()) {
-			UpdateDependenedCellPositions(dependent_cell, row_count, col_count);
-			UpdateDeletedCellDependencies(dependent_cell, first_row, row_count, first_col, col_count);
-		}
-	}
-}
-
-std::vector<Sheet::CellPtr> Sheet::ExtractDeletedRows(int first, int count) {
-	std::vector<CellPtr> deleted_cells;
-	for (int row_num = first; row_num < first + count; ++row_num) {
-		if (data.find(row_num) != end(data)) {
-			auto node = data.extract(row_num);
-			for (auto& row : node.mapped()) {
-				deleted_cells.push_back(std::move(row.second));
-			}
-		}
-	}
-	size.rows -= count;
-	return deleted_cells;
-}
-
-void Sheet::ChangeRowIndexes(int first, int count) {
-	for (int i = first + count; i < size.rows + 1; ++i) {
-		if (data.find(i) != end(data)) {
-			data[i - count] = std::move(data.at(i));
-			data.erase(i);
-		}
-	}
-}
-
-void Sheet::UpdateNonDeletedRows(int first, int count) {
-	for (int row_num = first + count; row_num < size.rows; ++row_num) {
-		if (data.find(row_num) != end(data)) {
-			auto& row = data.at(row_num);
-			for (auto& item : row) {
-				Cell* cell = item.second.get();
-				if (cell->IsFormula()) {
-					cell->GetFormula()->HandleDeletedRows(first, count);
-				}
-			}
-		}
-	}
-}
-
-void Sheet::UpdateDependendCells(std::vector<CellPtr>& deleted_cells, int first_row, int row_count, int first_col, int col_count) {
-	for (auto& cell_ptr : deleted_cells) {
-		Cell* deleted_cell = cell_ptr.get();
-		UpdateDependenedCellPositions(deleted_cell, row_count, col_count);
-		UpdateDeletedCellDependencies(deleted_cell, first_row, row_count, first_col, col_count);
-	}
-}
-
-void Sheet::DeleteRows(int first, int count) {
-	UpdateNonDeletedRows(first, count);
-	std::vector<CellPtr>& deleted_cells = ExtractDeletedRows(first, count);
-	ChangeRowIndexes(first, count);
-	UpdateDependendCells(deleted_cells, first, count, 0, 0);
-}
-
-std::vector<Sheet::CellPtr> Sheet::ExtractDeletedCols(int first, int count) {
-	std::vector<CellPtr> deleted_cells;
-	for (auto& row : data) {
-		for (int col_num = first; col_num < first + count; ++col_num) {
-			if (row.second.find(col_num) != end(row.second)) {
-				auto node = row.second.extract(col_num);
-				deleted_cells.push_back(std::move(node.mapped()));
-			}
-		}
-	}
-	return deleted_cells;
-}
-
-void Sheet::UpdateNonDeletedCols(int first, int count) {
-	for (auto& row : data) {
-		for (int col_num = first + count; col_num < size.cols; ++col_num) {
-			if (row.second.find(col_num) != end(row.second)) {
-				Cell* cell = row.second.at(col_num).get();
-				if (cell->IsFormula()) {
-					cell->GetFormula()->HandleDeletedCols(first, count);
-				}
-			}
-		}
-	}
-}
-
-void Sheet::ChangeColIndexes(int first, int count) {
-	for (auto& row : data) {
-		for (int i = first + count; i < size.cols + 1; ++i) {
-			if (row.second.find(i) != end(row.second)) {
-				row.second[i - count] = std::move(row.second[i]);
-				row.second.erase(i);
-			}
-		}
-	}
-}
-
-void Sheet::DeleteCols(int first, int count) {
-	UpdateNonDeletedCols(first, count);
-	std::vector<CellPtr> deleted_cells = ExtractDeletedCols(first, count);
-	ChangeColIndexes(first, count);
-	UpdateDependendCells(deleted_cells, 0, 0, first, count);
-}
-
-Size Sheet::GetPrintableSize() const { return size; }
-void Sheet::PrintValues(std::ostream& output) const {
-	for (int r = 0; r < size.rows; ++r) {
-		int blank_cells = 0;
-		for (int c = 0; c < size.cols; ++c) {
-			auto cell = GetCell({ r, c });
-			if (cell == nullptr) {
-				++blank_cells;
-				continue; 
-			}
-			if (cell->IsFormula()) {
-				output << cell->GetValue();
-			}
-			else {
-				output << cell->GetText();
-			}
-			if (c + 1 != size.cols) {
-				output << '\t';
-			}
-		}
-		if (blank_cells == size.cols) {
-			output << '\t';
-		}
-		output << '\n';
-	}
-}
-
-void Sheet::PrintTexts(std::ostream& output) const {
-	for (int r = 0; r < size.rows; ++r) {
-		int blank_cells = 0;
-		for (int c = 0; c < size.cols; ++c) {
-			auto cell = GetCell({ r, c });
-			if (cell == nullptr) {
-				++blank_cells;
-				continue; 
-			}
-			output << cell->GetText();
-			if (c+1 != size.cols) {
-				output << '\t';
-			}
-		}
-		if (blank_cells == size.cols) {
-			output << '\t';
-		}
-		output << '\n';
-	}
-}
\ No newline at end of file
+﻿#include "sheet.h"
+#include <exception>
+#include <thread>
+#include <utility>
+
+Sheet::Sheet() : cell_resource(&cell_pool), data(cell_resource) {}
+
+Sheet::Sheet(std::pmr::memory_resource* resource) : cell_resource(resource), data(cell_resource) {}
+
+void Sheet::PutCell(const Position& pos, CellPtr cell) {
+	CellPtr& slot = data[pos.row][pos.col];
+	if (slot == nullptr) {
+		AddOccupied(pos);
+	}
+	slot = std::move(cell);
+}
+
+Sheet::CellPtr Sheet::TakeCell(const Position& pos) {
+	auto row_it = data.find(pos.row);
+	if (row_it == end(data)) {
+		return nullptr;
+	}
+	auto cell_it = row_it->second.find(pos.col);
+	if (cell_it == end(row_it->second)) {
+		return nullptr;
+	}
+	CellPtr cell = std::move(cell_it->second);
+	row_it->second.erase(cell_it);
+	if (row_it->second.empty()) {
+		data.erase(row_it);
+	}
+	if (cell != nullptr) {
+		RemoveOccupied(pos);
+	}
+	return cell;
+}
+
+void Sheet::AddOccupied(const Position& pos) {
+	++row_cell_counts[pos.row];
+	++col_cell_counts[pos.col];
+	UpdatePrintableSize();
+}
+
+void Sheet::RemoveOccupied(const Position& pos) {
+	auto row_it = row_cell_counts.find(pos.row);
+	if (--row_it->second == 0) {
+		row_cell_counts.erase(row_it);
+	}
+	auto col_it = col_cell_counts.find(pos.col);
+	if (--col_it->second == 0) {
+		col_cell_counts.erase(col_it);
+	}
+	UpdatePrintableSize();
+}
+
+void Sheet::UpdatePrintableSize() {
+	size.rows = row_cell_counts.empty() ? 0 : row_cell_counts.rbegin()->first + 1;
+	size.cols = col_cell_counts.empty() ? 0 : col_cell_counts.rbegin()->first + 1;
+}
+
+// Номера от first сдвигаются на delta вместе со строками или столбцами листа;
+// при удалении счётчики удалённых номеров уже должны быть обнулены
+void Sheet::ShiftCellCounts(std::map<int, int>& counts, int first, int delta) {
+	auto first_it = counts.lower_bound(first);
+	std::vector<std::pair<int, int>> moved(first_it, end(counts));
+	counts.erase(first_it, end(counts));
+	for (const auto& [index, count] : moved) {
+		counts.emplace_hint(end(counts), index + delta, count);
+	}
+}
+
+void Sheet::UpdateDependenedCells(const Position& pos, Cell* cell) {
+	auto cell_formula = cell->GetFormula();
+
+	std::vector<Position> referenced_cells = cell_formula->GetReferencedCells();
+	for (const auto& dep_pos : referenced_cells) {
+		if (FindCell(dep_pos) == nullptr) {
+			CreatePlaceholder(dep_pos);
+		}
+	}
+	dependencies.SetPrecedents(pos, std::move(referenced_cells));
+	for (const auto& range : cell_formula->GetReferencedRanges()) {
+		range_dependents.Add(range, pos);
+	}
+}
+
+void Sheet::CreatePlaceholder(const Position& pos) {
+	auto cell_ptr = Cell::Create(cell_resource, "", *this);
+	cell_ptr->MarkAsPlaceholder();
+	PutCell(pos, std::move(cell_ptr));
+	OnCellChanged(pos);
+}
+
+// Заглушки, на которые после замены или очистки формулы никто не ссылается,
+// удаляются, иначе при долгой работе они копятся без ограничений
+void Sheet::ReleasePlaceholders(const std::vector<Position>& precedents) {
+	for (const auto& pos : precedents) {
+		const Cell* cell = FindCell(pos);
+		if (cell == nullptr || !cell->IsPlaceholder() || dependencies.HasDependents(pos)) {
+			continue;
+		}
+		TakeCell(pos);
+		OnCellChanged(pos);
+	}
+}
+
+// После вставки и удаления строк и столбцов ссылки формул уже сдвинуты,
+// поэтому рёбра проще построить заново, чем сдвигать
+void Sheet::RebuildDependencies() {
+	dependencies.Clear();
+	range_dependents.Clear();
+	for (const auto& row : data) {
+		for (const auto& item : row.second) {
+			if (item.second == nullptr || !item.second->IsFormula()) {
+				continue;
+			}
+			Position pos{ row.first, item.first };
+			dependencies.SetPrecedents(pos, item.second->GetReferencedCells());
+			for (const auto& range : item.second->GetReferencedRanges()) {
+				range_dependents.Add(range, pos);
+			}
+		}
+	}
+}
+
+void Sheet::RecalculateRangeFormulas() {
+	std::vector<Position> range_formulas;
+	for (const auto& row : data) {
+		for (const auto& item : row.second) {
+			if (item.second != nullptr && !item.second->GetReferencedRanges().empty()) {
+				range_formulas.push_back({ row.first, item.first });
+			}
+		}
+	}
+	RecalculateFormulas(std::move(range_formulas));
+}
+
+void Sheet::RecalculateDependents(const std::vector<Position>& changed) {
+	std::vector<Position> dependents;
+	for (const auto& pos : changed) {
+		auto range_dependents_of_pos = range_dependents.FindDependents(pos);
+		dependents.insert(end(dependents), begin(range_dependents_of_pos), end(range_dependents_of_pos));
+		auto cell_dependents_of_pos = dependencies.GetDependents(pos);
+		dependents.insert(end(dependents), begin(cell_dependents_of_pos), end(cell_dependents_of_pos));
+	}
+	if (!dependents.empty()) {
+		RecalculateFormulas(std::move(dependents));
+	}
+}
+
+void Sheet::RecalculateFormulas(std::vector<Position> affected) {
+	if (calculation_mode != CalculationMode::Automatic) {
+		MarkDirty(std::move(affected));
+		return;
+	}
+	auto get_dependents = [this](const Position& pos) {
+		std::vector<Position> dependents = range_dependents.FindDependents(pos);
+		auto cell_dependents = dependencies.GetDependents(pos);
+		dependents.insert(end(dependents), begin(cell_dependents), end(cell_dependents));
+		return dependents;
+	};
+
+	// исходные формулы вычисляются всегда, остальные - только если изменилось
+	// значение хотя бы одной формулы, от которой они зависят
+	std::unordered_set<Position, PositionHasher> pending(begin(affected), end(affected));
+	std::unordered_set<Position, PositionHasher> seen(begin(affected), end(affected));
+	for (size_t i = 0; i < affected.size(); ++i) {
+		for (const auto& dependent : get_dependents(affected[i])) {
+			if (seen.insert(dependent).second) {
+				affected.push_back(dependent);
+			}
+		}
+	}
+
+	for (const auto& pos : GetEvaluationOrder(affected)) {
+		if (pending.count(pos) == 0) {
+			++recalculation_stats.pruned;
+			continue;
+		}
+		++recalculation_stats.evaluated;
+		if (UpdateCellValue(pos, FindCell(pos))) {
+			auto dependents = get_dependents(pos);
+			pending.insert(begin(dependents), end(dependents));
+		}
+	}
+}
+
+std::vector<Position> Sheet::GetEvaluationOrder(const std::vector<Position>& positions) const {
+	std::unordered_map<Position, int, PositionHasher> levels;
+	std::vector<std::pair<int, Position>> ordered;
+	for (const auto& pos : positions) {
+		const Cell* cell = FindCell(pos);
+		if (cell != nullptr && cell->IsFormula()) {
+			ordered.push_back({ ComputeEvaluationLevel(pos, levels), pos });
+		}
+	}
+	std::sort(begin(ordered), end(ordered));
+	std::vector<Position> order;
+	order.reserve(ordered.size());
+	for (const auto& item : ordered) {
+		order.push_back(item.second);
+	}
+	return order;
+}
+
+void Sheet::EvaluateInOrder(const std::vector<Position>& positions) {
+	for (const auto& pos : GetEvaluationOrder(positions)) {
+		UpdateCellValue(pos, FindCell(pos));
+	}
+}
+
+// Зависимые от грязной формулы уже грязные, поэтому обход останавливается на них
+void Sheet::MarkDirty(std::vector<Position> positions) {
+	for (size_t i = 0; i < positions.size(); ++i) {
+		const Cell* cell = FindCell(positions[i]);
+		if (cell == nullptr || !cell->IsFormula() || !dirty.insert(positions[i]).second) {
+			continue;
+		}
+		auto range_dependents_of_pos = range_dependents.FindDependents(positions[i]);
+		positions.insert(end(positions), begin(range_dependents_of_pos), end(range_dependents_of_pos));
+		auto cell_dependents_of_pos = dependencies.GetDependents(positions[i]);
+		positions.insert(end(positions), begin(cell_dependents_of_pos), end(cell_dependents_of_pos));
+	}
+}
+
+// Вычисляет targets и грязные формулы, от которых они зависят. Чистая
+// формула не может зависеть от грязной, поэтому обход идёт только по грязным
+void Sheet::EvaluateDirty(const std::vector<Position>& targets) {
+	std::vector<Position> stack(targets);
+	std::unordered_set<Position, PositionHasher> visited;
+	std::vector<Position> to_evaluate;
+	while (!stack.empty()) {
+		Position pos = stack.back();
+		stack.pop_back();
+		if (dirty.count(pos) == 0 || !visited.insert(pos).second) {
+			continue;
+		}
+		to_evaluate.push_back(pos);
+		const Cell* cell = FindCell(pos);
+		for (const auto& ref : cell->GetReferencedCells()) {
+			stack.push_back(ref);
+		}
+		for (const auto& range : cell->GetReferencedRanges()) {
+			auto range_formulas = GetFormulaCellsInRange(range);
+			stack.insert(end(stack), begin(range_formulas), end(range_formulas));
+		}
+	}
+
+	evaluating_dirty = true;
+	EvaluateInOrder(to_evaluate);
+	evaluating_dirty = false;
+	for (const auto& pos : to_evaluate) {
+		dirty.erase(pos);
+	}
+}
+
+template <typename Remap>
+void Sheet::RemapDirty(Remap remap) {
+	std::unordered_set<Position, PositionHasher> remapped;
+	for (const auto& pos : dirty) {
+		if (auto new_pos = remap(pos)) {
+			remapped.insert(*new_pos);
+		}
+	}
+	dirty = std::move(remapped);
+}
+
+void Sheet::SetCalculationMode(CalculationMode mode) {
+	calculation_mode = mode;
+	if (mode == CalculationMode::Automatic) {
+		Recalculate();
+	}
+}
+
+Sheet::CalculationMode Sheet::GetCalculationMode() const {
+	return calculation_mode;
+}
+
+void Sheet::Recalculate() {
+	std::vector<Position> positions(begin(dirty), end(dirty));
+	dirty.clear();
+	EvaluateInOrder(positions);
+}
+
+void Sheet::RecalculateRegions(const std::vector<CellRange>& regions) {
+	for (const auto& region : regions) {
+		if (!region.IsValid()) {
+			throw InvalidPositionException("invalid range: " + region.ToString());
+		}
+	}
+	if (dirty.empty()) {
+		return;
+	}
+	std::vector<Position> targets;
+	for (const auto& region : regions) {
+		auto region_formulas = GetFormulaCellsInRange(region);
+		targets.insert(end(targets), begin(region_formulas), end(region_formulas));
+	}
+	EvaluateDirty(targets);
+}
+
+size_t Sheet::RecalculatePending(size_t max_formulas) {
+	std::vector<Position> targets;
+	for (auto it = begin(dirty); it != end(dirty) && targets.size() < max_formulas; ++it) {
+		targets.push_back(*it);
+	}
+	EvaluateDirty(targets);
+	return dirty.size();
+}
+
+size_t Sheet::GetDirtyCount() const {
+	return dirty.size();
+}
+
+void Sheet::DiscardDirty() {
+	dirty.clear();
+}
+
+Sheet::RecalculationStats Sheet::GetRecalculationStats() const {
+	return recalculation_stats;
+}
+
+void Sheet::ResetRecalculationStats() {
+	recalculation_stats = {};
+}
+
+FormulaTextCache::Stats Sheet::GetFormulaCacheStats() const {
+	return templates.GetTextCache().GetStats();
+}
+
+void Sheet::SetFormulaCacheBudget(size_t bytes) {
+	templates.GetTextCache().SetMemoryBudget(bytes);
+}
+
+// Возвращает, изменилось ли значение ячейки
+bool Sheet::UpdateCellValue(const Position& pos, Cell* cell) {
+	auto cell_formula = cell->GetFormula();
+	auto formula_eval_res = cell_formula->Evaluate(*this);
+	Cell::Value new_value;
+	if (std::holds_alternative<FormulaError>(formula_eval_res)) {
+		new_value = std::get<FormulaError>(formula_eval_res);
+	}
+	else {
+		new_value = std::get<double>(formula_eval_res);
+	}
+	if (cell->GetValue() == new_value) {
+		return false;
+	}
+	cell->SetValue(std::move(new_value));
+	OnCellChanged(pos);
+	return true;
+}
+
+void Sheet::EvaluateFormula(const Position& pos, Cell* cell) {
+	if (!cell->IsFormula()) {
+		return;
+	}
+	UpdateDependenedCells(pos, cell);
+	// текст ячейки изменился, даже если значение осталось прежним
+	if (calculation_mode != CalculationMode::Automatic) {
+		MarkDirty({ pos });
+		OnCellChanged(pos);
+	}
+	else if (!UpdateCellValue(pos, cell)) {
+		OnCellChanged(pos);
+	}
+}
+
+void Sheet::ThrowErrorIfInvalidPosition(const Position& pos) const {
+	if (!pos.IsValid()) {
+		std::stringstream message;
+		message << "invalid position: " << pos.ToString();
+		throw InvalidPositionException(message.str());
+	}
+}
+
+bool Sheet::HasCircularDependency(const Position& pos, const Cell* cell) const {
+	std::unordered_set<Position, PositionHasher> visited;
+	std::vector<const Cell*> stack{ cell };
+	while (!stack.empty()) {
+		const Cell* current = stack.back();
+		stack.pop_back();
+		if (current == nullptr) {
+			continue;
+		}
+		for (const auto& ref_pos : current->GetReferencedCells()) {
+			if (ref_pos == pos) {
+				return true;
+			}
+			if (visited.insert(ref_pos).second) {
+				stack.push_back(FindCell(ref_pos));
+			}
+		}
+		for (const auto& range : current->GetReferencedRanges()) {
+			if (range.Contains(pos)) {
+				return true;
+			}
+			for (const auto& formula_pos : GetFormulaCellsInRange(range)) {
+				if (visited.insert(formula_pos).second) {
+					stack.push_back(FindCell(formula_pos));
+				}
+			}
+		}
+	}
+	return false;
+}
+
+// Обход в глубину от roots по ссылкам и диапазонам; цикл - возврат в
+// ячейку, обход которой ещё не закончен
+bool Sheet::HasCircularDependency(const std::vector<Position>& roots) const {
+	enum class State { InProgress, Done };
+	struct Frame {
+		Position pos;
+		std::vector<Position> precedents;
+		size_t next = 0;
+	};
+	auto make_frame = [this](const Position& pos) {
+		Frame frame{ pos, {} };
+		const Cell* cell = FindCell(pos);
+		if (cell != nullptr && cell->IsFormula()) {
+			frame.precedents = cell->GetReferencedCells();
+			for (const auto& range : cell->GetReferencedRanges()) {
+				auto range_formulas = GetFormulaCellsInRange(range);
+				frame.precedents.insert(end(frame.precedents), begin(range_formulas), end(range_formulas));
+			}
+		}
+		return frame;
+	};
+
+	std::unordered_map<Position, State, PositionHasher> states;
+	std::vector<Frame> stack;
+	for (const auto& root : roots) {
+		if (!states.emplace(root, State::InProgress).second) {
+			continue;
+		}
+		stack.push_back(make_frame(root));
+		while (!stack.empty()) {
+			Frame& frame = stack.back();
+			if (frame.next == frame.precedents.size()) {
+				states[frame.pos] = State::Done;
+				stack.pop_back();
+				continue;
+			}
+			Position precedent = frame.precedents[frame.next++];
+			auto [it, inserted] = states.emplace(precedent, State::InProgress);
+			if (inserted) {
+				stack.push_back(make_frame(precedent));
+			}
+			else if (it->second == State::InProgress) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Обходит ячейки диапазона, перебирая номера строк и столбцов или сами
+// строки и ячейки листа - смотря чего меньше
+template <typename Callback>
+void Sheet::ForEachCellInRange(const CellRange& range, Callback callback) const {
+	auto visit_row = [&](int row_num, const Row& row) {
+		auto visit_cell = [&](int col_num, const CellPtr& cell) {
+			if (cell != nullptr) {
+				callback(Position{ row_num, col_num }, *cell);
+			}
+		};
+		if (static_cast<size_t>(range.last.col - range.first.col + 1) < row.size()) {
+			for (int col_num = range.first.col; col_num <= range.last.col; ++col_num) {
+				auto it = row.find(col_num);
+				if (it != end(row)) {
+					visit_cell(col_num, it->second);
+				}
+			}
+		}
+		else {
+			for (const auto& item : row) {
+				if (range.first.col <= item.first && item.first <= range.last.col) {
+					visit_cell(item.first, item.second);
+				}
+			}
+		}
+	};
+
+	if (static_cast<size_t>(range.last.row - range.first.row + 1) < data.size()) {
+		for (int row_num = range.first.row; row_num <= range.last.row; ++row_num) {
+			auto it = data.find(row_num);
+			if (it != end(data)) {
+				visit_row(row_num, it->second);
+			}
+		}
+	}
+	else {
+		for (const auto& row : data) {
+			if (range.first.row <= row.first && row.first <= range.last.row) {
+				visit_row(row.first, row.second);
+			}
+		}
+	}
+}
+
+std::vector<Position> Sheet::GetFormulaCellsInRange(const CellRange& range) const {
+	std::vector<Position> formula_cells;
+	ForEachCellInRange(range, [&formula_cells](Position pos, const Cell& cell) {
+		if (cell.IsFormula()) {
+			formula_cells.push_back(pos);
+		}
+	});
+	return formula_cells;
+}
+
+void Sheet::ReadRange(const CellRange& range, double* numbers, CellValueType* types, std::string_view* texts) const {
+	if (!range.IsValid()) {
+		throw InvalidPositionException("invalid range: " + range.ToString());
+	}
+	if (calculation_mode == CalculationMode::Deferred && !evaluating_dirty && !dirty.empty()) {
+		const_cast<Sheet*>(this)->EvaluateDirty(GetFormulaCellsInRange(range));
+	}
+	const size_t cols = range.last.col - range.first.col + 1;
+	const size_t count = (range.last.row - range.first.row + 1) * cols;
+	std::fill_n(numbers, count, 0.0);
+	std::fill_n(types, count, CellValueType::Empty);
+	std::fill_n(texts, count, std::string_view());
+	ForEachCellInRange(range, [&](Position pos, const Cell& cell) {
+		size_t index = (pos.row - range.first.row) * cols + (pos.col - range.first.col);
+		const Cell::Value& value = cell.PeekValue();
+		if (const double* number = std::get_if<double>(&value)) {
+			numbers[index] = *number;
+			types[index] = CellValueType::Number;
+		}
+		else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+			texts[index] = error->ToString();
+			types[index] = CellValueType::Error;
+		}
+		// пустой текст, как у заглушек, не отличается от отсутствующей ячейки
+		else if (const std::string& text = std::get<std::string>(value); !text.empty()) {
+			texts[index] = text;
+			types[index] = CellValueType::Text;
+		}
+	});
+}
+
+RangeSummary Sheet::SummarizeCell(const Cell* cell) {
+	RangeSummary summary;
+	if (cell == nullptr) {
+		return summary;
+	}
+	auto value = cell->GetValue();
+	if (std::holds_alternative<double>(value)) {
+		summary.Add(std::get<double>(value));
+	}
+	else if (std::holds_alternative<FormulaError>(value)) {
+		summary.first_error = std::get<FormulaError>(value);
+	}
+	return summary;
+}
+
+// Пустые столбцы деревьев не получают, недостающие деревья собираются за один
+// проход по ячейкам и покрывают строки только до последней занятой в столбце
+void Sheet::BuildColumnSummaryTrees(int first_col, int last_col) const {
+	std::unordered_map<int, std::vector<std::pair<int, RangeSummary>>> leaves;
+	int min_col = last_col;
+	int max_col = first_col;
+	for (auto it = col_cell_counts.lower_bound(first_col); it != end(col_cell_counts) && it->first <= last_col; ++it) {
+		if (column_summaries.count(it->first) == 0) {
+			leaves[it->first].reserve(it->second);
+			min_col = std::min(min_col, it->first);
+			max_col = std::max(max_col, it->first);
+		}
+	}
+	if (leaves.empty()) {
+		return;
+	}
+	ForEachCellInRange(CellRange{ Position{ 0, min_col }, Position{ size.rows - 1, max_col } }, [&leaves](Position pos, const Cell& cell) {
+		auto it = leaves.find(pos.col);
+		if (it != end(leaves)) {
+			it->second.push_back({ pos.row, SummarizeCell(&cell) });
+		}
+	});
+	for (const auto& [col, column_leaves] : leaves) {
+		int max_row = 0;
+		for (const auto& leaf : column_leaves) {
+			max_row = std::max(max_row, leaf.first);
+		}
+		ColumnSummaryTree tree(max_row + 1);
+		tree.Build(column_leaves);
+		column_summaries.emplace(col, std::move(tree));
+	}
+}
+
+void Sheet::OnCellChanged(const Position& pos) {
+	UpdateColumnSummary(pos);
+	if (track_changes && !layout_changed) {
+		changed_rows.insert(pos.row);
+	}
+}
+
+void Sheet::OnLayoutChanged() {
+	column_summaries.clear();
+	if (track_changes) {
+		layout_changed = true;
+		changed_rows.clear();
+	}
+}
+
+void Sheet::TrackChanges(bool enabled) {
+	track_changes = enabled;
+	layout_changed = true;
+	changed_rows.clear();
+}
+
+std::optional<std::vector<int>> Sheet::TakeChangedRows() {
+	if (layout_changed) {
+		layout_changed = false;
+		return std::nullopt;
+	}
+	std::vector<int> rows(begin(changed_rows), end(changed_rows));
+	changed_rows.clear();
+	return rows;
+}
+
+const Sheet::Row* Sheet::GetRow(int row) const {
+	auto it = data.find(row);
+	return it == end(data) ? nullptr : &it->second;
+}
+
+const DependencyGraph& Sheet::GetDependencyGraph() const {
+	return dependencies;
+}
+
+std::vector<int> Sheet::GetRowIndexes() const {
+	std::vector<int> rows;
+	rows.reserve(data.size());
+	for (const auto& row : data) {
+		rows.push_back(row.first);
+	}
+	return rows;
+}
+
+void Sheet::UpdateColumnSummary(const Position& pos) {
+	auto it = column_summaries.find(pos.col);
+	if (it == end(column_summaries)) {
+		return;
+	}
+	if (pos.row >= it->second.GetCapacity()) {
+		column_summaries.erase(it);
+		return;
+	}
+	it->second.Set(pos.row, SummarizeCell(FindCell(pos)));
+}
+
+RangeSummary Sheet::SummarizeRange(const CellRange& range) const {
+	if (calculation_mode == CalculationMode::Deferred && !evaluating_dirty && !dirty.empty()) {
+		const_cast<Sheet*>(this)->EvaluateDirty(GetFormulaCellsInRange(range));
+	}
+	BuildColumnSummaryTrees(range.first.col, range.last.col);
+	RangeSummary summary;
+	for (auto it = col_cell_counts.lower_bound(range.first.col); it != end(col_cell_counts) && it->first <= range.last.col; ++it) {
+		const ColumnSummaryTree& tree = column_summaries.at(it->first);
+		if (range.first.row < tree.GetCapacity()) {
+			summary.Add(tree.Query(range.first.row, std::min(range.last.row, tree.GetCapacity() - 1)));
+		}
+	}
+	return summary;
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+	switch (TrySetCell(pos, text)) {
+	case CellStatus::Ok:
+		break;
+	case CellStatus::InvalidPosition:
+		ThrowErrorIfInvalidPosition(pos);
+		break;
+	case CellStatus::InvalidFormula:
+		// разбор повторяется ради описания ошибки
+		ParseFormula(text.substr(1), pos, templates);
+		throw FormulaException("invalid formula");
+	case CellStatus::CircularDependency:
+		throw CircularDependencyException("");
+	}
+}
+
+CellStatus Sheet::TrySetCell(Position pos, std::string text) {
+	if (!pos.IsValid()) {
+		return CellStatus::InvalidPosition;
+	}
+	auto cell_ptr = Cell::TryCreate(cell_resource, std::move(text), *this, pos, templates);
+	if (cell_ptr == nullptr) {
+		return CellStatus::InvalidFormula;
+	}
+	Cell* cell = cell_ptr.get();
+	if (HasCircularDependency(pos, cell)) {
+		return CellStatus::CircularDependency;
+	}
+	
+	std::vector<Position> old_precedents = dependencies.GetPrecedents(pos);
+	range_dependents.Remove(pos);
+	dirty.erase(pos);
+	PutCell(pos, std::move(cell_ptr));
+	EvaluateFormula(pos, cell);
+	if (!cell->IsFormula()) {
+		dependencies.Remove(pos);
+		OnCellChanged(pos);
+	}
+	ReleasePlaceholders(old_precedents);
+	RecalculateDependents({ pos });
+	return CellStatus::Ok;
+}
+
+std::vector<Sheet::CellPtr> Sheet::ParseCells(const std::vector<std::pair<Position, std::string>>& cells, size_t thread_count) {
+	if (thread_count == 0) {
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+	}
+	thread_count = std::max<size_t>(1, std::min(thread_count, cells.size() / kMinCellsPerParser));
+
+	// у каждого потока свой кэш шаблонов; кэш листа не разделяется между потоками.
+	// Ресурс листа тоже не потокобезопасен, поэтому память под ячейки берётся заранее
+	std::vector<CellPtr> parsed(cells.size());
+	std::vector<void*> memory(cells.size());
+	for (auto& block : memory) {
+		block = cell_resource->allocate(sizeof(Cell), alignof(Cell));
+	}
+	std::vector<FormulaTemplateCache> thread_templates(thread_count);
+	for (auto& cache : thread_templates) {
+		cache.GetTextCache().SetMemoryBudget(templates.GetTextCache().GetMemoryBudget());
+	}
+	std::vector<std::exception_ptr> errors(thread_count);
+	auto parse_chunk = [&](size_t index) {
+		size_t first = cells.size() * index / thread_count;
+		size_t last = cells.size() * (index + 1) / thread_count;
+		try {
+			for (size_t i = first; i < last; ++i) {
+				Cell* cell = new (memory[i]) Cell(cells[i].second, *this, cells[i].first, thread_templates[index]);
+				parsed[i] = CellPtr(cell, Cell::Deleter{ cell_resource });
+			}
+		}
+		catch (...) {
+			errors[index] = std::current_exception();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t index = 1; index < thread_count; ++index) {
+		threads.emplace_back(parse_chunk, index);
+	}
+	parse_chunk(0);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	// ошибка первой по порядку ячейки, как при последовательных SetCell
+	for (const auto& error : errors) {
+		if (error) {
+			for (size_t i = 0; i < cells.size(); ++i) {
+				if (parsed[i] == nullptr) {
+					cell_resource->deallocate(memory[i], sizeof(Cell), alignof(Cell));
+				}
+			}
+			std::rethrow_exception(error);
+		}
+	}
+	for (const auto& cache : thread_templates) {
+		templates.Merge(cache);
+	}
+	return parsed;
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, size_t thread_count) {
+	for (const auto& cell : cells) {
+		ThrowErrorIfInvalidPosition(cell.first);
+	}
+	std::vector<CellPtr> parsed = ParseCells(cells, thread_count);
+
+	// ячейки ставятся на место до проверки циклов, заменённые сохраняются для отката
+	std::unordered_set<Position, PositionHasher> positions;
+	std::vector<std::pair<Position, CellPtr>> replaced;
+	std::vector<Position> formulas;
+	for (size_t i = 0; i < cells.size(); ++i) {
+		const Position& pos = cells[i].first;
+		CellPtr& slot = data[pos.row][pos.col];
+		if (positions.insert(pos).second) {
+			if (slot == nullptr) {
+				AddOccupied(pos);
+			}
+			replaced.push_back({ pos, std::move(slot) });
+		}
+		slot = std::move(parsed[i]);
+	}
+	for (const auto& item : replaced) {
+		if (FindCell(item.first)->IsFormula()) {
+			formulas.push_back(item.first);
+		}
+	}
+	if (HasCircularDependency(formulas)) {
+		for (auto& [pos, old_cell] : replaced) {
+			if (old_cell != nullptr) {
+				data[pos.row][pos.col] = std::move(old_cell);
+				continue;
+			}
+			TakeCell(pos);
+		}
+		throw CircularDependencyException("");
+	}
+
+	std::vector<Position> old_precedents;
+	std::vector<std::pair<Position, std::vector<Position>>> precedents;
+	precedents.reserve(replaced.size());
+	for (const auto& [pos, old_cell] : replaced) {
+		if (old_cell != nullptr && old_cell->IsFormula()) {
+			auto old_refs = dependencies.GetPrecedents(pos);
+			old_precedents.insert(end(old_precedents), begin(old_refs), end(old_refs));
+		}
+		range_dependents.Remove(pos);
+		dirty.erase(pos);
+		OnCellChanged(pos);
+		Cell* cell = FindCell(pos);
+		if (!cell->IsFormula()) {
+			precedents.push_back({ pos, {} });
+			continue;
+		}
+		std::vector<Position> referenced_cells = cell->GetReferencedCells();
+		for (const auto& ref : referenced_cells) {
+			if (FindCell(ref) == nullptr) {
+				CreatePlaceholder(ref);
+			}
+		}
+		precedents.push_back({ pos, std::move(referenced_cells) });
+		for (const auto& range : cell->GetReferencedRanges()) {
+			range_dependents.Add(range, pos);
+		}
+	}
+	dependencies.SetPrecedents(std::move(precedents));
+	replaced.clear();
+	ReleasePlaceholders(old_precedents);
+
+	// пересчитываются новые формулы и всё, что зависит от записанных ячеек
+	std::unordered_set<Position, PositionHasher> affected(begin(formulas), end(formulas));
+	std::vector<Position> queue(begin(positions), end(positions));
+	for (size_t i = 0; i < queue.size(); ++i) {
+		for (const auto& dependent : range_dependents.FindDependents(queue[i])) {
+			if (affected.insert(dependent).second) {
+				queue.push_back(dependent);
+			}
+		}
+		for (const auto& dependent : dependencies.GetDependents(queue[i])) {
+			if (affected.insert(dependent).second) {
+				queue.push_back(dependent);
+			}
+		}
+	}
+	std::vector<Position> closure(begin(affected), end(affected));
+	if (calculation_mode != CalculationMode::Automatic) {
+		MarkDirty(std::move(closure));
+		return;
+	}
+	EvaluateByLevels(closure);
+}
+
+const Cell* Sheet::GetCell(Position pos) const {
+	ThrowErrorIfInvalidPosition(pos);
+	if (calculation_mode == CalculationMode::Deferred && !evaluating_dirty && dirty.count(pos) != 0) {
+		// значения формул - кэш вычислений, поэтому досчитываются и при чтении
+		const_cast<Sheet*>(this)->EvaluateDirty({ pos });
+	}
+	return FindCell(pos);
+}
+
+Cell* Sheet::GetCell(Position pos) {
+	return const_cast<Cell*>(std::as_const(*this).GetCell(pos));
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+	auto row_it = data.find(pos.row);
+	if (row_it == end(data)) {
+		return nullptr;
+	}
+	auto cell_it = row_it->second.find(pos.col);
+	return cell_it == end(row_it->second) ? nullptr : cell_it->second.get();
+}
+
+Cell* Sheet::FindCell(Position pos) {
+	return const_cast<Cell*>(std::as_const(*this).FindCell(pos));
+}
+
+void Sheet::ClearCell(Position pos) {
+	ThrowErrorIfInvalidPosition(pos);
+	// ячейка удаляется из строки, а не обнуляется, чтобы очищенные позиции не копились
+	if (TakeCell(pos) == nullptr) {
+		return;
+	}
+	std::vector<Position> old_precedents = dependencies.GetPrecedents(pos);
+	dependencies.Remove(pos);
+	range_dependents.Remove(pos);
+	dirty.erase(pos);
+	OnCellChanged(pos);
+	ReleasePlaceholders(old_precedents);
+	RecalculateDependents({ pos });
+}
+
+void Sheet::ThrowIfTooBigAfterInsertion(int row_count, int col_count) const {
+	Position pos;
+	pos.row = size.rows + row_count;
+	if (!pos.IsValid()) {
+		throw TableTooBigException("table will be too big after insertion of number of rows: " + std::to_string(row_count));
+	}
+	pos.col = size.cols + col_count;
+	if (!pos.IsValid()) {
+		throw TableTooBigException("table will be too big after insertion of number of cols: " + std::to_string(col_count));
+	}
+}
+
+void Sheet::InsertRows(int before, int count) {
+	ThrowIfTooBigAfterInsertion(count, 0);
+	OnLayoutChanged();
+	for (auto it_r = begin(data); it_r != end(data); ++it_r) {
+		for (auto it_c = begin(it_r->second); it_c != end(it_r->second); ++it_c) {
+			Cell* cell = it_c->second.get();
+			if (cell != nullptr && cell->IsFormula()) {
+				if (cell->GetFormula()->HandleInsertedRows(before, count) != IFormula::HandlingResult::NothingChanged) {
+					cell->InvalidateText();
+				}
+			}
+		}
+	}
+	std::vector<int> moved_rows;
+	for (const auto& row : data) {
+		if (row.first >= before) {
+			moved_rows.push_back(row.first);
+		}
+	}
+	std::sort(moved_rows.rbegin(), moved_rows.rend());
+	for (int row_num : moved_rows) {
+		auto node = data.extract(row_num);
+		node.key() += count;
+		data.insert(std::move(node));
+	}
+	ShiftCellCounts(row_cell_counts, before, count);
+	UpdatePrintableSize();
+	RebuildDependencies();
+	RemapDirty([before, count](Position pos) -> std::optional<Position> {
+		if (pos.row >= before) {
+			pos.row += count;
+		}
+		return pos;
+	});
+}
+
+void Sheet::InsertCols(int before, int count) {
+	ThrowIfTooBigAfterInsertion(0, count);
+	OnLayoutChanged();
+	for (auto it_r = begin(data); it_r != end(data); ++it_r) {
+		for (auto it_c = begin(it_r->second); it_c != end(it_r->second); ++it_c) {
+			Cell* cell = it_c->second.get();
+			if (cell != nullptr && cell->IsFormula()) {
+				if (cell->GetFormula()->HandleInsertedCols(before, count) != IFormula::HandlingResult::NothingChanged) {
+					cell->InvalidateText();
+				}
+			}
+		}
+	}
+	for (auto& row : data) {
+		std::vector<int> moved_cols;
+		for (const auto& item : row.second) {
+			if (item.first >= before) {
+				moved_cols.push_back(item.first);
+			}
+		}
+		std::sort(moved_cols.rbegin(), moved_cols.rend());
+		for (int col_num : moved_cols) {
+			auto node = row.second.extract(col_num);
+			node.key() += count;
+			row.second.insert(std::move(node));
+		}
+	}
+	ShiftCellCounts(col_cell_counts, before, count);
+	UpdatePrintableSize();
+	RebuildDependencies();
+	RemapDirty([before, count](Position pos) -> std::optional<Position> {
+		if (pos.col >= before) {
+			pos.col += count;
+		}
+		return pos;
+	});
+}
+
+// Формулы вне удаляемой области, ссылавшиеся на неё, в координатах после удаления
+std::vector<Position> Sheet::GetDependentsOfDeleted(int first_row, int row_count, int first_col, int col_count) const {
+	auto is_deleted = [=](const Position& pos) {
+		return (first_row <= pos.row && pos.row < first_row + row_count)
+			|| (first_col <= pos.col && pos.col < first_col + col_count);
+	};
+	std::vector<Position> dependents;
+	for (const auto& row : data) {
+		for (const auto& item : row.second) {
+			Position pos{ row.first, item.first };
+			if (item.second == nullptr || !is_deleted(pos)) {
+				continue;
+			}
+			for (Position dependent : dependencies.GetDependents(pos)) {
+				if (is_deleted(dependent)) {
+					continue;
+				}
+				if (dependent.row >= first_row + row_count) {
+					dependent.row -= row_count;
+				}
+				if (dependent.col >= first_col + col_count) {
+					dependent.col -= col_count;
+				}
+				dependents.push_back(dependent);
+			}
+		}
+	}
+	return dependents;
+}
+
+std::vector<Sheet::CellPtr> Sheet::ExtractDeletedRows(int first, int count) {
+	std::vector<CellPtr> deleted_cells;
+	for (int row_num = first; row_num < first + count; ++row_num) {
+		if (data.find(row_num) != end(data)) {
+			auto node = data.extract(row_num);
+			for (auto& row : node.mapped()) {
+				if (row.second != nullptr) {
+					RemoveOccupied({ row_num, row.first });
+				}
+				deleted_cells.push_back(std::move(row.second));
+			}
+		}
+	}
+	return deleted_cells;
+}
+
+void Sheet::ChangeRowIndexes(int first, int count) {
+	std::vector<int> moved_rows;
+	for (const auto& row : data) {
+		if (row.first >= first + count) {
+			moved_rows.push_back(row.first);
+		}
+	}
+	std::sort(moved_rows.begin(), moved_rows.end());
+	for (int row_num : moved_rows) {
+		auto node = data.extract(row_num);
+		node.key() -= count;
+		data.insert(std::move(node));
+	}
+	ShiftCellCounts(row_cell_counts, first + count, -count);
+	UpdatePrintableSize();
+}
+
+void Sheet::UpdateNonDeletedRows(int first, int count) {
+	for (auto& row : data) {
+		if (row.first >= first && row.first < first + count) {
+			continue;
+		}
+		for (auto& item : row.second) {
+			Cell* cell = item.second.get();
+			if (cell != nullptr && cell->IsFormula()) {
+				if (cell->GetFormula()->HandleDeletedRows(first, count) != IFormula::HandlingResult::NothingChanged) {
+					cell->InvalidateText();
+				}
+			}
+		}
+	}
+}
+
+void Sheet::DeleteRows(int first, int count) {
+	OnLayoutChanged();
+	std::vector<Position> dependents = GetDependentsOfDeleted(first, count, 0, 0);
+	UpdateNonDeletedRows(first, count);
+	ExtractDeletedRows(first, count);
+	ChangeRowIndexes(first, count);
+	OnLayoutChanged();
+	RebuildDependencies();
+	RemapDirty([first, count](Position pos) -> std::optional<Position> {
+		if (pos.row >= first + count) {
+			pos.row -= count;
+		}
+		else if (pos.row >= first) {
+			return std::nullopt;
+		}
+		return pos;
+	});
+	RecalculateFormulas(std::move(dependents));
+	RecalculateRangeFormulas();
+}
+
+std::vector<Sheet::CellPtr> Sheet::ExtractDeletedCols(int first, int count) {
+	std::vector<CellPtr> deleted_cells;
+	for (auto row_it = begin(data); row_it != end(data);) {
+		Row& row = row_it->second;
+		for (int col_num = first; col_num < first + count; ++col_num) {
+			if (row.find(col_num) != end(row)) {
+				auto node = row.extract(col_num);
+				if (node.mapped() != nullptr) {
+					RemoveOccupied({ row_it->first, col_num });
+				}
+				deleted_cells.push_back(std::move(node.mapped()));
+			}
+		}
+		// опустевшая строка удаляется сразу, как и при ClearCell
+		row_it = row.empty() ? data.erase(row_it) : std::next(row_it);
+	}
+	return deleted_cells;
+}
+
+void Sheet::UpdateNonDeletedCols(int first, int count) {
+	for (auto& row : data) {
+		for (auto& item : row.second) {
+			if (item.first >= first && item.first < first + count) {
+				continue;
+			}
+			Cell* cell = item.second.get();
+			if (cell != nullptr && cell->IsFormula()) {
+				if (cell->GetFormula()->HandleDeletedCols(first, count) != IFormula::HandlingResult::NothingChanged) {
+					cell->InvalidateText();
+				}
+			}
+		}
+	}
+}
+
+void Sheet::ChangeColIndexes(int first, int count) {
+	for (auto& row : data) {
+		std::vector<int> moved_cols;
+		for (const auto& item : row.second) {
+			if (item.first >= first + count) {
+				moved_cols.push_back(item.first);
+			}
+		}
+		std::sort(moved_cols.begin(), moved_cols.end());
+		for (int col_num : moved_cols) {
+			auto node = row.second.extract(col_num);
+			node.key() -= count;
+			row.second.insert(std::move(node));
+		}
+	}
+	ShiftCellCounts(col_cell_counts, first + count, -count);
+	UpdatePrintableSize();
+}
+
+void Sheet::DeleteCols(int first, int count) {
+	OnLayoutChanged();
+	std::vector<Position> dependents = GetDependentsOfDeleted(0, 0, first, count);
+	UpdateNonDeletedCols(first, count);
+	ExtractDeletedCols(first, count);
+	ChangeColIndexes(first, count);
+	OnLayoutChanged();
+	RebuildDependencies();
+	RemapDirty([first, count](Position pos) -> std::optional<Position> {
+		if (pos.col >= first + count) {
+			pos.col -= count;
+		}
+		else if (pos.col >= first) {
+			return std::nullopt;
+		}
+		return pos;
+	});
+	RecalculateFormulas(std::move(dependents));
+	RecalculateRangeFormulas();
+}
+
+Size Sheet::GetPrintableSize() const { return size; }
+void Sheet::PrintValues(std::ostream& output) const {
+	for (int r = 0; r < size.rows; ++r) {
+		int blank_cells = 0;
+		for (int c = 0; c < size.cols; ++c) {
+			auto cell = GetCell({ r, c });
+			if (cell == nullptr) {
+				++blank_cells;
+				continue; 
+			}
+			if (cell->IsFormula()) {
+				output << cell->GetValue();
+			}
+			else {
+				output << cell->GetText();
+			}
+			if (c + 1 != size.cols) {
+				output << '\t';
+			}
+		}
+		if (blank_cells == size.cols) {
+			output << '\t';
+		}
+		output << '\n';
+	}
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+	for (int r = 0; r < size.rows; ++r) {
+		int blank_cells = 0;
+		for (int c = 0; c < size.cols; ++c) {
+			auto cell = FindCell({ r, c });
+			if (cell == nullptr) {
+				++blank_cells;
+				continue; 
+			}
+			output << cell->GetText();
+			if (c+1 != size.cols) {
+				output << '\t';
+			}
+		}
+		if (blank_cells == size.cols) {
+			output << '\t';
+		}
+		output << '\n';
+	}
+}
+
+int Sheet::ComputeEvaluationLevel(const Position& pos, std::unordered_map<Position, int, PositionHasher>& levels) const {
+	std::vector<Position> stack{ pos };
+	while (!stack.empty()) {
+		Position current = stack.back();
+		if (levels.find(current) != end(levels)) {
+			stack.pop_back();
+			continue;
+		}
+		const Cell* cell = FindCell(current);
+		int level = 0;
+		bool ready = true;
+		if (cell != nullptr) {
+			std::vector<Position> dependencies = cell->GetReferencedCells();
+			for (const auto& range : cell->GetReferencedRanges()) {
+				auto range_formulas = GetFormulaCellsInRange(range);
+				dependencies.insert(end(dependencies), begin(range_formulas), end(range_formulas));
+			}
+			for (const auto& ref : dependencies) {
+				auto it = levels.find(ref);
+				if (it == end(levels)) {
+					stack.push_back(ref);
+					ready = false;
+				}
+				else {
+					level = std::max(level, it->second + 1);
+				}
+			}
+		}
+		if (ready) {
+			levels[current] = level;
+			stack.pop_back();
+		}
+	}
+	return levels.at(pos);
+}
+
+void Sheet::EvaluateTemplateRun(const FormulaTemplate* formula_template, Position first, int count) {
+	std::vector<double> values(count);
+	std::vector<uint8_t> errors(count);
+	Vectorized::EvaluateRun(formula_template->program, *this, first, count, values.data(), errors.data());
+	for (int i = 0; i < count; ++i) {
+		Cell* cell = FindCell({ first.row + i, first.col });
+		if (errors[i] != Vectorized::kNoError) {
+			cell->SetValue(Cell::Value(Vectorized::FromErrorCode(errors[i])));
+		}
+		else {
+			cell->SetValue(Cell::Value(values[i]));
+		}
+		OnCellChanged({ first.row + i, first.col });
+	}
+}
+
+// Формулы одного уровня не зависят друг от друга, поэтому подряд идущие
+// в столбце формулы с общим шаблоном вычисляются одной векторной серией
+void Sheet::EvaluateLevel(const std::vector<Position>& positions) {
+	std::vector<std::pair<const FormulaTemplate*, Position>> cells;
+	cells.reserve(positions.size());
+	for (const auto& pos : positions) {
+		auto formula = dynamic_cast<Formula*>(FindCell(pos)->GetFormula());
+		// пустая программа - в шаблоне есть диапазоны или функции, такие
+		// формулы вычисляются только по одной
+		const FormulaTemplate* formula_template = formula != nullptr ? formula->GetTemplate() : nullptr;
+		if (formula_template != nullptr && formula_template->program.empty()) {
+			formula_template = nullptr;
+		}
+		cells.push_back({ formula_template, pos });
+	}
+	std::sort(begin(cells), end(cells), [](const auto& lhs, const auto& rhs) {
+		return std::make_tuple(lhs.first, lhs.second.col, lhs.second.row) < std::make_tuple(rhs.first, rhs.second.col, rhs.second.row);
+	});
+
+	for (size_t run_begin = 0; run_begin < cells.size();) {
+		size_t run_end = run_begin + 1;
+		while (run_end < cells.size()
+			&& cells[run_end].first == cells[run_begin].first
+			&& cells[run_end].second.col == cells[run_begin].second.col
+			&& cells[run_end].second.row == cells[run_end - 1].second.row + 1) {
+			++run_end;
+		}
+		int run_size = static_cast<int>(run_end - run_begin);
+		if (cells[run_begin].first != nullptr && run_size >= kMinVectorizedRun) {
+			EvaluateTemplateRun(cells[run_begin].first, cells[run_begin].second, run_size);
+		}
+		else {
+			for (size_t i = run_begin; i < run_end; ++i) {
+				UpdateCellValue(cells[i].second, FindCell(cells[i].second));
+			}
+		}
+		run_begin = run_end;
+	}
+}
+
+void Sheet::RecalculateAll() {
+	dirty.clear();
+	std::vector<Position> formulas;
+	for (const auto& row : data) {
+		for (const auto& item : row.second) {
+			if (item.second != nullptr && item.second->IsFormula()) {
+				formulas.push_back({ row.first, item.first });
+			}
+		}
+	}
+	EvaluateByLevels(formulas);
+}
+
+// Формулы одного уровня не зависят друг от друга, поэтому соседние формулы
+// одного шаблона внутри уровня считаются векторно
+void Sheet::EvaluateByLevels(const std::vector<Position>& formulas) {
+	std::unordered_map<Position, int, PositionHasher> levels;
+	std::vector<std::vector<Position>> positions_by_level;
+	for (const auto& pos : formulas) {
+		size_t level = ComputeEvaluationLevel(pos, levels);
+		if (positions_by_level.size() <= level) {
+			positions_by_level.resize(level + 1);
+		}
+		positions_by_level[level].push_back(pos);
+	}
+	for (const auto& positions : positions_by_level) {
+		EvaluateLevel(positions);
+	}
+}
@@ -1,53 +1,172 @@
-﻿#pragma once
-#include <sstream>
-#include <unordered_map>
-#include "common.h"
-#include "cell.h"
-
-class Sheet : public ISheet {
-public:
-	using CellPtr = std::unique_ptr<Cell>;
-	using Row = std::unordered_map<int, CellPtr>;
-public:
-	Sheet() = default;
-	void SetToSize(int row_size, int col_size);
-	void UpdateSizeAfterCellInsertion(Cell* cell, const Position& pos);
-	
-	void EvaluateFormula(const Position& pos, Cell* cell);
-	void UpdateDependenedCells(const Position& pos, Cell* cell);
-	void UpdateCellText(Cell* cell);
-	void UpdateCellValue(Cell* cell);
-	
-	void SetCell(Position pos, std::string text);
-	const Cell* GetCell(Position pos) const;
-	Cell* GetCell(Position pos);
-	void ClearCell(Position pos);
-	
-	void InsertRows(int before, int count = 1);
-	void InsertCols(int before, int count = 1);
-	
-	Size GetPrintableSize() const;
-	void PrintValues(std::ostream& output) const;
-	void PrintTexts(std::ostream& output) const;
-
-	void ThrowErrorIfInvalidPosition(const Position& pos) const;
-	void ThrowIfTooBigAfterInsertion(int row_count = 0, int col_count = 0) const;
-	
-	void DeleteRows(int first, int count = 1);
-	void UpdateDependendCells(std::vector<CellPtr>& deleted_cells, int first_row = 0, int row_count = 0, int first_col = 0, int col_count = 0);
-	void UpdateDependenedCellPositions(Cell* cell, int row_count = 0, int col_count = 0);
-	void UpdateDeletedCellDependencies(Cell* cell, int first_row = 0, int row_count = 0, int first_col = 0, int col_count = 0);
-	std::vector<CellPtr> ExtractDeletedRows(int first, int count);
-	void ChangeRowIndexes(int first, int count);
-	void UpdateNonDeletedRows(int first, int count);
-
-	void DeleteCols(int first, int count = 1);
-	void UpdateNonDeletedCols(int first, int count);
-	void ChangeColIndexes(int first, int count);
-	std::vector<CellPtr> ExtractDeletedCols(int first, int count);
-
-	void CheckForCircularDependency(const Position& pos, Cell* cell);
-private:
-	std::unordered_map<int, Row> data;
-	Size size;
+﻿#pragma once
+#include <map>
+#include <memory_resource>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include "common.h"
+#include "cell.h"
+#include "dependency_graph.h"
+#include "range_index.h"
+#include "summary_tree.h"
+#include "vectorized.h"
+
+class Sheet : public ISheet {
+public:
+	using CellPtr = Cell::Ptr;
+	using Row = std::pmr::unordered_map<int, CellPtr>;
+	// Automatic пересчитывает зависимые формулы при каждом изменении, Manual
+	// только копит их до Recalculate, Deferred досчитывает их при чтении
+	// через GetCell и SummarizeRange
+	enum class CalculationMode { Automatic, Manual, Deferred };
+	// Счётчики автоматического пересчёта: вычисленные формулы и пропущенные,
+	// потому что значения, от которых они зависят, не изменились
+	struct RecalculationStats {
+		size_t evaluated = 0;
+		size_t pruned = 0;
+	};
+public:
+	// Ячейки и узлы строк берутся из собственного пула листа или из
+	// переданного ресурса, который должен пережить лист
+	Sheet();
+	explicit Sheet(std::pmr::memory_resource* resource);
+	
+	void EvaluateFormula(const Position& pos, Cell* cell);
+	void UpdateDependenedCells(const Position& pos, Cell* cell);
+	void CreatePlaceholder(const Position& pos);
+	void ReleasePlaceholders(const std::vector<Position>& precedents);
+	void RebuildDependencies();
+	void RecalculateRangeFormulas();
+	void RecalculateDependents(const std::vector<Position>& changed);
+	void RecalculateFormulas(std::vector<Position> affected);
+	std::vector<Position> GetEvaluationOrder(const std::vector<Position>& positions) const;
+	void EvaluateInOrder(const std::vector<Position>& positions);
+	void MarkDirty(std::vector<Position> positions);
+	void EvaluateDirty(const std::vector<Position>& targets);
+	template <typename Remap>
+	void RemapDirty(Remap remap);
+
+	void SetCalculationMode(CalculationMode mode);
+	CalculationMode GetCalculationMode() const;
+	void Recalculate();
+	// Вычисляет грязные формулы в regions (например, в видимой области) и те,
+	// от которых они зависят; остальные ждут Recalculate, RecalculatePending
+	// или чтения в режиме Deferred
+	void RecalculateRegions(const std::vector<CellRange>& regions);
+	// Досчитывает по частям: max_formulas грязных формул вместе с их грязными
+	// предшественниками. Возвращает, сколько формул осталось грязными
+	size_t RecalculatePending(size_t max_formulas);
+	size_t GetDirtyCount() const;
+	// Считает значения грязных формул актуальными, не вычисляя их
+	void DiscardDirty();
+	RecalculationStats GetRecalculationStats() const;
+	void ResetRecalculationStats();
+	// Кэш разобранных формул по тексту: попадания, промахи и занятая память
+	FormulaTextCache::Stats GetFormulaCacheStats() const;
+	void SetFormulaCacheBudget(size_t bytes);
+	bool UpdateCellValue(const Position& pos, Cell* cell);
+	
+	void SetCell(Position pos, std::string text);
+	// SetCell без исключений для загрузки непроверенных данных: при ошибке
+	// лист не меняется, а причина возвращается статусом
+	CellStatus TrySetCell(Position pos, std::string text);
+	// Массовая загрузка: тексты разбираются параллельно в thread_count потоках
+	// (0 - по числу ядер), затем ячейки подключаются к листу в одном потоке и
+	// все затронутые формулы вычисляются один раз. Повторная позиция заменяет
+	// предыдущую. При ошибке разбора или циклической ссылке лист не меняется
+	void SetCells(std::vector<std::pair<Position, std::string>> cells, size_t thread_count = 0);
+	std::vector<CellPtr> ParseCells(const std::vector<std::pair<Position, std::string>>& cells, size_t thread_count);
+	const Cell* GetCell(Position pos) const;
+	Cell* GetCell(Position pos);
+	void ClearCell(Position pos);
+	
+	void InsertRows(int before, int count = 1);
+	void InsertCols(int before, int count = 1);
+	
+	Size GetPrintableSize() const;
+	void PrintValues(std::ostream& output) const;
+	void PrintTexts(std::ostream& output) const;
+
+	void ThrowErrorIfInvalidPosition(const Position& pos) const;
+	void ThrowIfTooBigAfterInsertion(int row_count = 0, int col_count = 0) const;
+	
+	void DeleteRows(int first, int count = 1);
+	std::vector<Position> GetDependentsOfDeleted(int first_row, int row_count, int first_col, int col_count) const;
+	std::vector<CellPtr> ExtractDeletedRows(int first, int count);
+	void ChangeRowIndexes(int first, int count);
+	void UpdateNonDeletedRows(int first, int count);
+
+	void DeleteCols(int first, int count = 1);
+	void UpdateNonDeletedCols(int first, int count);
+	void ChangeColIndexes(int first, int count);
+	std::vector<CellPtr> ExtractDeletedCols(int first, int count);
+
+	// приведёт ли запись cell в pos к циклу
+	bool HasCircularDependency(const Position& pos, const Cell* cell) const;
+	bool HasCircularDependency(const std::vector<Position>& roots) const;
+	std::vector<Position> GetFormulaCellsInRange(const CellRange& range) const;
+	// Значения прямоугольника построчно в буферы вызывающего длиной rows * cols:
+	// числа в numbers, тип в types, текст и текст ошибки в texts. Строки не
+	// копируются, поэтому texts действительны до следующего изменения листа
+	void ReadRange(const CellRange& range, double* numbers, CellValueType* types, std::string_view* texts) const;
+
+	RangeSummary SummarizeRange(const CellRange& range) const;
+	void UpdateColumnSummary(const Position& pos);
+	// Строит недостающие деревья для занятых столбцов из [first_col, last_col]
+	void BuildColumnSummaryTrees(int first_col, int last_col) const;
+	static RangeSummary SummarizeCell(const Cell* cell);
+
+	void OnCellChanged(const Position& pos);
+	void OnLayoutChanged();
+	void TrackChanges(bool enabled);
+	std::optional<std::vector<int>> TakeChangedRows();
+	const Row* GetRow(int row) const;
+	std::vector<int> GetRowIndexes() const;
+	const DependencyGraph& GetDependencyGraph() const;
+
+	void RecalculateAll();
+	void EvaluateByLevels(const std::vector<Position>& formulas);
+	int ComputeEvaluationLevel(const Position& pos, std::unordered_map<Position, int, PositionHasher>& levels) const;
+	void EvaluateLevel(const std::vector<Position>& positions);
+	void EvaluateTemplateRun(const FormulaTemplate* formula_template, Position first, int count);
+private:
+	const Cell* FindCell(Position pos) const;
+	Cell* FindCell(Position pos);
+	template <typename Callback>
+	void ForEachCellInRange(const CellRange& range, Callback callback) const;
+	// Ячейка ставится в лист и убирается из него только через эти методы:
+	// пустые строки удаляются сразу, счётчики занятости остаются точными
+	void PutCell(const Position& pos, CellPtr cell);
+	CellPtr TakeCell(const Position& pos);
+	void AddOccupied(const Position& pos);
+	void RemoveOccupied(const Position& pos);
+	void UpdatePrintableSize();
+	static void ShiftCellCounts(std::map<int, int>& counts, int first, int delta);
+
+	static const int kMinVectorizedRun = 8;
+	static const size_t kMinCellsPerParser = 4096;
+
+	std::pmr::unsynchronized_pool_resource cell_pool;
+	std::pmr::memory_resource* cell_resource;
+	std::pmr::unordered_map<int, Row> data;
+	// число ячеек, включая заглушки, в каждой занятой строке и каждом занятом
+	// столбце; размер печати - наибольшие номера плюс один
+	std::map<int, int> row_cell_counts;
+	std::map<int, int> col_cell_counts;
+	Size size;
+	FormulaTemplateCache templates;
+	mutable std::unordered_map<int, ColumnSummaryTree> column_summaries;
+	DependencyGraph dependencies;
+	RangeDependencyIndex range_dependents;
+
+	CalculationMode calculation_mode = CalculationMode::Automatic;
+	// формулы, ждущие пересчёта; вместе с формулой сюда попадают все зависящие от неё
+	std::unordered_set<Position, PositionHasher> dirty;
+	bool evaluating_dirty = false;
+	RecalculationStats recalculation_stats;
+
+	// строки, значения или тексты которых менялись с прошлого TakeChangedRows
+	bool track_changes = false;
+	bool layout_changed = true;
+	std::unordered_set<int> changed_rows;
 };
\ No newline at end of file
@@ -1,262 +1,524 @@
-#include "statement.h"
-
-namespace Ast {
-
-	std::ostream& operator<<(std::ostream& stream, const OperationType& operation_type) {
-		switch (operation_type) {
-		case OperationType::Add:
-			stream << '+';
-			break;
-		case OperationType::Sub:
-			stream << '-';
-			break;
-		case OperationType::Mul:
-			stream << '*';
-			break;
-		case OperationType::Div:
-			stream << '/';
-		}
-		return stream;
-	}
-
-	std::string UnaryOperation::ToString() const {
-		std::stringstream ss;
-		ss << operation_type;
-		ss << rhs.get()->ToString();
-		return ss.str();
-	}
-
-	IFormula::Value UnaryOperation::Evaluate(const ISheet& sheet) const {
-		auto eval_res = rhs.get()->Evaluate(sheet);
-		
-		if (std::holds_alternative<FormulaError>(eval_res)) {
-			return eval_res;
-		}
-
-		double value = std::get<double>(eval_res);
-		if (operation_type == OperationType::Sub) {
-			return -value;
-		}
-
-		return value;
-	}
-
-	StatementType UnaryOperation::Type() const {
-		return statement_type;
-	}
-
-	std::string ValueOperation::ToString() const {
-		std::stringstream ss;
-		if (std::holds_alternative<double>(value)) {
-			ss << std::get<double>(value);
-		}
-		else {
-			ss << std::get<FormulaError>(value);
-		}
-		return ss.str();
-	}
-
-	IFormula::Value ValueOperation::Evaluate(const ISheet& sheet) const {
-		return value;
-	}
-
-	StatementType ValueOperation::Type() const {
-		return statement_type;
-	}
-
-	std::string BinaryOperation::ToString() const {
-		std::stringstream ss;
-		
-		BinaryOperation* lhs_binary = dynamic_cast<BinaryOperation*>(lhs.get());
-		ParentesisOperation* lhs_parentesis = dynamic_cast<ParentesisOperation*>(lhs.get());
-		BinaryOperation* rhs_binary = dynamic_cast<BinaryOperation*>(rhs.get());
-		ParentesisOperation* rhs_parentesis = dynamic_cast<ParentesisOperation*>(rhs.get());
-
-		if (operation_type == OperationType::Mul) {
-			if (lhs_parentesis != nullptr) {
-				BinaryOperation* left_binary_op = dynamic_cast<BinaryOperation*>(lhs_parentesis->body.get());
-				if (left_binary_op != nullptr && left_binary_op->operation_type == OperationType::Mul) {
-					std::string left = lhs.get()->ToString();
-					ss << left.substr(1, left.size() - 2);
-				}
-			}
-			else {
-				ss << lhs.get()->ToString();
-			}
-			
-		}
-
-		if (operation_type == OperationType::Add || operation_type == OperationType::Sub) {
-			if (lhs_parentesis != nullptr) {
-				BinaryOperation* left_binary_op = dynamic_cast<BinaryOperation*>(lhs_parentesis->body.get());
-				if (left_binary_op != nullptr && (left_binary_op->operation_type == OperationType::Mul || left_binary_op->operation_type == OperationType::Div)) {
-					std::string left = lhs.get()->ToString();
-					ss << left.substr(1, left.size() - 2);
-				}
-			}
-			else {
-				ss << lhs.get()->ToString();
-			}
-			
-		}
-
-		if (operation_type == OperationType::Div) {
-			if (lhs_parentesis != nullptr) {
-				BinaryOperation* left_binary_op = dynamic_cast<BinaryOperation*>(lhs_parentesis->body.get());
-				if (left_binary_op != nullptr && (left_binary_op->operation_type == OperationType::Mul || left_binary_op->operation_type == OperationType::Div)) {
-					std::string left = lhs.get()->ToString();
-					ss << left.substr(1, left.size() - 2);
-				}
-			}
-			else {
-				ss << lhs.get()->ToString();
-			}
-		}
-
-		ss << operation_type;
-
-		if (operation_type == OperationType::Mul) {
-			if (rhs_parentesis != nullptr) {
-				BinaryOperation* right_binary_op = dynamic_cast<BinaryOperation*>(rhs_parentesis->body.get());
-				if (right_binary_op != nullptr && (right_binary_op->operation_type == OperationType::Mul || right_binary_op->operation_type == OperationType::Div)) {
-					std::string right = rhs.get()->ToString();
-					ss << right.substr(1, right.size() - 2);
-					return ss.str();
-				}
-			}
-			ss << rhs.get()->ToString();
-			return ss.str();
-		}
-
-		if (operation_type == OperationType::Add || operation_type == OperationType::Sub) {
-			if (rhs_parentesis != nullptr) {
-				BinaryOperation* right_binary_op = dynamic_cast<BinaryOperation*>(rhs_parentesis->body.get());
-				if (right_binary_op != nullptr) {
-					std::string right = rhs.get()->ToString();
-					ss << right.substr(1, right.size() - 2);
-					return ss.str();
-				}
-			}
-			ss << rhs.get()->ToString();
-			return ss.str();
-		}
-
-		if (operation_type == OperationType::Div) {
-			ss << rhs.get()->ToString();
-			return ss.str();
-		}
-
-		return ss.str();
-	}
-
-	IFormula::Value BinaryOperation::Evaluate(const ISheet& sheet) const {
-		auto lhs_res = lhs.get()->Evaluate(sheet);
-		if (std::holds_alternative<FormulaError>(lhs_res)) {
-			return lhs_res;
-		}
-		double l_val = std::get<double>(lhs_res);
-
-		auto rhs_res = rhs.get()->Evaluate(sheet);
-		if (std::holds_alternative<FormulaError>(rhs_res)) {
-			return rhs_res;
-		}
-		double r_val = std::get<double>(rhs_res);
-		double result;
-		
-		switch (operation_type) {
-		case OperationType::Add: 
-			result = l_val + r_val;
-			break;
-		case OperationType::Sub: 
-			result = l_val - r_val;
-			break;
-		case OperationType::Mul: 
-			result = l_val * r_val;
-			break;
-		case OperationType::Div:
-			if (r_val != 0) {
-				result = l_val / r_val;
-			}
-			else {
-				return FormulaError::Category::Div0;
-			}
-		}
-		
-		if (!std::isfinite(result)) {
-			return FormulaError::Category::Div0;
-		}
-
-		return result;
-	}
-
-	StatementType BinaryOperation::Type() const {
-		return statement_type;
-	}
-
-	std::string CellOperation::ToString() const {
-		std::stringstream ss;
-		if (pos.IsValid()) {
-			ss << pos.ToString();
-		}
-		else {
-			ss << FormulaError::Category::Ref;
-		}
-		
-		return ss.str();
-	}
-
-	IFormula::Value CellOperation::Evaluate(const ISheet& sheet) const {
-
-		if (!pos.IsValid()) {
-			return FormulaError::Category::Ref;
-		}
-		
-		auto cell = sheet.GetCell(pos);
-		if (cell == nullptr) {
-			return IFormula::Value(0.0);
-		}
-
-		auto cell_value = cell->GetValue();
-		if (std::holds_alternative<double>(cell_value)) {
-			return IFormula::Value(std::get<double>(cell_value));
-		}
-		else if (std::holds_alternative<std::string>(cell_value)) {
-			if (std::get<std::string>(cell_value).empty()) {
-				return IFormula::Value(0.0);
-			}
-		}
-		else if (std::holds_alternative<FormulaError>(cell_value)) {
-			return std::get<FormulaError>(cell_value);
-		}
-
-
-		return FormulaError::Category::Value;
-	}
-
-	StatementType CellOperation::Type() const {
-		return statement_type;
-	}
-
-
-	std::string ParentesisOperation::ToString() const {
-		std::stringstream ss;
-		ValueOperation* value_ptr = dynamic_cast<ValueOperation*>(body.get());
-		ParentesisOperation* parentesis_ptr = dynamic_cast<ParentesisOperation*>(body.get());
-		if (value_ptr != nullptr || parentesis_ptr != nullptr) {
-			ss << body.get()->ToString();
-		}
-		else {
-			ss << '(' << body.get()->ToString() << ')';
-		}
-		return ss.str();
-	}
-
-	IFormula::Value ParentesisOperation::Evaluate(const ISheet& sheet) const {
-		return body.get()->Evaluate(sheet);
-	}
-
-	StatementType ParentesisOperation::Type() const {
-		return statement_type;
-	}
-
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "statement.h"
+
+namespace Ast {
+
+	namespace {
+		constexpr std::string_view kFunctionNames[] = { "SUM", "AVERAGE", "MIN", "MAX", "COUNT" };
+
+		constexpr int kAdditivePrecedence = 1;
+		constexpr int kMultiplicativePrecedence = 2;
+		constexpr int kUnaryPrecedence = 3;
+		constexpr int kAtomPrecedence = 4;
+
+		constexpr char kOperatorChars[] = { '+', '-', '*', '/' };
+
+		const Statement* SkipParentheses(const Statement* statement) {
+			while (statement->Type() == StatementType::Parentesis) {
+				statement = static_cast<const ParentesisOperation*>(statement)->body.get();
+			}
+			return statement;
+		}
+
+		int GetPrecedence(const Statement* statement) {
+			switch (statement->Type()) {
+			case StatementType::BinaryOperation: {
+				OperationType operation_type = static_cast<const BinaryOperation*>(statement)->operation_type;
+				bool additive = operation_type == OperationType::Add || operation_type == OperationType::Sub;
+				return additive ? kAdditivePrecedence : kMultiplicativePrecedence;
+			}
+			case StatementType::UnaryOperation:
+				return kUnaryPrecedence;
+			default:
+				return kAtomPrecedence;
+			}
+		}
+
+		bool IsLeaf(const Statement* statement) {
+			StatementType type = statement->Type();
+			return type == StatementType::Value || type == StatementType::Cell || type == StatementType::Range;
+		}
+
+		// Потомки узла в порядке вычисления
+		void AppendChildren(const Statement* statement, std::vector<const Statement*>& children) {
+			switch (statement->Type()) {
+			case StatementType::UnaryOperation:
+				children.push_back(static_cast<const UnaryOperation*>(statement)->rhs.get());
+				break;
+			case StatementType::BinaryOperation: {
+				auto binary_op = static_cast<const BinaryOperation*>(statement);
+				children.push_back(binary_op->lhs.get());
+				children.push_back(binary_op->rhs.get());
+				break;
+			}
+			case StatementType::Parentesis:
+				children.push_back(static_cast<const ParentesisOperation*>(statement)->body.get());
+				break;
+			case StatementType::Function:
+				for (const auto& arg : static_cast<const FunctionOperation*>(statement)->args) {
+					children.push_back(arg.get());
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		// Забирает потомков-операций, чтобы деструктор узла не спускался по
+		// дереву; листья удаляются вместе с узлом
+		void TakeChildren(Statement& statement, std::vector<std::unique_ptr<Statement>>& children) {
+			auto take = [&children](std::unique_ptr<Statement>& child) {
+				if (child && !IsLeaf(child.get())) {
+					children.push_back(std::move(child));
+				}
+			};
+			switch (statement.Type()) {
+			case StatementType::UnaryOperation:
+				take(static_cast<UnaryOperation&>(statement).rhs);
+				break;
+			case StatementType::BinaryOperation:
+				take(static_cast<BinaryOperation&>(statement).lhs);
+				take(static_cast<BinaryOperation&>(statement).rhs);
+				break;
+			case StatementType::Parentesis:
+				take(static_cast<ParentesisOperation&>(statement).body);
+				break;
+			case StatementType::Function: {
+				auto& args = static_cast<FunctionOperation&>(statement).args;
+				for (auto& arg : args) {
+					take(arg);
+				}
+				args.clear();
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		void DestroyChildren(Statement& root) {
+			std::vector<std::unique_ptr<Statement>> pending;
+			TakeChildren(root, pending);
+			while (!pending.empty()) {
+				std::unique_ptr<Statement> statement = std::move(pending.back());
+				pending.pop_back();
+				TakeChildren(*statement, pending);
+			}
+		}
+
+		void AppendLeaf(const Statement* statement, std::string& out, Position anchor) {
+			switch (statement->Type()) {
+			case StatementType::Value: {
+				EvalValue value = static_cast<const ValueOperation*>(statement)->value;
+				if (value.IsError()) {
+					out += value.GetError().ToString();
+					break;
+				}
+				// тот же формат, что и у std::ostream по умолчанию
+				char buffer[32];
+				int length = std::snprintf(buffer, sizeof(buffer), "%g", value.GetNumber());
+				out.append(buffer, length);
+				break;
+			}
+			case StatementType::Cell: {
+				Position pos = Resolve(anchor, static_cast<const CellOperation*>(statement)->offset);
+				if (!pos.IsValid()) {
+					out += FormulaError(FormulaError::Category::Ref).ToString();
+					break;
+				}
+				char buffer[Position::kMaxNameLength];
+				out.append(buffer, pos.ToChars(buffer, buffer + sizeof(buffer)));
+				break;
+			}
+			case StatementType::Range: {
+				CellRange range = Resolve(anchor, static_cast<const RangeOperation*>(statement)->offsets);
+				if (!range.IsValid()) {
+					out += FormulaError(FormulaError::Category::Ref).ToString();
+					break;
+				}
+				char buffer[Position::kMaxNameLength];
+				out.append(buffer, range.first.ToChars(buffer, buffer + sizeof(buffer)));
+				out += ':';
+				out.append(buffer, range.last.ToChars(buffer, buffer + sizeof(buffer)));
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		// Элемент стека печати: операнд с приоритетом, ниже которого он
+		// берётся в скобки, или знак операции либо скобки
+		struct PrintItem {
+			const Statement* operand;
+			int min_precedence;
+			char text;
+		};
+
+		EvalValue ApplyUnary(OperationType operation_type, EvalValue operand) {
+			if (operand.IsError() || operation_type != OperationType::Sub) {
+				return operand;
+			}
+			return -operand.GetNumber();
+		}
+
+		EvalValue ApplyBinary(OperationType operation_type, EvalValue lhs, EvalValue rhs) {
+			if (lhs.IsError()) {
+				return lhs;
+			}
+			if (rhs.IsError()) {
+				return rhs;
+			}
+			double l_val = lhs.GetNumber();
+			double r_val = rhs.GetNumber();
+			double result = 0.0;
+
+			switch (operation_type) {
+			case OperationType::Add:
+				result = l_val + r_val;
+				break;
+			case OperationType::Sub:
+				result = l_val - r_val;
+				break;
+			case OperationType::Mul:
+				result = l_val * r_val;
+				break;
+			case OperationType::Div:
+				if (r_val != 0) {
+					result = l_val / r_val;
+				}
+				else {
+					return FormulaError::Category::Div0;
+				}
+			}
+
+			if (!std::isfinite(result)) {
+				return FormulaError::Category::Div0;
+			}
+
+			return result;
+		}
+
+		// Значения аргументов-диапазонов не используются: диапазон сводится
+		// через SummarizeRange
+		EvalValue ApplyFunction(const FunctionOperation& function_op, const EvalValue* operands, const ISheet& sheet, Position anchor) {
+			RangeSummary summary;
+			for (size_t i = 0; i < function_op.args.size(); ++i) {
+				const Statement* arg = function_op.args[i].get();
+				if (arg->Type() == StatementType::Range) {
+					CellRange range = Resolve(anchor, static_cast<const RangeOperation*>(arg)->offsets);
+					if (!range.IsValid()) {
+						summary.first_error = summary.first_error.value_or(FormulaError::Category::Ref);
+						continue;
+					}
+					summary.Add(sheet.SummarizeRange(range));
+					continue;
+				}
+				if (operands[i].IsError()) {
+					summary.first_error = summary.first_error.value_or(operands[i].GetError());
+				}
+				else {
+					summary.Add(operands[i].GetNumber());
+				}
+			}
+
+			if (function_op.function_type == FunctionType::Count) {
+				return static_cast<double>(summary.count);
+			}
+			if (summary.first_error) {
+				return *summary.first_error;
+			}
+
+			double result = 0.0;
+			switch (function_op.function_type) {
+			case FunctionType::Sum:
+				result = summary.sum;
+				break;
+			case FunctionType::Average:
+				if (summary.count == 0) {
+					return FormulaError::Category::Div0;
+				}
+				result = summary.sum / summary.count;
+				break;
+			case FunctionType::Min:
+				result = summary.count > 0 ? summary.min : 0.0;
+				break;
+			case FunctionType::Max:
+				result = summary.count > 0 ? summary.max : 0.0;
+				break;
+			case FunctionType::Count:
+				break;
+			}
+
+			if (!std::isfinite(result)) {
+				return FormulaError::Category::Div0;
+			}
+			return result;
+		}
+
+		// Стек операндов; неглубоким формулам хватает места на стеке вызовов
+		class OperandStack {
+		public:
+			void Push(EvalValue value) {
+				if (size == capacity) {
+					Grow();
+				}
+				data[size++] = value;
+			}
+
+			EvalValue Pop() {
+				return data[--size];
+			}
+
+			EvalValue& Top() {
+				return data[size - 1];
+			}
+
+			// последние count значений, снятые со стека
+			const EvalValue* Pop(size_t count) {
+				size -= count;
+				return data + size;
+			}
+
+		private:
+			void Grow() {
+				if (data == inline_values) {
+					heap_values.assign(inline_values, inline_values + size);
+				}
+				heap_values.resize(capacity * 2);
+				data = heap_values.data();
+				capacity = heap_values.size();
+			}
+
+			static const size_t kInlineCapacity = 32;
+
+			EvalValue inline_values[kInlineCapacity];
+			std::vector<EvalValue> heap_values;
+			EvalValue* data = inline_values;
+			size_t size = 0;
+			size_t capacity = kInlineCapacity;
+		};
+	}
+
+	EvalValue Statement::Evaluate(const ISheet& sheet, Position anchor) const {
+		return Ast::Evaluate(Flatten(this), sheet, anchor);
+	}
+
+	void Statement::AppendTo(std::string& out, Position anchor) const {
+		std::vector<PrintItem> pending{ { this, 0, '\0' } };
+		while (!pending.empty()) {
+			PrintItem item = pending.back();
+			pending.pop_back();
+			if (item.operand == nullptr) {
+				out += item.text;
+				continue;
+			}
+
+			// левый операнд печатается сразу, на стек кладутся только части
+			// правее него, в обратном порядке
+			const Statement* statement = item.operand;
+			int min_precedence = item.min_precedence;
+			while (statement != nullptr) {
+				// скобки исходного текста отбрасываются; операнд берётся в
+				// скобки, только если его приоритет ниже требуемого
+				statement = SkipParentheses(statement);
+				int precedence = GetPrecedence(statement);
+				if (precedence < min_precedence) {
+					out += '(';
+					pending.push_back({ nullptr, 0, ')' });
+					min_precedence = 0;
+					continue;
+				}
+
+				switch (statement->Type()) {
+				case StatementType::UnaryOperation: {
+					auto unary_op = static_cast<const UnaryOperation*>(statement);
+					out += kOperatorChars[static_cast<size_t>(unary_op->operation_type)];
+					statement = unary_op->rhs.get();
+					min_precedence = kUnaryPrecedence;
+					break;
+				}
+				case StatementType::BinaryOperation: {
+					auto binary_op = static_cast<const BinaryOperation*>(statement);
+					// вычитание и деление не ассоциативны: a-(b-c) != a-b-c
+					bool keep_equal = binary_op->operation_type == OperationType::Sub || binary_op->operation_type == OperationType::Div;
+					pending.push_back({ binary_op->rhs.get(), keep_equal ? precedence + 1 : precedence, '\0' });
+					pending.push_back({ nullptr, 0, kOperatorChars[static_cast<size_t>(binary_op->operation_type)] });
+					statement = binary_op->lhs.get();
+					min_precedence = precedence;
+					break;
+				}
+				case StatementType::Function: {
+					auto function_op = static_cast<const FunctionOperation*>(statement);
+					out += kFunctionNames[static_cast<size_t>(function_op->function_type)];
+					out += '(';
+					pending.push_back({ nullptr, 0, ')' });
+					for (size_t i = function_op->args.size(); i-- > 1;) {
+						pending.push_back({ function_op->args[i].get(), 0, '\0' });
+						pending.push_back({ nullptr, 0, ',' });
+					}
+					statement = function_op->args.front().get();
+					min_precedence = 0;
+					break;
+				}
+				default:
+					AppendLeaf(statement, out, anchor);
+					statement = nullptr;
+				}
+			}
+		}
+	}
+
+	std::string Statement::ToString(Position anchor) const {
+		std::string out;
+		AppendTo(out, anchor);
+		return out;
+	}
+
+	std::optional<FunctionType> FunctionFromName(std::string_view name) {
+		for (size_t i = 0; i < std::size(kFunctionNames); ++i) {
+			if (kFunctionNames[i] == name) {
+				return static_cast<FunctionType>(i);
+			}
+		}
+		return std::nullopt;
+	}
+
+	UnaryOperation::~UnaryOperation() {
+		DestroyChildren(*this);
+	}
+
+	StatementType UnaryOperation::Type() const {
+		return StatementType::UnaryOperation;
+	}
+
+	StatementType ValueOperation::Type() const {
+		return StatementType::Value;
+	}
+
+	BinaryOperation::~BinaryOperation() {
+		DestroyChildren(*this);
+	}
+
+	StatementType BinaryOperation::Type() const {
+		return StatementType::BinaryOperation;
+	}
+
+	StatementType CellOperation::Type() const {
+		return StatementType::Cell;
+	}
+
+	ParentesisOperation::~ParentesisOperation() {
+		DestroyChildren(*this);
+	}
+
+	StatementType ParentesisOperation::Type() const {
+		return StatementType::Parentesis;
+	}
+
+	StatementType RangeOperation::Type() const {
+		return StatementType::Range;
+	}
+
+	FunctionOperation::~FunctionOperation() {
+		DestroyChildren(*this);
+	}
+
+	StatementType FunctionOperation::Type() const {
+		return StatementType::Function;
+	}
+
+	std::vector<const Statement*> Flatten(const Statement* root) {
+		// прямой обход "узел, потомки справа налево", развёрнутый в обратном порядке
+		std::vector<const Statement*> postorder;
+		std::vector<const Statement*> pending{ root };
+		while (!pending.empty()) {
+			const Statement* statement = pending.back();
+			pending.pop_back();
+			postorder.push_back(statement);
+			AppendChildren(statement, pending);
+		}
+		std::reverse(begin(postorder), end(postorder));
+		return postorder;
+	}
+
+	EvalValue Evaluate(const std::vector<const Statement*>& postorder, const ISheet& sheet, Position anchor) {
+		OperandStack operands;
+		for (const Statement* statement : postorder) {
+			switch (statement->Type()) {
+			case StatementType::Value:
+				operands.Push(static_cast<const ValueOperation*>(statement)->value);
+				break;
+			case StatementType::Cell: {
+				Position pos = Resolve(anchor, static_cast<const CellOperation*>(statement)->offset);
+				operands.Push(pos.IsValid() ? EvalValue::FromCell(sheet.GetCell(pos)) : FormulaError::Category::Ref);
+				break;
+			}
+			case StatementType::Range:
+				operands.Push(FormulaError::Category::Value);
+				break;
+			case StatementType::Parentesis:
+				break;
+			case StatementType::UnaryOperation:
+				operands.Top() = ApplyUnary(static_cast<const UnaryOperation*>(statement)->operation_type, operands.Top());
+				break;
+			case StatementType::BinaryOperation: {
+				EvalValue rhs = operands.Pop();
+				operands.Top() = ApplyBinary(static_cast<const BinaryOperation*>(statement)->operation_type, operands.Top(), rhs);
+				break;
+			}
+			case StatementType::Function: {
+				auto function_op = static_cast<const FunctionOperation*>(statement);
+				const EvalValue* args = operands.Pop(function_op->args.size());
+				operands.Push(ApplyFunction(*function_op, args, sheet, anchor));
+				break;
+			}
+			}
+		}
+		return operands.Pop();
+	}
+
+	std::vector<Instruction> Compile(const std::vector<const Statement*>& postorder) {
+		std::vector<Instruction> program;
+		for (const Statement* statement : postorder) {
+			switch (statement->Type()) {
+			case StatementType::Cell:
+				program.push_back({ OpCode::PushCell, 0.0, static_cast<const CellOperation*>(statement)->offset });
+				break;
+			case StatementType::Value:
+				program.push_back({ OpCode::PushValue, static_cast<const ValueOperation*>(statement)->value, Position{} });
+				break;
+			case StatementType::BinaryOperation:
+				switch (static_cast<const BinaryOperation*>(statement)->operation_type) {
+				case OperationType::Add:
+					program.push_back({ OpCode::Add });
+					break;
+				case OperationType::Sub:
+					program.push_back({ OpCode::Sub });
+					break;
+				case OperationType::Mul:
+					program.push_back({ OpCode::Mul });
+					break;
+				case OperationType::Div:
+					program.push_back({ OpCode::Div });
+					break;
+				}
+				break;
+			case StatementType::UnaryOperation:
+				if (static_cast<const UnaryOperation*>(statement)->operation_type == OperationType::Sub) {
+					program.push_back({ OpCode::Negate });
+				}
+				break;
+			case StatementType::Parentesis:
+				break;
+			case StatementType::Range:
+			case StatementType::Function:
+				return {};
+			}
+		}
+		return program;
+	}
+
 }
\ No newline at end of file
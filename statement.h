@@ -1,63 +1,110 @@
-#pragma once
-#include "common.h"
-
-namespace Ast {
-	enum class OperationType { Add, Sub, Mul, Div };
-	enum class StatementType { Value, UnaryOperation, BinaryOperation, Cell, Parentesis };
-
-
-    struct Statement {
-        virtual ~Statement() = default;
-        virtual IFormula::Value Evaluate(const ISheet& sheet) const = 0;
-        virtual std::string ToString() const = 0;
-        virtual StatementType Type() const = 0;
-    };
-
-    struct UnaryOperation : public Statement {
-        IFormula::Value Evaluate(const ISheet& sheet) const;
-        std::string ToString() const;
-        StatementType Type() const;
-
-        OperationType operation_type;
-        std::unique_ptr<Statement> rhs;
-        StatementType statement_type;
-    };
-
-    struct ValueOperation : public Statement {
-        IFormula::Value Evaluate(const ISheet& sheet) const;
-        std::string ToString() const;
-        StatementType Type() const;
-
-        IFormula::Value value;
-        StatementType statement_type;
-    };
-
-    struct BinaryOperation : public Statement {
-        IFormula::Value Evaluate(const ISheet& sheet) const;
-        std::string ToString() const;
-        StatementType Type() const;
-
-        OperationType operation_type;
-        StatementType statement_type;
-        std::unique_ptr<Statement> lhs, rhs;
-    };
-
-    struct CellOperation : public Statement {
-        IFormula::Value Evaluate(const ISheet& sheet) const;
-        std::string ToString() const;
-        StatementType Type() const;
-
-        StatementType statement_type;
-        Position pos;
-    };
-
-    struct ParentesisOperation : public Statement {
-        IFormula::Value Evaluate(const ISheet& sheet) const;
-        std::string ToString() const;
-        StatementType Type() const;
-
-        StatementType statement_type;
-        std::unique_ptr<Statement> body;
-    };
-
-}
+#pragma once
+#include "common.h"
+#include "eval_value.h"
+
+namespace Ast {
+	enum class OperationType { Add, Sub, Mul, Div };
+	enum class StatementType { Value, UnaryOperation, BinaryOperation, Cell, Parentesis, Range, Function };
+	enum class FunctionType { Sum, Average, Min, Max, Count };
+	enum class OpCode { PushValue, PushCell, Negate, Add, Sub, Mul, Div };
+
+	// Позиция ячейки по якорю формулы и относительному смещению ссылки
+	inline Position Resolve(Position anchor, Position offset) {
+		return Position{ anchor.row + offset.row, anchor.col + offset.col };
+	}
+
+	inline Position Offset(Position anchor, Position pos) {
+		return Position{ pos.row - anchor.row, pos.col - anchor.col };
+	}
+
+	inline CellRange Resolve(Position anchor, const CellRange& offsets) {
+		return CellRange{ Resolve(anchor, offsets.first), Resolve(anchor, offsets.last) };
+	}
+
+	inline CellRange Offset(Position anchor, const CellRange& range) {
+		return CellRange{ Offset(anchor, range.first), Offset(anchor, range.last) };
+	}
+
+	std::optional<FunctionType> FunctionFromName(std::string_view name);
+
+    // Обходы дерева идут по явному стеку, а не рекурсией: формула вида
+    // =A1+A2+...+A50000 даёт дерево глубиной в число слагаемых
+    struct Statement {
+        virtual ~Statement() = default;
+        EvalValue Evaluate(const ISheet& sheet, Position anchor) const;
+        // Дописывает выражение в out; скобки ставятся только там, где их
+        // требует приоритет операций
+        void AppendTo(std::string& out, Position anchor) const;
+        std::string ToString(Position anchor) const;
+        virtual StatementType Type() const = 0;
+    };
+
+    // Деструкторы узлов с потомками разбирают поддерево без рекурсии
+    struct UnaryOperation : public Statement {
+        ~UnaryOperation();
+        StatementType Type() const;
+
+        OperationType operation_type;
+        std::unique_ptr<Statement> rhs;
+    };
+
+    struct ValueOperation : public Statement {
+        StatementType Type() const;
+
+        EvalValue value;
+    };
+
+    struct BinaryOperation : public Statement {
+        ~BinaryOperation();
+        StatementType Type() const;
+
+        OperationType operation_type;
+        std::unique_ptr<Statement> lhs, rhs;
+    };
+
+    struct CellOperation : public Statement {
+        StatementType Type() const;
+
+        // смещение относительно ячейки-якоря формулы
+        Position offset = {};
+    };
+
+    struct ParentesisOperation : public Statement {
+        ~ParentesisOperation();
+        StatementType Type() const;
+
+        std::unique_ptr<Statement> body;
+    };
+
+    // Диапазон допустим только как аргумент функции
+    struct RangeOperation : public Statement {
+        StatementType Type() const;
+
+        CellRange offsets;
+    };
+
+    struct FunctionOperation : public Statement {
+        ~FunctionOperation();
+        StatementType Type() const;
+
+        FunctionType function_type;
+        std::vector<std::unique_ptr<Statement>> args;
+    };
+
+    // Узлы дерева в обратном порядке: потомки слева направо, затем родитель
+    std::vector<const Statement*> Flatten(const Statement* root);
+    // Вычисляет дерево по узлам, развёрнутым Flatten
+    EvalValue Evaluate(const std::vector<const Statement*>& postorder, const ISheet& sheet, Position anchor);
+
+    // Инструкция постфиксной записи формулы: операнды кладутся на стек,
+    // операции снимают их и кладут результат
+    struct Instruction {
+        OpCode code;
+        EvalValue value = 0.0;
+        Position offset = {};
+    };
+
+    // Программа по узлам, развёрнутым Flatten; пустая, если в формуле есть функции
+    std::vector<Instruction> Compile(const std::vector<const Statement*>& postorder);
+
+}
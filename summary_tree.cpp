@@ -0,0 +1,48 @@
+#include "summary_tree.h"
+
+ColumnSummaryTree::ColumnSummaryTree(int min_capacity) {
+	while (capacity < min_capacity) {
+		capacity *= 2;
+	}
+	nodes.resize(2 * capacity);
+}
+
+int ColumnSummaryTree::GetCapacity() const {
+	return capacity;
+}
+
+void ColumnSummaryTree::Set(int row, const RangeSummary& leaf) {
+	int node = capacity + row;
+	nodes[node] = leaf;
+	for (node /= 2; node > 0; node /= 2) {
+		nodes[node] = nodes[2 * node];
+		nodes[node].Add(nodes[2 * node + 1]);
+	}
+}
+
+void ColumnSummaryTree::Build(const std::vector<std::pair<int, RangeSummary>>& leaves) {
+	for (const auto& [row, leaf] : leaves) {
+		nodes[capacity + row] = leaf;
+	}
+	for (int node = capacity - 1; node > 0; --node) {
+		nodes[node] = nodes[2 * node];
+		nodes[node].Add(nodes[2 * node + 1]);
+	}
+}
+
+RangeSummary ColumnSummaryTree::Query(int first_row, int last_row) const {
+	RangeSummary left;
+	RangeSummary right;
+	for (int l = first_row + capacity, r = last_row + capacity + 1; l < r; l /= 2, r /= 2) {
+		if (l & 1) {
+			left.Add(nodes[l++]);
+		}
+		if (r & 1) {
+			RangeSummary node = nodes[--r];
+			node.Add(right);
+			right = node;
+		}
+	}
+	left.Add(right);
+	return left;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <vector>
+#include "common.h"
+
+// Дерево отрезков по строкам одного столбца: обновление ячейки и сводка
+// по диапазону строк за O(log n)
+class ColumnSummaryTree {
+public:
+	explicit ColumnSummaryTree(int min_capacity);
+	int GetCapacity() const;
+	void Set(int row, const RangeSummary& leaf);
+	void Build(const std::vector<std::pair<int, RangeSummary>>& leaves);
+	RangeSummary Query(int first_row, int last_row) const;
+private:
+	int capacity = 1;
+	std::vector<RangeSummary> nodes;
+};
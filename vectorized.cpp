@@ -0,0 +1,248 @@
+#include <cmath>
+#include <cstring>
+#include "vectorized.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VECTORIZED_SSE2
+#endif
+
+namespace Vectorized {
+
+	namespace {
+		constexpr int kChunkSize = 256;
+
+		struct Lanes {
+			double values[kChunkSize];
+			uint8_t errors[kChunkSize];
+		};
+
+		void Broadcast(EvalValue value, int count, Lanes& out) {
+			if (value.IsError()) {
+				std::fill(out.values, out.values + count, 0.0);
+				std::fill(out.errors, out.errors + count, ToErrorCode(value.GetError()));
+				return;
+			}
+			std::fill(out.values, out.values + count, value.GetNumber());
+			std::fill(out.errors, out.errors + count, kNoError);
+		}
+
+		void Gather(const ISheet& sheet, Position first, int count, Lanes& out) {
+			for (int i = 0; i < count; ++i) {
+				Position pos{ first.row + i, first.col };
+				out.values[i] = 0.0;
+				out.errors[i] = kNoError;
+				if (!pos.IsValid()) {
+					out.errors[i] = ToErrorCode(FormulaError::Category::Ref);
+					continue;
+				}
+				EvalValue value = EvalValue::FromCell(sheet.GetCell(pos));
+				if (value.IsError()) {
+					out.errors[i] = ToErrorCode(value.GetError());
+				}
+				else {
+					out.values[i] = value.GetNumber();
+				}
+			}
+		}
+
+		// Ошибка операнда имеет приоритет, затем ошибки вычисления:
+		// деление на ноль и бесконечный или неопределённый результат
+		void MergeLaneError(Lanes& lhs, const Lanes& rhs, int i, bool arithmetic_error) {
+			if (lhs.errors[i] != kNoError) {
+				return;
+			}
+			if (rhs.errors[i] != kNoError) {
+				lhs.errors[i] = rhs.errors[i];
+			}
+			else if (arithmetic_error) {
+				lhs.errors[i] = ToErrorCode(FormulaError::Category::Div0);
+			}
+		}
+
+		template <Ast::OpCode code>
+		double Apply(double lhs, double rhs) {
+			if constexpr (code == Ast::OpCode::Add) {
+				return lhs + rhs;
+			}
+			else if constexpr (code == Ast::OpCode::Sub) {
+				return lhs - rhs;
+			}
+			else if constexpr (code == Ast::OpCode::Mul) {
+				return lhs * rhs;
+			}
+			else {
+				return lhs / rhs;
+			}
+		}
+
+		template <Ast::OpCode code>
+		void Combine(Lanes& lhs, const Lanes& rhs, int count) {
+			int i = 0;
+#if defined(__AVX2__)
+			const __m256d zero = _mm256_setzero_pd();
+			const __m256d infinity = _mm256_set1_pd(INFINITY);
+			const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+			for (; i + 4 <= count; i += 4) {
+				__m256d l = _mm256_loadu_pd(lhs.values + i);
+				__m256d r = _mm256_loadu_pd(rhs.values + i);
+				__m256d result;
+				if constexpr (code == Ast::OpCode::Add) {
+					result = _mm256_add_pd(l, r);
+				}
+				else if constexpr (code == Ast::OpCode::Sub) {
+					result = _mm256_sub_pd(l, r);
+				}
+				else if constexpr (code == Ast::OpCode::Mul) {
+					result = _mm256_mul_pd(l, r);
+				}
+				else {
+					result = _mm256_div_pd(l, r);
+				}
+				__m256d bad = _mm256_cmp_pd(_mm256_and_pd(result, abs_mask), infinity, _CMP_NLT_UQ);
+				if constexpr (code == Ast::OpCode::Div) {
+					bad = _mm256_or_pd(bad, _mm256_cmp_pd(r, zero, _CMP_EQ_OQ));
+				}
+				_mm256_storeu_pd(lhs.values + i, result);
+
+				uint32_t operand_errors = 0;
+				uint32_t rhs_errors = 0;
+				std::memcpy(&operand_errors, lhs.errors + i, 4);
+				std::memcpy(&rhs_errors, rhs.errors + i, 4);
+				int bad_mask = _mm256_movemask_pd(bad);
+				if ((operand_errors | rhs_errors) != 0 || bad_mask != 0) {
+					for (int lane = 0; lane < 4; ++lane) {
+						MergeLaneError(lhs, rhs, i + lane, (bad_mask >> lane) & 1);
+					}
+				}
+			}
+#elif defined(VECTORIZED_SSE2)
+			const __m128d zero = _mm_setzero_pd();
+			const __m128d infinity = _mm_set1_pd(INFINITY);
+			const __m128d abs_mask = _mm_castsi128_pd(_mm_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+			for (; i + 2 <= count; i += 2) {
+				__m128d l = _mm_loadu_pd(lhs.values + i);
+				__m128d r = _mm_loadu_pd(rhs.values + i);
+				__m128d result;
+				if constexpr (code == Ast::OpCode::Add) {
+					result = _mm_add_pd(l, r);
+				}
+				else if constexpr (code == Ast::OpCode::Sub) {
+					result = _mm_sub_pd(l, r);
+				}
+				else if constexpr (code == Ast::OpCode::Mul) {
+					result = _mm_mul_pd(l, r);
+				}
+				else {
+					result = _mm_div_pd(l, r);
+				}
+				__m128d bad = _mm_cmpnlt_pd(_mm_and_pd(result, abs_mask), infinity);
+				if constexpr (code == Ast::OpCode::Div) {
+					bad = _mm_or_pd(bad, _mm_cmpeq_pd(r, zero));
+				}
+				_mm_storeu_pd(lhs.values + i, result);
+
+				uint16_t operand_errors = 0;
+				uint16_t rhs_errors = 0;
+				std::memcpy(&operand_errors, lhs.errors + i, 2);
+				std::memcpy(&rhs_errors, rhs.errors + i, 2);
+				int bad_mask = _mm_movemask_pd(bad);
+				if ((operand_errors | rhs_errors) != 0 || bad_mask != 0) {
+					for (int lane = 0; lane < 2; ++lane) {
+						MergeLaneError(lhs, rhs, i + lane, (bad_mask >> lane) & 1);
+					}
+				}
+			}
+#endif
+			for (; i < count; ++i) {
+				double result = Apply<code>(lhs.values[i], rhs.values[i]);
+				bool bad = !std::isfinite(result);
+				if constexpr (code == Ast::OpCode::Div) {
+					bad = bad || rhs.values[i] == 0;
+				}
+				lhs.values[i] = result;
+				MergeLaneError(lhs, rhs, i, bad);
+			}
+		}
+
+		void Negate(Lanes& operand, int count) {
+			for (int i = 0; i < count; ++i) {
+				operand.values[i] = -operand.values[i];
+			}
+		}
+
+		size_t GetStackDepth(const std::vector<Ast::Instruction>& program) {
+			size_t depth = 0;
+			size_t max_depth = 0;
+			for (const auto& instruction : program) {
+				switch (instruction.code) {
+				case Ast::OpCode::PushValue:
+				case Ast::OpCode::PushCell:
+					max_depth = std::max(max_depth, ++depth);
+					break;
+				case Ast::OpCode::Negate:
+					break;
+				default:
+					--depth;
+				}
+			}
+			return max_depth;
+		}
+
+		void EvaluateChunk(const std::vector<Ast::Instruction>& program, const ISheet& sheet,
+			Position first_anchor, int count, std::vector<Lanes>& stack) {
+			size_t top = 0;
+			for (const auto& instruction : program) {
+				switch (instruction.code) {
+				case Ast::OpCode::PushValue:
+					Broadcast(instruction.value, count, stack[top++]);
+					break;
+				case Ast::OpCode::PushCell:
+					Gather(sheet, Ast::Resolve(first_anchor, instruction.offset), count, stack[top++]);
+					break;
+				case Ast::OpCode::Negate:
+					Negate(stack[top - 1], count);
+					break;
+				case Ast::OpCode::Add:
+					--top;
+					Combine<Ast::OpCode::Add>(stack[top - 1], stack[top], count);
+					break;
+				case Ast::OpCode::Sub:
+					--top;
+					Combine<Ast::OpCode::Sub>(stack[top - 1], stack[top], count);
+					break;
+				case Ast::OpCode::Mul:
+					--top;
+					Combine<Ast::OpCode::Mul>(stack[top - 1], stack[top], count);
+					break;
+				case Ast::OpCode::Div:
+					--top;
+					Combine<Ast::OpCode::Div>(stack[top - 1], stack[top], count);
+					break;
+				}
+			}
+		}
+	}
+
+	uint8_t ToErrorCode(FormulaError error) {
+		return static_cast<uint8_t>(error.GetCategory()) + 1;
+	}
+
+	FormulaError FromErrorCode(uint8_t code) {
+		return static_cast<FormulaError::Category>(code - 1);
+	}
+
+	void EvaluateRun(const std::vector<Ast::Instruction>& program, const ISheet& sheet,
+		Position first_anchor, int count, double* values, uint8_t* errors) {
+		std::vector<Lanes> stack(std::max<size_t>(GetStackDepth(program), 1));
+		for (int chunk_begin = 0; chunk_begin < count; chunk_begin += kChunkSize) {
+			int chunk_size = std::min(kChunkSize, count - chunk_begin);
+			Position chunk_anchor{ first_anchor.row + chunk_begin, first_anchor.col };
+			EvaluateChunk(program, sheet, chunk_anchor, chunk_size, stack);
+			std::copy(stack[0].values, stack[0].values + chunk_size, values + chunk_begin);
+			std::copy(stack[0].errors, stack[0].errors + chunk_size, errors + chunk_begin);
+		}
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include "common.h"
+#include "statement.h"
+
+// Вычисление серии формул с общим шаблоном, расположенных подряд в одном
+// столбце: операнды собираются в плотные массивы и обрабатываются SIMD
+namespace Vectorized {
+	inline constexpr uint8_t kNoError = 0;
+
+	uint8_t ToErrorCode(FormulaError error);
+	FormulaError FromErrorCode(uint8_t code);
+
+	// values[i] и errors[i] получают результат формулы с якорем
+	// { first_anchor.row + i, first_anchor.col }
+	void EvaluateRun(const std::vector<Ast::Instruction>& program, const ISheet& sheet,
+		Position first_anchor, int count, double* values, uint8_t* errors);
+}